@@ -79,6 +79,24 @@ Eigen::Matrix<double,6,6> hogmanCov2EnvireCov( const Matrix6& hogman_matrix )
     return t1;
 }
 
+void hogman2Eigen( const std::vector<AISNavigation::PoseGraph3D::Vertex*>& vertices, 
+	Affine3dVector& transforms, Matrix6dVector& covariances )
+{
+    transforms.resize( vertices.size() );
+    covariances.resize( vertices.size() );
+    for( size_t i = 0; i < vertices.size(); i++ )
+    {
+	transforms[i] = hogman2Eigen( vertices[i]->transformation );
+
+	// swapping the [t r] blocks is a shift of both indices by three
+	const Matrix6 &hogman_matrix = vertices[i]->covariance;
+	Eigen::Matrix<double,6,6> &covariance = covariances[i];
+	for( int m=0; m<6; m++ )
+	    for( int n=0; n<6; n++ )
+		covariance(m,n) = hogman_matrix[(m+3)%6][(n+3)%6];
+    }
+}
+
 }
 
 
@@ -2,8 +2,10 @@
 #define GRAPH_SLAM_HOGMAN2EIGEN_HPP__
 
 #include <aislib/graph_optimizer/graph_optimizer3d_hchol.h>
+#include <vector>
 #include <Eigen/Core>
 #include <Eigen/Geometry>
+#include <Eigen/StdVector>
 
 namespace graph_slam
 {
@@ -28,6 +30,17 @@ Matrix6 envireCov2HogmanInf( const Eigen::Matrix<double,6,6>& eigen_matrix );
  */
 Eigen::Matrix<double,6,6> hogmanCov2EnvireCov( const Matrix6& hogman_matrix );
 
+typedef std::vector<Eigen::Affine3d, Eigen::aligned_allocator<Eigen::Affine3d> > Affine3dVector;
+typedef std::vector<Eigen::Matrix<double,6,6>, Eigen::aligned_allocator<Eigen::Matrix<double,6,6> > > Matrix6dVector;
+
+/** 
+ * Convert the poses and covariances of several hogman vertices at once.
+ * The covariances are reordered to the envire [r t] order directly, 
+ * without intermediate matrices.
+ */
+void hogman2Eigen( const std::vector<AISNavigation::PoseGraph3D::Vertex*>& vertices, 
+	Affine3dVector& transforms, Matrix6dVector& covariances );
+
 }
 
 #endif
@@ -2,49 +2,12 @@
 #include "VisualSensorMaps.hpp"
 
 #include <envire/maps/MLSGrid.hpp>
+#include <boost/bind.hpp>
+#include <algorithm>
+#include <cmath>
 
 namespace graph_slam
 {
-    void mergeMap( 
-	    envire::Operator* mergeOperator,
-	    envire::Layer* map_,
-	    envire::FrameNode* fn,
-	    double z_error = 0.0,
-	    size_t num_steps = 0 )
-    {
-	envire::MLSGrid* map = dynamic_cast<envire::MLSGrid*>( map_ );
-	assert( map );
-
-	envire::Environment *env = fn->getEnvironment();
-	envire::MLSGrid* grid = map->clone();
-
-	// attach to framenode and operator
-	env->setFrameNode( grid, fn );
-	mergeOperator->addInput( grid );
-
-	if( num_steps > 0 )
-	{
-	    // perform z-height correction
-	    // on all grid cells
-	    for(size_t m=0;m<grid->getWidth();m++)
-	    {
-		for(size_t n=0;n<grid->getHeight();n++)
-		{
-		    for( envire::MLSGrid::iterator cit = grid->beginCell(m,n); cit != grid->endCell(); cit++ )
-		    {
-			envire::MLSGrid::SurfacePatch p( *cit );
-			size_t uidx = p.update_idx;
-			// linear distribution of error
-			double error = z_error * (double)uidx / (double)num_steps;
-			p.mean -= error;
-		    }
-		}
-	    }
-	}
-
-	grid->itemModified();
-    }
-
     class MapSegmentSensorMaps : public SensorMaps
     {
 	VisualSensorMaps vm;
@@ -83,8 +46,11 @@ namespace graph_slam
 	}
     };
 
+    /** number of grid rows corrected by one task */
+    static const size_t merge_tile_rows = 32;
+
     MapSegmentPoseGraph::MapSegmentPoseGraph( envire::Environment* env )
-	: PoseGraph( env )
+	: PoseGraph( env ), z_error_tolerance( 0.001 )
     {
     }
 
@@ -123,11 +89,17 @@ namespace graph_slam
 	// in case the mergeOperator is set
 	if( mergeOperator )
 	{
-	    // clear inputs first
+	    // clear the inputs first, except the merged maps which are kept
+	    mergedMaps.resize( segments.size() );
+	    std::set<envire::Layer*> merged;
+	    for( size_t i=0; i<mergedMaps.size(); i++ )
+		if( mergedMaps[i].grid )
+		    merged.insert( mergedMaps[i].grid.get() );
 	    std::list<envire::Layer*> inputs =
 		env->getInputs( mergeOperator.get() );
 	    for( std::list<envire::Layer*>::iterator it = inputs.begin(); it != inputs.end(); it++ )
-		(*it)->detach();
+		if( !merged.count( *it ) )
+		    (*it)->detach();
 
 	    Eigen::Affine3d prevPose;
 	    for( size_t i=0; i<segments.size(); i++ )
@@ -151,7 +123,7 @@ namespace graph_slam
 		    // and add as input
 		    //mergeOperator->addInput( map );
 		    mergeMap( 
-			    mergeOperator.get(),
+			    mergedMaps[i-1],
 			    map,
 			    segments[i-1]->getFrameNode(),
 			    pose2prevPose.translation().z() - map_pose.translation().z(),
@@ -171,7 +143,7 @@ namespace graph_slam
 		    segments.back()->getBestMap();
 		//mergeOperator->addInput( map ); 
 		mergeMap( 
-			mergeOperator.get(),
+			mergedMaps.back(),
 			map,
 			segments.back()->getFrameNode() );
 	    }
@@ -183,6 +155,75 @@ namespace graph_slam
     void MapSegmentPoseGraph::setMergeOperator( envire::Operator* op )
     {
 	mergeOperator = op;
+	// the merged maps are inputs of the previous operator
+	mergedMaps.clear();
+    }
+
+    void MapSegmentPoseGraph::mergeMap( 
+	    MergedMap& merged,
+	    envire::CartesianMap* source,
+	    envire::FrameNode* fn,
+	    double z_error,
+	    size_t num_steps )
+    {
+	// the correction already contained in the merged map
+	double applied_error = merged.z_error;
+
+	if( !merged.grid || merged.source != source || merged.num_steps != num_steps )
+	{
+	    envire::MLSGrid* map = dynamic_cast<envire::MLSGrid*>( source );
+	    assert( map );
+
+	    if( merged.grid )
+		merged.grid->detach();
+	    merged.grid = map->clone();
+	    merged.source = source;
+	    merged.num_steps = num_steps;
+	    applied_error = 0.0;
+
+	    // attach to framenode and operator
+	    env->setFrameNode( merged.grid.get(), fn );
+	    mergeOperator->addInput( merged.grid.get() );
+	}
+	else if( std::abs( z_error - applied_error ) <= z_error_tolerance )
+	{
+	    // the merged map is still valid
+	    return;
+	}
+
+	// only the difference to the applied correction is distributed
+	if( num_steps > 0 )
+	    correctHeights( merged.grid.get(), z_error - applied_error, num_steps );
+	merged.z_error = z_error;
+
+	merged.grid->itemModified();
+    }
+
+    void MapSegmentPoseGraph::correctHeights( envire::MLSGrid* grid, double z_error, size_t num_steps )
+    {
+	// the cells of different tiles are independent
+	size_t tiles = (grid->getHeight() + merge_tile_rows - 1) / merge_tile_rows;
+	thread_pool->parallelFor( tiles, 
+		boost::bind( &MapSegmentPoseGraph::correctHeightsTask, this, grid, z_error, num_steps, _1 ) );
+    }
+
+    void MapSegmentPoseGraph::correctHeightsTask( envire::MLSGrid* grid, double z_error, size_t num_steps, size_t tile )
+    {
+	size_t end = std::min<size_t>( (tile + 1) * merge_tile_rows, grid->getHeight() );
+	for(size_t n=tile * merge_tile_rows;n<end;n++)
+	{
+	    for(size_t m=0;m<grid->getWidth();m++)
+	    {
+		for( envire::MLSGrid::iterator cit = grid->beginCell(m,n); cit != grid->endCell(); cit++ )
+		{
+		    envire::MLSGrid::SurfacePatch &p( *cit );
+		    size_t uidx = p.update_idx;
+		    // linear distribution of error
+		    double error = z_error * (double)uidx / (double)num_steps;
+		    p.mean -= error;
+		}
+	    }
+	}
     }
 
     SensorMaps* MapSegmentPoseGraph::createSensorMaps( envire::FrameNode* fn )
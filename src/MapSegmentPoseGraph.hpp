@@ -3,6 +3,7 @@
 
 #include <graph_slam/PoseGraph.hpp>
 #include <envire/maps/MapSegment.hpp>
+#include <envire/maps/MLSGrid.hpp>
 
 namespace graph_slam
 {
@@ -31,10 +32,45 @@ public:
     void setMergeOperator( envire::Operator* op );
 
 protected:
+    /** corrected copy of the selected map of a segment, 
+     * which is an input of the merge operator
+     */
+    struct MergedMap
+    {
+	envire::MLSGrid::Ptr grid;
+	envire::CartesianMap* source;
+	double z_error;
+	size_t num_steps;
+	MergedMap() : source( NULL ), z_error( 0.0 ), num_steps( 0 ) {}
+    };
+
     std::vector<envire::MapSegment::Ptr> segments; 
     SensorMaps* createSensorMaps( envire::FrameNode* fn );
 
+    /** @brief update the merged map of a segment
+     *
+     * The copy of the source map is only created again if another map has
+     * been selected. Otherwise only the change of the z-error is applied to
+     * the existing copy, if it is above the tolerance.
+     */
+    void mergeMap( MergedMap& merged, envire::CartesianMap* source, envire::FrameNode* fn, 
+	    double z_error = 0.0, size_t num_steps = 0 );
+
+    /** @brief distribute a z-error linearly over the patches of a grid,
+     * using their update index
+     */
+    void correctHeights( envire::MLSGrid* grid, double z_error, size_t num_steps );
+
+    /** task of the parallel height correction, corrects the rows of a tile */
+    void correctHeightsTask( envire::MLSGrid* grid, double z_error, size_t num_steps, size_t tile );
+
     envire::Operator::Ptr mergeOperator;
+
+    /** merged maps, indexed by segment */
+    std::vector<MergedMap> mergedMaps;
+
+    /** changes of the z-error below this tolerance don't update a merged map */
+    double z_error_tolerance;
 };
 
 }
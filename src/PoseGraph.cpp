@@ -1,6 +1,8 @@
 #include "PoseGraph.hpp"
 #include <base-logging/Logging.hpp>
 #include "Hogman2Eigen.hpp"
+#include <cmath>
+#include <boost/bind.hpp>
 
 namespace graph_slam 
 {
@@ -13,8 +15,9 @@ struct OptimizerImpl
 };
 
 PoseGraph::PoseGraph( envire::Environment* env, int num_levels, int node_distance ) 
-    : max_node_radius( 25.0 ),
-    env( env ), optimizer( new OptimizerImpl ) 
+    : max_node_radius( 25.0 ), index_cell_size( 10.0 ), max_index_cells( 1024 ),
+    translation_tolerance( 0.0001 ), rotation_tolerance( 0.00001 ), covariance_tolerance( 0.01 ),
+    env( env ), optimizer( new OptimizerImpl ), thread_pool( new ThreadPool( 1 ) ) 
 {
     optimizer->hogman = 
 	new AISNavigation::HCholOptimizer3D( num_levels, node_distance );
@@ -73,22 +76,54 @@ void PoseGraph::addConstraint( const envire::FrameNode* fn1, const envire::Frame
 
 void PoseGraph::associateNode( envire::FrameNode* update_fn )
 {
-    for( std::map<std::string, SensorMaps*>::iterator it = nodeMap.begin();
-	    it != nodeMap.end(); it++ )
+    // the maps of the node might have changed since it was indexed
+    SensorMaps *update_sm = getSensorMaps( update_fn );
+    updateBoundsIndex( update_sm );
+
+    // only the nodes with overlapping bounding boxes are considered
+    std::map<long, SensorMaps*> candidates;
+    queryBoundsIndex( update_sm->bounds, candidates );
+    std::vector<SensorMaps*> pending;
+    for( std::map<long, SensorMaps*>::iterator it = candidates.begin();
+	    it != candidates.end(); it++ )
     {
 	envire::FrameNode *fn = it->second->frameNode.get();
 	// don't associate with self
-	if( update_fn != fn )
-	{
-	    bool result = associateNodes( fn, update_fn ); 
+	if( update_fn == fn )
+	    continue;
 
+	bool result;
+	if( needsAssociation( it->second, update_sm, result ) )
+	    pending.push_back( it->second );
+	else
 	    LOG_INFO_S << "associate node " 
 		<< fn->getUniqueIdNumericalSuffix() 
 		<< " with " 
 		<< update_fn->getUniqueIdNumericalSuffix() << "... "
 		<< (result ? "match" : "no match");
-	}
     }
+
+    // the associations only read the maps, so they can run in parallel.
+    // The constraints are added afterwards in the order of the candidates.
+    std::vector<std::vector<envire::TransformWithUncertainty> > constraints( pending.size() );
+    thread_pool->parallelFor( pending.size(), 
+	    boost::bind( &PoseGraph::associateTask, this, &pending, update_sm, &constraints, _1 ) );
+    for( size_t i = 0; i < pending.size(); i++ )
+    {
+	bool result = addAssociation( pending[i], update_sm, constraints[i] );
+
+	LOG_INFO_S << "associate node " 
+	    << pending[i]->frameNode->getUniqueIdNumericalSuffix() 
+	    << " with " 
+	    << update_fn->getUniqueIdNumericalSuffix() << "... "
+	    << (result ? "match" : "no match");
+    }
+}
+
+void PoseGraph::setWorkerThreadCount( unsigned threads )
+{
+    if( threads != thread_pool->getThreadCount() )
+	thread_pool.reset( new ThreadPool( threads ) );
 }
 
 void PoseGraph::optimizeNodes( int iterations )
@@ -96,30 +131,59 @@ void PoseGraph::optimizeNodes( int iterations )
     // perform the graph optimization
     optimizer->hogman->optimize( iterations, false );
 
-    // write the poses back to the environment
-    // for now, write all the poses back, could add an updated flag
+    // get the poses with uncertainty of all nodes from Hogman at once
+    std::vector<SensorMaps*> maps;
+    std::vector<AISNavigation::PoseGraph3D::Vertex*> vertices;
+    maps.reserve( nodeMap.size() );
+    vertices.reserve( nodeMap.size() );
     for( std::map<std::string, SensorMaps*>::iterator it = nodeMap.begin();
 	    it != nodeMap.end(); it++ )
     {
-	SensorMaps *sm = it->second;
-	AISNavigation::PoseGraph3D::Vertex 
-	    *vertex = optimizer->hogman->vertex( sm->vertexId );
-
-	// get pose with uncertainty from Hogman
-	envire::TransformWithUncertainty tu( 
-		hogman2Eigen( vertex->transformation ), 
-		hogmanCov2EnvireCov( vertex->covariance ) );
+	maps.push_back( it->second );
+	vertices.push_back( optimizer->hogman->vertex( it->second->vertexId ) );
+    }
+    Affine3dVector transforms;
+    Matrix6dVector covariances;
+    hogman2Eigen( vertices, transforms, covariances );
 
+    // write the poses back to the environment, updating the bounds is 
+    // expensive, so only the nodes which have changed are written back
+    for( size_t i = 0; i < maps.size(); i++ )
+    {
+	SensorMaps *sm = maps[i];
 	envire::FrameNode::Ptr fn = sm->frameNode; 
-	fn->setTransform( tu );
+	if( !hasChanged( fn->getTransformWithUncertainty(), transforms[i], covariances[i] ) )
+	    continue;
 
-	// update the bounds 
-	// TODO this could be optimized, as it may be to expensive to 
-	// update the bounds everytime we have a small change in position
-	sm->update();
+	fn->setTransform( envire::TransformWithUncertainty( transforms[i], covariances[i] ) );
+
+	// the extents of the maps are local and don't change with the pose
+	sm->updateBounds();
+	updateBoundsIndex( sm );
     }
 }
 
+void PoseGraph::setUpdateTolerances( double translation_tolerance, double rotation_tolerance, double covariance_tolerance )
+{
+    this->translation_tolerance = translation_tolerance;
+    this->rotation_tolerance = rotation_tolerance;
+    this->covariance_tolerance = covariance_tolerance;
+}
+
+bool PoseGraph::hasChanged( const envire::TransformWithUncertainty& current, 
+	const Eigen::Affine3d& transform, const Eigen::Matrix<double,6,6>& covariance ) const
+{
+    // the poses are compared to the ones in the FrameNodes, so small changes can't add up unnoticed
+    const Eigen::Affine3d current_transform = current.getTransform();
+    if( (current_transform.translation() - transform.translation()).norm() > translation_tolerance )
+	return true;
+    Eigen::AngleAxisd rotation_delta( Eigen::Matrix3d(current_transform.linear().transpose() * transform.linear()) );
+    if( std::abs( rotation_delta.angle() ) > rotation_tolerance )
+	return true;
+    const Eigen::Matrix<double,6,6> current_covariance = current.getCovariance();
+    return (current_covariance - covariance).norm() > covariance_tolerance * current_covariance.norm();
+}
+
 
 /** will return a sensormaps structure for a given 
  * framenode. creates a new one, if not already existing.
@@ -143,6 +207,7 @@ SensorMaps* PoseGraph::getSensorMaps( envire::FrameNode* fn )
     // call update bounds once, so we have an initial
     // idea of the bounds
     sm->update();
+    updateBoundsIndex( sm );
 
     return sm;
 }
@@ -155,40 +220,161 @@ SensorMaps* PoseGraph::getSensorMaps( envire::FrameNode* fn )
  */ 
 bool PoseGraph::associateNodes( envire::FrameNode* a, envire::FrameNode* b )
 {
+    // get the sensor map objects for both frameNodes
+    SensorMaps 
+	*sma = getSensorMaps( a ), 
+	*smb = getSensorMaps( b );
+
+    bool result;
+    if( !needsAssociation( sma, smb, result ) )
+	return result;
+
+    std::vector<envire::TransformWithUncertainty> constraints;
+    sma->associate( smb, constraints );
+    return addAssociation( sma, smb, constraints );
+}
+
+bool PoseGraph::needsAssociation( SensorMaps* sma, SensorMaps* smb, bool& result ) const
+{
+    result = false;
+
     // discard if distance between is too high
     // TODO: this is potentially dangerous as it doesn't take the
     // uncertainty into account... see how to make this safer, but still
     // fast.
-    if( (a->getTransform().translation() - b->getTransform().translation()).norm() > max_node_radius )
+    if( (sma->frameNode->getTransform().translation() - smb->frameNode->getTransform().translation()).norm() > max_node_radius )
 	return false;
 
-    // get the sensor map objects for both frameNodes
-    SensorMaps 
-	*sma = getSensorMaps( a ), 
-	*smb = getSensorMaps( b );
-
     // check if the bounding boxes have a common intersection
     // and return false if not
     if( sma->bounds.intersection( smb->bounds ).isEmpty() )
 	return false;
 
-    std::vector<envire::TransformWithUncertainty> constraints;
-    sma->associate( smb, constraints );
+    // each pair of nodes is only associated once, since the maps 
+    // of the nodes don't change and the result would be the same
+    std::map<std::pair<long, long>, bool>::const_iterator 
+	memo = associations.find( associationKey( sma, smb ) );
+    if( memo != associations.end() )
+    {
+	result = memo->second;
+	return false;
+    }
+
+    return true;
+}
+
+bool PoseGraph::addAssociation( SensorMaps* sma, SensorMaps* smb, const std::vector<envire::TransformWithUncertainty>& constraints )
+{
     for( size_t i = 0; i < constraints.size(); i++ )
     {
 	// add the egde to the optimization framework 
 	// this will update an existing edge
 	optimizer->hogman->addEdge( 
-		optimizer->hogman->vertex( a->getUniqueIdNumericalSuffix() ),
-		optimizer->hogman->vertex( b->getUniqueIdNumericalSuffix() ),
+		optimizer->hogman->vertex( sma->vertexId ),
+		optimizer->hogman->vertex( smb->vertexId ),
 		eigen2Hogman( constraints[i].getTransform() ),
 		envireCov2HogmanInf( constraints[i].getCovariance() )
 		);
     }
 
-    // TODO store both successful and unsuccessful associations
-    // since it doesn't make sense to try to associate twice
+    associations[associationKey( sma, smb )] = !constraints.empty();
     return !constraints.empty();
 }
 
+std::pair<long, long> PoseGraph::associationKey( const SensorMaps* sma, const SensorMaps* smb )
+{
+    return sma->vertexId < smb->vertexId ? 
+	std::make_pair( sma->vertexId, smb->vertexId ) : std::make_pair( smb->vertexId, sma->vertexId );
+}
+
+void PoseGraph::associateTask( const std::vector<SensorMaps*>* maps, SensorMaps* update_sm, 
+	std::vector<std::vector<envire::TransformWithUncertainty> >* constraints, size_t index )
+{
+    (*maps)[index]->associate( update_sm, (*constraints)[index] );
+}
+
+void PoseGraph::updateBoundsIndex( SensorMaps* sm )
+{
+    // remove the previous bounds
+    std::map<SensorMaps*, CellRange>::iterator 
+	f = indexedRanges.find( sm );
+    if( f != indexedRanges.end() )
+    {
+	const CellRange &range = f->second;
+	if( range.oversized )
+	    oversizedBounds.erase( sm );
+	else
+	{
+	    for( int x = range.min_x; x <= range.max_x; x++ )
+	    {
+		for( int y = range.min_y; y <= range.max_y; y++ )
+		{
+		    std::map<std::pair<int, int>, std::set<SensorMaps*> >::iterator 
+			cell = boundsIndex.find( std::make_pair( x, y ) );
+		    cell->second.erase( sm );
+		    if( cell->second.empty() )
+			boundsIndex.erase( cell );
+		}
+	    }
+	}
+	indexedRanges.erase( f );
+    }
+
+    // nodes without bounds can't overlap with other nodes
+    if( sm->bounds.isEmpty() )
+	return;
+
+    CellRange range;
+    range.min_x = floor( sm->bounds.min().x() / index_cell_size );
+    range.min_y = floor( sm->bounds.min().y() / index_cell_size );
+    range.max_x = floor( sm->bounds.max().x() / index_cell_size );
+    range.max_y = floor( sm->bounds.max().y() / index_cell_size );
+    range.oversized = 
+	(double)(range.max_x - range.min_x + 1) * (range.max_y - range.min_y + 1) > max_index_cells;
+
+    if( range.oversized )
+	oversizedBounds.insert( sm );
+    else
+    {
+	for( int x = range.min_x; x <= range.max_x; x++ )
+	    for( int y = range.min_y; y <= range.max_y; y++ )
+		boundsIndex[std::make_pair( x, y )].insert( sm );
+    }
+    indexedRanges.insert( std::make_pair( sm, range ) );
+}
+
+void PoseGraph::queryBoundsIndex( const Eigen::AlignedBox<double, 3>& bounds, std::map<long, SensorMaps*>& result ) const
+{
+    result.clear();
+    if( bounds.isEmpty() )
+	return;
+
+    for( std::set<SensorMaps*>::const_iterator it = oversizedBounds.begin(); it != oversizedBounds.end(); it++ )
+	result.insert( std::make_pair( (*it)->vertexId, *it ) );
+
+    int min_x = floor( bounds.min().x() / index_cell_size );
+    int min_y = floor( bounds.min().y() / index_cell_size );
+    int max_x = floor( bounds.max().x() / index_cell_size );
+    int max_y = floor( bounds.max().y() / index_cell_size );
+    // a query larger than the index is answered by all indexed nodes
+    if( (double)(max_x - min_x + 1) * (max_y - min_y + 1) > boundsIndex.size() )
+    {
+	for( std::map<SensorMaps*, CellRange>::const_iterator it = indexedRanges.begin(); it != indexedRanges.end(); it++ )
+	    result.insert( std::make_pair( it->first->vertexId, it->first ) );
+	return;
+    }
+    for( int x = min_x; x <= max_x; x++ )
+    {
+	for( int y = min_y; y <= max_y; y++ )
+	{
+	    std::map<std::pair<int, int>, std::set<SensorMaps*> >::const_iterator 
+		cell = boundsIndex.find( std::make_pair( x, y ) );
+	    if( cell == boundsIndex.end() )
+		continue;
+	    for( std::set<SensorMaps*>::const_iterator it = cell->second.begin(); it != cell->second.end(); it++ )
+		result.insert( std::make_pair( (*it)->vertexId, *it ) );
+	}
+    }
+}
+
 }
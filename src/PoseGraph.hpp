@@ -1,8 +1,12 @@
 #ifndef __GRAPH_SLAM_POSE_GRAPH_HPP__
 #define __GRAPH_SLAM_POSE_GRAPH_HPP__
 
+#include <map>
+#include <set>
 #include <envire/Core.hpp>
 #include <graph_slam/SensorMaps.hpp>
+#include <graph_slam/thread_pool.hpp>
+#include <boost/shared_ptr.hpp>
 
 namespace graph_slam
 {
@@ -18,11 +22,45 @@ protected:
      */
     double max_node_radius;
 
+    /** edge length of the cells of the bounds index in the xy-plane
+     */
+    double index_cell_size;
+
+    /** maximum number of cells a node is inserted into. Nodes with larger
+     * bounds are kept in a separate list, which is always checked.
+     */
+    size_t max_index_cells;
+
+    /** tolerances below which an optimized node is not written back */
+    double translation_tolerance;
+    double rotation_tolerance;
+    double covariance_tolerance;
+
 protected:
     envire::Environment *env;
     OptimizerImpl *optimizer;
     std::map<std::string, SensorMaps*> nodeMap;
 
+    /** outcome of each pair of nodes, which has already been associated.
+     * The key is the pair of vertex ids, with the smaller id first.
+     */
+    std::map<std::pair<long, long>, bool> associations;
+
+    /** range of cells covered by the bounds of a node */
+    struct CellRange
+    {
+	int min_x, min_y, max_x, max_y;
+	bool oversized;
+    };
+
+    /** spatial index over the bounds of the nodes */
+    std::map<std::pair<int, int>, std::set<SensorMaps*> > boundsIndex;
+    std::set<SensorMaps*> oversizedBounds;
+    std::map<SensorMaps*, CellRange> indexedRanges;
+
+    /** workers of the parallel association */
+    boost::shared_ptr<ThreadPool> thread_pool;
+
 public:
     /** @brief Constructor for PoseGraph 
      *
@@ -66,11 +104,29 @@ public:
      */
     void associateNode( envire::FrameNode* fn );
 
+    /** @brief set the number of threads used to associate a node with
+     * the candidate nodes. 
+     *
+     * With more than one thread SensorMaps::associate is called concurrently
+     * for different nodes with the same new node. The default is one thread.
+     */
+    void setWorkerThreadCount( unsigned threads );
+
     /** @brief will run the graph optimization and write the results back 
      * to the FrameNodes
      */
     void optimizeNodes( int iterations = 5 );
 
+    /** @brief set the tolerances, below which a node is not considered as changed
+     * by the optimization. Only changed nodes are written back to their FrameNodes
+     * and get their bounds updated.
+     *
+     * @param translation_tolerance translation tolerance in meters
+     * @param rotation_tolerance rotation tolerance in radians
+     * @param covariance_tolerance tolerance of the relative change of the covariance
+     */
+    void setUpdateTolerances( double translation_tolerance, double rotation_tolerance, double covariance_tolerance );
+
     /** @will return a sensormaps structure for a given 
      * framenode. creates a new one, if not already existing.
      */
@@ -85,6 +141,50 @@ protected:
      */ 
     bool associateNodes( envire::FrameNode* a, envire::FrameNode* b );
 
+    /** 
+     * @brief check if two nodes have to be associated. 
+     *
+     * @param result the outcome, if no association is needed
+     * @return false if the nodes are too far apart, if their bounding 
+     *         boxes don't intersect or if they have been associated before
+     */
+    bool needsAssociation( SensorMaps* sma, SensorMaps* smb, bool& result ) const;
+
+    /** 
+     * @brief add the constraints found by the association of two nodes
+     * to the graph and remember the outcome
+     *
+     * @return true if an association has been added
+     */
+    bool addAssociation( SensorMaps* sma, SensorMaps* smb, const std::vector<envire::TransformWithUncertainty>& constraints );
+
+    /** key of a pair of nodes in the associations */
+    static std::pair<long, long> associationKey( const SensorMaps* sma, const SensorMaps* smb );
+
+    /** task of the parallel association, associates the node with the given index with update_sm */
+    void associateTask( const std::vector<SensorMaps*>* maps, SensorMaps* update_sm, 
+	    std::vector<std::vector<envire::TransformWithUncertainty> >* constraints, size_t index );
+
+    /** 
+     * @brief insert the current bounds of a node into the spatial index,
+     * replacing its previous bounds
+     */
+    void updateBoundsIndex( SensorMaps* sm );
+
+    /** 
+     * @brief check if an optimized pose differs from the current transform of 
+     * a FrameNode by more than the tolerances
+     */
+    bool hasChanged( const envire::TransformWithUncertainty& current, 
+	    const Eigen::Affine3d& transform, const Eigen::Matrix<double,6,6>& covariance ) const;
+
+    /** 
+     * @brief find all nodes whose indexed bounds might overlap the given bounds
+     *
+     * The nodes are ordered by their vertex id.
+     */
+    void queryBoundsIndex( const Eigen::AlignedBox<double, 3>& bounds, std::map<long, SensorMaps*>& result ) const;
+
     /** 
      * @brief create a new SensorMaps structure for the given FrameNode
      *
@@ -25,6 +25,8 @@ public:
      *
      * Any constraints that have been found because the two maps have a
      * relation will be added to the constraints vector.
+     * The PoseGraph may call it concurrently for different maps with the
+     * same argument, so it must not modify either of the maps.
      */
     virtual void associate( SensorMaps *maps, std::vector<envire::TransformWithUncertainty>& constraints ) = 0;
 
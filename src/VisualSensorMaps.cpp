@@ -2,9 +2,66 @@
 #include <stereo/sparse_stereo.hpp>
 #include <envire/icpConfigurationTypes.hpp>
 #include <envire/ransac.hpp>
+#include <boost/thread/mutex.hpp>
 
 namespace graph_slam
 {
+
+/** 
+ * Configured feature matchers, which are reused by all associations.
+ * Concurrent associations take different matchers from the pool, so 
+ * each of them has its own matcher state.
+ */
+class StereoFeaturesPool
+{
+public:
+    ~StereoFeaturesPool()
+    {
+	for( size_t i = 0; i < matchers.size(); i++ )
+	    delete matchers[i];
+    }
+
+    stereo::StereoFeatures* acquire()
+    {
+	boost::mutex::scoped_lock lock( mutex );
+	if( !available.empty() )
+	{
+	    stereo::StereoFeatures *f = available.back();
+	    available.pop_back();
+	    return f;
+	}
+
+	stereo::StereoFeatures *f = new stereo::StereoFeatures();
+	stereo::FeatureConfiguration config;
+	config.isometryFilterThreshold = 1.5;
+	config.distanceFactor = 1.5;
+	config.isometryFilterMaxSteps = 5000;
+	f->setConfiguration( config );
+	matchers.push_back( f );
+	return f;
+    }
+
+    void release( stereo::StereoFeatures* f )
+    {
+	boost::mutex::scoped_lock lock( mutex );
+	available.push_back( f );
+    }
+
+private:
+    boost::mutex mutex;
+    std::vector<stereo::StereoFeatures*> matchers;
+    std::vector<stereo::StereoFeatures*> available;
+};
+
+static StereoFeaturesPool matcher_pool;
+
+/** takes a matcher from the pool for the lifetime of the object */
+struct ScopedStereoFeatures
+{
+    ScopedStereoFeatures() : f( matcher_pool.acquire() ) {}
+    ~ScopedStereoFeatures() { matcher_pool.release( f ); }
+    stereo::StereoFeatures *f;
+};
 VisualSensorMaps::VisualSensorMaps()
     : stereoMap(NULL), 
     sparseMap(NULL), 
@@ -90,17 +147,14 @@ void VisualSensorMaps::associateStereoMap( envire::Pointcloud* pc1, envire::Poin
 
 size_t VisualSensorMaps::associateSparseMap( envire::Featurecloud *fc1, envire::Featurecloud *fc2, std::vector<envire::TransformWithUncertainty>& constraints )
 {
-    stereo::StereoFeatures f;
-    stereo::FeatureConfiguration config;
-    config.isometryFilterThreshold = 1.5;
-    config.distanceFactor = 1.5;
-    config.isometryFilterMaxSteps = 5000;
-    f.setConfiguration( config );
+    // the matcher is already configured and reuses its buffers
+    ScopedStereoFeatures matcher;
+    stereo::StereoFeatures &f( *matcher.f );
 
     f.calculateInterFrameCorrespondences( fc1, fc2, stereo::FILTER_ISOMETRY );
-    std::vector<std::pair<long, long> > matches = f.getInterFrameCorrespondences();
+    size_t correspondences = f.getInterFrameCorrespondences().size();
 
-    if( f.getInterFrameCorrespondences().size() >= min_sparse_correspondences )
+    if( correspondences >= min_sparse_correspondences )
     {
 	Eigen::Affine3d bodyBtoBodyA = f.getInterFrameCorrespondenceTransform();
 
@@ -119,7 +173,7 @@ size_t VisualSensorMaps::associateSparseMap( envire::Featurecloud *fc1, envire::
 	constraints.push_back( envire::TransformWithUncertainty( bodyBtoBodyA, cov ) );
     }
 
-    return f.getInterFrameCorrespondences().size();
+    return correspondences;
 }
 
 void VisualSensorMaps::associate( SensorMaps *maps, std::vector<envire::TransformWithUncertainty>& constraints )
@@ -140,8 +194,8 @@ void VisualSensorMaps::associate( SensorMaps *maps, std::vector<envire::Transfor
     {
 	associateStereoMap( sma->stereoMap, smb->stereoMap, constraints );
     }
-    // TODO store both successful and unsuccessful associations
-    // since it doesn't make sense to try to associate twice
+    // the outcome is remembered by the PoseGraph, so the pair 
+    // isn't associated twice
 }
 
 
@@ -25,6 +25,8 @@ protected:
     
     /** 
      * try to associate two sparse feature clouds.
+     * It only reads the feature clouds and uses its own matcher, so it 
+     * can be called concurrently.
      *
      * @return the number of matching interframe features. This can be used as a measure of quality
      * for the match.
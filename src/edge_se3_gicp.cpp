@@ -1,13 +1,17 @@
 #include "edge_se3_gicp.hpp"
 #include <graph_slam/matrix_helper.hpp>
 #include <graph_slam/pointcloud_helper.hpp>
+#include <graph_slam/instrumentation.hpp>
 #include <pcl/registration/gicp.h>
+#include <pcl/pcl_config.h>
 #include <limits> 
+#include <cmath>
+#include <algorithm>
 
 namespace graph_slam
 {
     
-EdgeSE3_GICP::EdgeSE3_GICP() : EdgeSE3(), run_gicp(true), use_guess_from_state(false), valid_gicp_measurement(false), icp_fitness_score(std::numeric_limits<double>::max())
+EdgeSE3_GICP::EdgeSE3_GICP() : EdgeSE3(), run_gicp(true), use_guess_from_state(false), coarse_to_fine(false), valid_gicp_measurement(false), icp_fitness_score(std::numeric_limits<double>::max())
 {
     setGICPConfiguration(GICPConfiguration());
     
@@ -41,9 +45,122 @@ bool EdgeSE3_GICP::setMeasurementFromGICP(bool delayed)
     // compute current transformation guess
     Eigen::Isometry3d transfomation_guess = source_vertex->estimate().inverse() * target_vertex->estimate();
     
+    Eigen::Isometry3d measurement;
+    Matrix6d information;
+    double fitness_score;
+    if(computeGICPMeasurement(*source_vertex->getGICPPointCloud(), *target_vertex->getGICPPointCloud(), transfomation_guess, gicp_config,
+                              measurement, information, fitness_score, coarse_to_fine))
+    {
+        setGICPMeasurement(measurement, information, fitness_score);
+    }
+    
+    run_gicp = false;
+    return true;
+}
+
+void EdgeSE3_GICP::setGICPMeasurement(const Eigen::Isometry3d& measurement, const Matrix6d& information, double fitness_score)
+{
+    _measurement = measurement;
+    _inverseMeasurement = _measurement.inverse();
+    _information = information;
+    
+    valid_gicp_measurement = true;
+    icp_fitness_score = fitness_score;
+    run_gicp = false;
+}
+
+/** Approximates the information matrix of a converged GICP alignment using the
+ * final correspondences. The Hessian of the GICP cost H = sum(J^T * M * J) is computed 
+ * with J = [I, -[T*p]x] for a perturbation of the aligned pose and M the inverse of 
+ * the combined point covariances. It is scaled by the a-posteriori variance of the 
+ * residuals, since the GICP point covariances have no metric scale.
+ * 
+ * @param source_cloud pointcloud of the source vertex
+ * @param target_cloud pointcloud of the target vertex
+ * @param source_in_target aligned pose of the source in the target frame
+ * @param max_correspondence_distance max distance of corresponding points
+ * @param information information matrix in the error space of the g2o::EdgeSE3
+ * @return false if there are not enough correspondences or the Hessian is ill-conditioned
+ */
+static bool computeCorrespondenceInformation(const VertexSE3_GICP::GICPPointCloud& source_cloud, const VertexSE3_GICP::GICPPointCloud& target_cloud,
+                                             const Eigen::Isometry3d& source_in_target, double max_correspondence_distance, Matrix6d& information)
+{
+    if(!source_cloud.covariances || !target_cloud.covariances || !target_cloud.search_tree || source_cloud.cloud->empty())
+        return false;
+    
+    const unsigned min_correspondences = 10;
+    const Eigen::Matrix3d rotation = source_in_target.linear();
+    const double max_squared_distance = max_correspondence_distance * max_correspondence_distance;
+    Matrix6d hessian = Matrix6d::Zero();
+    double squared_residuals = 0.0;
+    unsigned correspondences = 0;
+    std::vector<int> indices(1);
+    std::vector<float> squared_distances(1);
+    // the source points are transformed at once
+    PointBuffer points;
+    transformPoints(source_cloud.cloud->getMatrixXfMap(3, 4, 0), source_in_target, points);
+    for(unsigned i = 0; i < source_cloud.cloud->size(); i++)
+    {
+        Eigen::Vector3d point = points.col(i);
+        pcl::PointXYZ query(point.x(), point.y(), point.z());
+        if(target_cloud.search_tree->nearestKSearch(query, 1, indices, squared_distances) < 1 || squared_distances[0] > max_squared_distance)
+            continue;
+        
+        Eigen::Vector3d residual = point - target_cloud.cloud->points[indices[0]].getVector3fMap().cast<double>();
+        Eigen::Matrix3d mahalanobis = ((*target_cloud.covariances)[indices[0]] + 
+                                       rotation * (*source_cloud.covariances)[i] * rotation.transpose()).inverse();
+        Eigen::Matrix<double, 3, 6> jacobian;
+        jacobian.leftCols<3>().setIdentity();
+        jacobian.rightCols<3>() << 0.0, point.z(), -point.y(),
+                                   -point.z(), 0.0, point.x(),
+                                   point.y(), -point.x(), 0.0;
+        hessian += jacobian.transpose() * mahalanobis * jacobian;
+        squared_residuals += residual.transpose() * mahalanobis * residual;
+        correspondences++;
+    }
+    
+    if(correspondences < min_correspondences)
+        return false;
+    
+    // a-posteriori variance factor
+    double variance_factor = squared_residuals / (double)(correspondences - 6);
+    if(!(variance_factor > 0.0))
+        return false;
+    hessian /= variance_factor;
+    
+    // check the conditioning of the hessian
+    Eigen::SelfAdjointEigenSolver<Matrix6d> eigen_solver(hessian);
+    if(eigen_solver.info() != Eigen::Success || !(eigen_solver.eigenvalues().minCoeff() > 1e-9 * eigen_solver.eigenvalues().maxCoeff()))
+        return false;
+    
+    // The perturbation of the aligned pose corresponds to a perturbation of the measurement,
+    // which is its inverse. The rotational part of the g2o error is the vector part of a quaternion, 
+    // i.e. half of the rotation angle.
+    Matrix6d D = Matrix6d::Identity();
+    D.bottomRightCorner<3,3>() *= 2.0;
+    information = D * hessian * D;
+    
+    return !is_nan(information);
+}
+
+/** Aligns the source to the target pointcloud using GICP.
+ * 
+ * @param source_cloud pointcloud of the source vertex
+ * @param target_cloud pointcloud of the target vertex
+ * @param guess pose guess of the source in the target frame
+ * @param gicp_config GICP specific configuration
+ * @param max_correspondence_distance max distance of corresponding points
+ * @param transformation resulting pose of the source in the target frame
+ * @param fitness_score resulting GICP fitness score
+ * @return true if GICP has converged
+ */
+static bool alignGICP(const VertexSE3_GICP::GICPPointCloud& source_cloud, const VertexSE3_GICP::GICPPointCloud& target_cloud,
+                      const Eigen::Matrix4f& guess, const GICPConfiguration& gicp_config, double max_correspondence_distance,
+                      Eigen::Matrix4f& transformation, double& fitness_score)
+{
     // config gicp
     pcl::GeneralizedIterativeClosestPoint<pcl::PointXYZ, pcl::PointXYZ> icp;
-    icp.setMaxCorrespondenceDistance(gicp_config.max_correspondence_distance);
+    icp.setMaxCorrespondenceDistance(max_correspondence_distance);
     icp.setMaximumIterations(gicp_config.maximum_iterations);
     icp.setTransformationEpsilon(gicp_config.transformation_epsilon);
     icp.setEuclideanFitnessEpsilon(gicp_config.euclidean_fitness_epsilon);
@@ -51,46 +168,93 @@ bool EdgeSE3_GICP::setMeasurementFromGICP(bool delayed)
     icp.setMaximumOptimizerIterations(gicp_config.maximum_optimizer_iterations);
     icp.setRotationEpsilon(gicp_config.rotation_epsilon);
 
-    // set source cloud
-    icp.setInputSource(source_vertex->getPCLPointCloud());
-
-    // set target cloud
-    typedef pcl::PointCloud<pcl::PointXYZ> PCLPointCloud;
-    typedef typename PCLPointCloud::Ptr PCLPointCloudPtr;
-    PCLPointCloudPtr transformed_target_cloud(new PCLPointCloud);
-    pcl::transformPointCloud(*target_vertex->getPCLPointCloud(), *transformed_target_cloud, Eigen::Affine3d(transfomation_guess));
-    icp.setInputTarget(transformed_target_cloud);
+    // set source and target cloud
+    icp.setInputSource(source_cloud.cloud);
+    icp.setInputTarget(target_cloud.cloud);
+#if PCL_VERSION_COMPARE(>=, 1, 8, 0)
+    // reuse the search tree and covariances computed by the vertices
+    if(target_cloud.search_tree)
+        icp.setSearchMethodTarget(target_cloud.search_tree, true);
+    if(source_cloud.covariances && source_cloud.covariance_neighbors == gicp_config.correspondence_randomness)
+        icp.setSourceCovariances(source_cloud.covariances);
+    if(target_cloud.covariances && target_cloud.covariance_neighbors == gicp_config.correspondence_randomness)
+        icp.setTargetCovariances(target_cloud.covariances);
+#endif
     
     // Perform the alignment
+    GRAPH_SLAM_COUNT(gicp_alignments, 1);
     pcl::PointCloud<pcl::PointXYZ> cloud_source_registered;
-    icp.align(cloud_source_registered);
-    double fitness_score = icp.getFitnessScore();
+    icp.align(cloud_source_registered, guess);
+    fitness_score = icp.getFitnessScore();
+    transformation = icp.getFinalTransformation();
+    return icp.hasConverged();
+}
+
+bool EdgeSE3_GICP::computeGICPMeasurement(const VertexSE3_GICP::GICPPointCloud& source_cloud, const VertexSE3_GICP::GICPPointCloud& target_cloud,
+                                          const Eigen::Isometry3d& transfomation_guess, const GICPConfiguration& gicp_config,
+                                          Eigen::Isometry3d& measurement, Matrix6d& information, double& fitness_score,
+                                          bool coarse_to_fine)
+{
+    GRAPH_SLAM_SCOPED_TIMER(gicp_time);
+    GRAPH_SLAM_COUNT(gicp_calls, 1);
+    if(!source_cloud.cloud || !target_cloud.cloud)
+    {
+        GRAPH_SLAM_COUNT(gicp_failures, 1);
+        return false;
+    }
+    
+    // The source is aligned to the untransformed target, using the inverse guess, 
+    // i.e. the pose of the source in the target frame.
+    Eigen::Matrix4f guess = transfomation_guess.inverse().matrix().cast<float>();
     
-    if(icp.hasConverged() && fitness_score <= gicp_config.max_fitness_score)
+    // refine the guess from the coarsest to the finest resolution level
+    size_t coarse_levels = coarse_to_fine && gicp_config.resolution_levels > 1 ? gicp_config.resolution_levels - 1 : 0;
+    coarse_levels = std::min(coarse_levels, std::min(source_cloud.coarse_levels.size(), target_cloud.coarse_levels.size()));
+    for(size_t level = coarse_levels; level > 0; level--)
     {
-        Eigen::Isometry3f transformation(icp.getFinalTransformation());
+        double max_correspondence_distance = gicp_config.max_correspondence_distance * std::pow(gicp_config.correspondence_distance_scale, (double)level);
+        Eigen::Matrix4f level_transformation;
+        double level_fitness_score;
+        if(alignGICP(*source_cloud.coarse_levels[level-1], *target_cloud.coarse_levels[level-1], guess, gicp_config, 
+                     max_correspondence_distance, level_transformation, level_fitness_score) && !is_nan(level_transformation))
+            guess = level_transformation;
+    }
+    
+    Eigen::Matrix4f final_transformation;
+    bool converged = alignGICP(source_cloud, target_cloud, guess, gicp_config, gicp_config.max_correspondence_distance, final_transformation, fitness_score);
+    
+    if(converged && fitness_score <= gicp_config.max_fitness_score)
+    {
+        Eigen::Isometry3f transformation(final_transformation);
 
         // check for nan values
         if(is_nan(transformation.matrix()))
         {
             std::cerr << "Messurement from ICP contains not numerical values." << std::endl;
+            GRAPH_SLAM_COUNT(gicp_failures, 1);
             return false;
         }
         
-        _measurement = Eigen::Isometry3d(transformation).inverse() * transfomation_guess;
-        _inverseMeasurement = _measurement.inverse();
+        measurement = Eigen::Isometry3d(transformation).inverse();
+        
+        // use the information derived from the final correspondences if possible
+        if(gicp_config.correspondence_based_information && 
+           source_cloud.covariance_neighbors == gicp_config.correspondence_randomness &&
+           target_cloud.covariance_neighbors == gicp_config.correspondence_randomness &&
+           computeCorrespondenceInformation(source_cloud, target_cloud, Eigen::Isometry3d(transformation), 
+                                            gicp_config.max_correspondence_distance, information))
+            return true;
 	
 	// TODO use sampled gicp based covariance per default
 	Eigen::Matrix3d translation_cov = 0.1 * Eigen::Matrix3d::Identity();
 	translation_cov(2,2) = 0.01;
-        _information = (combineToPoseCovariance(translation_cov, 0.005*Eigen::Matrix3d::Identity())).inverse();
+        information = (combineToPoseCovariance(translation_cov, 0.005*Eigen::Matrix3d::Identity())).inverse();
         
-        valid_gicp_measurement = true;
-        icp_fitness_score = fitness_score;
+        return true;
     }
     
-    run_gicp = false;
-    return true;
+    GRAPH_SLAM_COUNT(gicp_failures, 1);
+    return false;
 }
 
 void EdgeSE3_GICP::computeError()
@@ -3,6 +3,7 @@
 
 #include <graph_slam/vertex_se3_gicp.hpp>
 #include <graph_slam/graph_slam_config.hpp>
+#include <graph_slam/matrix_helper.hpp>
 
 #include <g2o/types/slam3d/edge_se3.h>
 
@@ -18,6 +19,32 @@ public:
     
     bool setMeasurementFromGICP(bool delayed = false);
     
+    /** Sets a measurement, which has been computed with computeGICPMeasurement() beforehand.
+     * The edge is then handled as an edge with a valid GICP measurement.
+     */
+    void setGICPMeasurement(const Eigen::Isometry3d& measurement, const Matrix6d& information, double fitness_score);
+    
+    /** Aligns the source and target pointclouds using GICP.
+     * Both pointclouds stay in their vertex frames, the cached search trees and 
+     * point covariances of the vertices are reused if they are available.
+     * If coarse_to_fine is set and more than one resolution level is configured, the guess
+     * is refined on the coarser levels of the pointclouds first, using wider correspondence distances.
+     * 
+     * @param source_cloud pointcloud of the source vertex
+     * @param target_cloud pointcloud of the target vertex
+     * @param transformation_guess pose guess of the target vertex in the source vertex frame
+     * @param gicp_config GICP specific configuration
+     * @param measurement resulting pose of the target vertex in the source vertex frame
+     * @param information information matrix of the measurement
+     * @param fitness_score resulting GICP fitness score
+     * @param coarse_to_fine use the coarser resolution levels to refine the guess
+     * @return true if the alignment has converged to a valid measurement
+     */
+    static bool computeGICPMeasurement(const VertexSE3_GICP::GICPPointCloud& source_cloud, const VertexSE3_GICP::GICPPointCloud& target_cloud,
+                                       const Eigen::Isometry3d& transformation_guess, const GICPConfiguration& gicp_config,
+                                       Eigen::Isometry3d& measurement, Matrix6d& information, double& fitness_score,
+                                       bool coarse_to_fine = false);
+    
     void linearizeOplus();
     
     virtual void initialEstimate(const g2o::OptimizableGraph::VertexSet& from, g2o::OptimizableGraph::Vertex* to);
@@ -29,12 +56,17 @@ public:
     
     void useGuessForGICP(bool b) {use_guess_from_state = b;}
     
+    /** Enables the coarse-to-fine alignment for this edge, i.e. for loop closures with a poor guess */
+    void useCoarseToFine(bool b) {coarse_to_fine = b;}
+    bool usesCoarseToFine() const {return coarse_to_fine;}
+    
     bool hasValidGICPMeasurement() {return valid_gicp_measurement;}
     double getICPFitnessScore() {return icp_fitness_score;}
     
 protected:
     bool run_gicp;
     bool use_guess_from_state;
+    bool coarse_to_fine;
     GICPConfiguration gicp_config;
     bool valid_gicp_measurement;
     double icp_fitness_score;
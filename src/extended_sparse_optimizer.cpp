@@ -1,7 +1,11 @@
 #include "extended_sparse_optimizer.hpp"
 
 #include <limits>
+#include <cmath>
+#include <algorithm>
 #include <graph_slam/vertex_se3_gicp.hpp>
+#include <graph_slam/graph_sparsification.hpp>
+#include <graph_slam/instrumentation.hpp>
 #include <base/Pose.hpp>
 
 #include <g2o/core/factory.h>
@@ -9,8 +13,13 @@
 #include <g2o/core/block_solver.h>
 #include <g2o/core/optimization_algorithm_gauss_newton.h>
 #include <g2o/core/optimization_algorithm_levenberg.h>
+#include <g2o/core/robust_kernel_impl.h>
 #include <g2o/solvers/cholmod/linear_solver_cholmod.h>
 #include <g2o/solvers/csparse/linear_solver_csparse.h>
+#include <g2o/solvers/eigen/linear_solver_eigen.h>
+#include <graph_slam/linear_solvers.hpp>
+
+#include <boost/bind.hpp>
 
 #include <envire/maps/Pointcloud.hpp>
 #include <envire/maps/MLSGrid.hpp>
@@ -18,10 +27,23 @@
 namespace graph_slam 
 {
     
-ExtendedSparseOptimizer::ExtendedSparseOptimizer(OptimizationAlgorithm optimizer, LinearSolver solver) : SparseOptimizer()
+ExtendedSparseOptimizer::ExtendedSparseOptimizer(OptimizationAlgorithm optimizer, LinearSolver solver, const LinearSolverConfiguration& solver_config) :
+                                                SparseOptimizer(), marginal_covariances(cov_graph)
 {
     initValues();
-    setupOptimizer(optimizer, solver);
+    setupOptimizer(optimizer, solver, solver_config);
+    thread_pool.reset(new ThreadPool(1));
+    scratch_cloud.reset(new VertexSE3_GICP::PCLPointCloud);
+    terminate_flag = false;
+    async_alignments_per_snapshot = 1;
+    translation_tolerance = 0.0001;
+    rotation_tolerance = 0.00001;
+    covariance_tolerance = 0.01;
+    window_size = 0;
+    keyframe_distance = 0;
+    coarse_iterations = 10;
+    apriori_streaming_radius = 0.0;
+    apriori_map_attached = false;
     env.reset(new envire::Environment);
     map2world_frame = new envire::FrameNode();
     env->addChild(env->getRootNode(), map2world_frame);
@@ -29,6 +51,7 @@ ExtendedSparseOptimizer::ExtendedSparseOptimizer(OptimizationAlgorithm optimizer
 
 ExtendedSparseOptimizer::~ExtendedSparseOptimizer()
 {
+    setGainThreshold(0.0);
     clear();
 }
 
@@ -36,6 +59,8 @@ void ExtendedSparseOptimizer::initValues()
 {
     next_vertex_id = 0;
     initialized = false;
+    cov_graph_initialized = false;
+    coarse_graph_initialized = false;
     odometry_pose_last_vertex = Eigen::Isometry3d::Identity();
     odometry_pose_last_vertex.matrix() = std::numeric_limits<double>::quiet_NaN() * odometry_pose_last_vertex.matrix();
     odometry_covariance_last_vertex = Matrix6d::Zero();
@@ -44,6 +69,8 @@ void ExtendedSparseOptimizer::initValues()
     robot_start2world = Eigen::Isometry3d::Identity();
     last_vertex = NULL;
     new_edges_added = false;
+    loop_closure_added = false;
+    loop_closure_count = 0;
     use_mls = false;
     use_vertex_grid = false;
     map_update_necessary = false;
@@ -52,19 +79,33 @@ void ExtendedSparseOptimizer::initValues()
 
 void ExtendedSparseOptimizer::clear()
 {
+    if(loop_closure_worker)
+        loop_closure_worker->clear();
+
+    mls_update.clear();
+    if(pointcloud_store)
+        pointcloud_store->clear();
+    window_graph.clear();
+    window_vertices.clear();
+    coarse_graph.clear();
+    coarse_vertex_keyframes.clear();
+    coarse_edges.clear();
+    coarse_pending_vertices.clear();
+    coarse_pending_edges.clear();
     env.reset(new envire::Environment);
     projection.reset();
     map2world_frame = new envire::FrameNode();
     env->addChild(env->getRootNode(), map2world_frame);
     vertex_grid.reset();
 
-    for (std::vector<graph_slam::VertexSE3_GICP*>::iterator it=apriori_vertices.begin(); it!=apriori_vertices.end(); ++it)
-    {
-        for (g2o::HyperGraph::EdgeSet::iterator edge=(*it)->edges().begin(); edge!=(*it)->edges().end(); ++edge)
-            delete (*edge);
-        delete (*it);
-    }
-    apriori_vertices.clear();
+    resetAPrioriMap();
+    vertex_index.clear();
+    edge_candidate_queue.clear();
+    rejected_loop_closures.clear();
+    loop_closure_retries.clear();
+    dirty_vertices.clear();
+    published_vertices.clear();
+    marginal_covariances.invalidateAll();
     cov_graph.clear();
     vertices_to_add.clear();
     edges_to_add.clear();
@@ -74,55 +115,133 @@ void ExtendedSparseOptimizer::clear()
     initValues();
 }
 
-void ExtendedSparseOptimizer::setupOptimizer(OptimizationAlgorithm optimizer, LinearSolver solver)
+void ExtendedSparseOptimizer::setGainThreshold(double gain_threshold)
+{
+    if(gain_threshold > 0.0)
+    {
+        if(!terminate_action)
+        {
+            terminate_action.reset(new g2o::SparseOptimizerTerminateAction());
+            terminate_action->setMaxIterations(std::numeric_limits<int>::max());
+            addPostIterationAction(terminate_action.get());
+            setForceStopFlag(&terminate_flag);
+        }
+        terminate_action->setGainThreshold(gain_threshold);
+    }
+    else if(terminate_action)
+    {
+        removePostIterationAction(terminate_action.get());
+        setForceStopFlag(NULL);
+        terminate_action.reset();
+    }
+}
+
+/** Creates a robust kernel of the given type and width, NULL for NoRobustKernel */
+static g2o::RobustKernel* createRobustKernel(RobustKernelType type, double width)
+{
+    g2o::RobustKernel* kernel = NULL;
+    switch(type)
+    {
+        case HuberKernel:
+            kernel = new g2o::RobustKernelHuber();
+            break;
+        case CauchyKernel:
+            kernel = new g2o::RobustKernelCauchy();
+            break;
+        case DCSKernel:
+            kernel = new g2o::RobustKernelDCS();
+            break;
+        default:
+            break;
+    }
+    if(kernel)
+        kernel->setDelta(width);
+    return kernel;
+}
+
+/** Returns the type of a robust kernel, NoRobustKernel if it is NULL or unknown */
+static RobustKernelType getRobustKernelType(const g2o::RobustKernel* kernel)
+{
+    if(dynamic_cast<const g2o::RobustKernelHuber*>(kernel))
+        return HuberKernel;
+    if(dynamic_cast<const g2o::RobustKernelCauchy*>(kernel))
+        return CauchyKernel;
+    if(dynamic_cast<const g2o::RobustKernelDCS*>(kernel))
+        return DCSKernel;
+    return NoRobustKernel;
+}
+
+/** Allocates an optimization algorithm together with its block and linear solver */
+static g2o::OptimizationAlgorithmWithHessian* createOptimizationAlgorithm(ExtendedSparseOptimizer::OptimizationAlgorithm optimizer, ExtendedSparseOptimizer::LinearSolver solver,
+                                                                          const LinearSolverConfiguration& solver_config)
 {
     typedef g2o::BlockSolver< g2o::BlockSolverTraits<-1, -1> >  SlamBlockSolver;
-    typedef g2o::LinearSolverCCS<SlamBlockSolver::PoseMatrixType> LinearSolver;
+    typedef g2o::LinearSolver<SlamBlockSolver::PoseMatrixType> LinearSolver;
     typedef g2o::LinearSolverCSparse<SlamBlockSolver::PoseMatrixType> CSparseLinearSolver;
     typedef g2o::LinearSolverCholmod<SlamBlockSolver::PoseMatrixType> CholmodLinearSolver;
+    typedef LinearSolverCholmodSupernodal<SlamBlockSolver::PoseMatrixType> CholmodSupernodalLinearSolver;
+    typedef g2o::LinearSolverEigen<SlamBlockSolver::PoseMatrixType> EigenLinearSolver;
+    typedef LinearSolverWarmStartPCG<SlamBlockSolver::PoseMatrixType> PCGLinearSolver;
     
     // allocating the linear solver
     LinearSolver* linearSolver = NULL;
-    LinearSolver* covLinearSolver = NULL;
-    if(solver == CSparse)
+    if(solver == ExtendedSparseOptimizer::CSparse)
     {
-	linearSolver = new CSparseLinearSolver();
-	covLinearSolver = new CSparseLinearSolver();
+	CSparseLinearSolver* csparse = new CSparseLinearSolver();
+	csparse->setBlockOrdering(solver_config.block_ordering);
+	linearSolver = csparse;
     }
-    else if(solver == Cholmod)
+    else if(solver == ExtendedSparseOptimizer::Cholmod || solver == ExtendedSparseOptimizer::CholmodSupernodal)
     {
-	linearSolver = new CholmodLinearSolver();
-	covLinearSolver = new CholmodLinearSolver();
+	CholmodLinearSolver* cholmod = solver == ExtendedSparseOptimizer::Cholmod ? new CholmodLinearSolver() : new CholmodSupernodalLinearSolver();
+	cholmod->setBlockOrdering(solver_config.block_ordering);
+	linearSolver = cholmod;
     }
-    else
-	throw std::runtime_error("Unknown linear solver selected!");
-    
-    SlamBlockSolver* blockSolver = new SlamBlockSolver(linearSolver);
-    SlamBlockSolver* covBlockSolver = new SlamBlockSolver(covLinearSolver);
-    
-    // allocating the optimizer
-    g2o::OptimizationAlgorithmWithHessian* optimizationAlgorithm = NULL;
-    g2o::OptimizationAlgorithmWithHessian* covOptimizationAlgorithm = NULL;
-    if(optimizer == GaussNewton)
+    else if(solver == ExtendedSparseOptimizer::EigenCholesky)
     {
-	optimizationAlgorithm = new g2o::OptimizationAlgorithmGaussNewton(blockSolver);
-	covOptimizationAlgorithm = new g2o::OptimizationAlgorithmGaussNewton(covBlockSolver);
+	EigenLinearSolver* eigen = new EigenLinearSolver();
+	eigen->setBlockOrdering(solver_config.block_ordering);
+	linearSolver = eigen;
     }
-    else if(optimizer == LevenbergMarquardt)
+    else if(solver == ExtendedSparseOptimizer::PCG)
     {
-	optimizationAlgorithm = new g2o::OptimizationAlgorithmLevenberg(blockSolver);
-	covOptimizationAlgorithm = new g2o::OptimizationAlgorithmLevenberg(covBlockSolver);
+	PCGLinearSolver* pcg = new PCGLinearSolver();
+	pcg->setTolerance(solver_config.pcg_tolerance);
+	pcg->setAbsoluteTolerance(solver_config.pcg_absolute_tolerance);
+	pcg->setMaxIterations(solver_config.pcg_max_iterations);
+	pcg->setWarmStart(solver_config.pcg_warm_start);
+	linearSolver = pcg;
     }
     else
-	throw std::runtime_error("Unknown optimization algorithm selected!");
+	throw std::runtime_error("Unknown linear solver selected!");
+    
+    SlamBlockSolver* blockSolver = new SlamBlockSolver(linearSolver);
     
-    setAlgorithm(optimizationAlgorithm);
-    cov_graph.setAlgorithm(covOptimizationAlgorithm);
+    // allocating the optimizer
+    if(optimizer == ExtendedSparseOptimizer::GaussNewton)
+	return new g2o::OptimizationAlgorithmGaussNewton(blockSolver);
+    else if(optimizer == ExtendedSparseOptimizer::LevenbergMarquardt)
+	return new g2o::OptimizationAlgorithmLevenberg(blockSolver);
+
+    delete blockSolver;
+    throw std::runtime_error("Unknown optimization algorithm selected!");
+}
+
+void ExtendedSparseOptimizer::setupOptimizer(OptimizationAlgorithm optimizer, LinearSolver solver, const LinearSolverConfiguration& solver_config)
+{
+    setAlgorithm(createOptimizationAlgorithm(optimizer, solver, solver_config));
+    // the marginal covariances need a solver providing the factorization of the system
+    LinearSolver cov_solver = (solver == PCG || solver == EigenCholesky) ? CSparse : solver;
+    cov_graph.setAlgorithm(createOptimizationAlgorithm(optimizer, cov_solver, solver_config));
+    window_graph.setAlgorithm(createOptimizationAlgorithm(optimizer, solver, solver_config));
+    coarse_graph.setAlgorithm(createOptimizationAlgorithm(optimizer, solver, solver_config));
 }
 
 void ExtendedSparseOptimizer::updateGICPConfiguration(const GICPConfiguration& gicp_config)
 {
     this->gicp_config = gicp_config;
+    if(gicp_config.max_sensor_distance > 0.0)
+        vertex_index.setCellSize(gicp_config.max_sensor_distance);
     
     for(g2o::HyperGraph::EdgeSet::iterator it = _edges.begin(); it != _edges.end(); it++)
     {
@@ -138,7 +257,10 @@ bool ExtendedSparseOptimizer::setAPrioriMap(const boost::shared_ptr<envire::Envi
     std::vector<envire::Pointcloud*> pointclouds = apriori_env->getItems<envire::Pointcloud>();
     if(!pointclouds.empty())
     {
-        apriori_vertices.clear();
+        resetAPrioriMap();
+        // when streaming, the pointclouds are copied from the a-priori environment once they are in range
+        if(apriori_streaming_radius > 0.0)
+            this->apriori_env = apriori_env;
 
         // find pointcloud with the smallest id
         unsigned fixed_pc_index = 0;
@@ -158,26 +280,10 @@ bool ExtendedSparseOptimizer::setAPrioriMap(const boost::shared_ptr<envire::Envi
             return false;
 
         // create initial vertex
-        graph_slam::VertexSE3_GICP* first_vertex = new graph_slam::VertexSE3_GICP();
-        first_vertex->setId(next_vertex_id);
-        first_vertex->setFixed(true);
-        first_vertex->setEstimate(Eigen::Isometry3d(inital_transform.getTransform().matrix()));
-        first_vertex->setEdgeSearchState(true, first_vertex->estimate());
-        
-        // attach point cloud to vertex
-        envire::Pointcloud* envire_pointcloud = new envire::Pointcloud();
-        envire_pointcloud->vertices = pointclouds[fixed_pc_index]->vertices;
-        envire_pointcloud->setSensorOrigin(pointclouds[fixed_pc_index]->getSensorOrigin());
-        first_vertex->attachPointCloud(envire_pointcloud);
-
-        // add pointcloud to environment
-        envire::FrameNode* framenode = new envire::FrameNode();
-        framenode->setTransform(inital_transform);
-        env->addChild(map2world_frame, framenode);
-        env->setFrameNode(envire_pointcloud, framenode);
-
-        apriori_vertices.push_back(first_vertex);
-        next_vertex_id++;
+        APrioriPointcloud first_pointcloud;
+        first_pointcloud.transform = inital_transform;
+        first_pointcloud.source = pointclouds[fixed_pc_index];
+        addAPrioriVertex(first_pointcloud);
 
         // add the rest of the point clouds
         for(unsigned i = 0; i < pointclouds.size(); i++)
@@ -190,33 +296,10 @@ bool ExtendedSparseOptimizer::setAPrioriMap(const boost::shared_ptr<envire::Envi
             if(transform.hasUncertainty() && !is_nan(transform.getCovariance()) && !is_nan(transform.getTransform().matrix()))
             {
                 // create vertex
-                graph_slam::VertexSE3_GICP* vertex = new graph_slam::VertexSE3_GICP();
-                vertex->setId(next_vertex_id);
-                vertex->setEstimate(Eigen::Isometry3d(transform.getTransform().matrix()));
-                vertex->setEdgeSearchState(true, vertex->estimate());
-                
-                // attach point cloud to vertex
-                envire::Pointcloud* envire_pointcloud = new envire::Pointcloud();
-                envire_pointcloud->vertices = pointclouds[i]->vertices;
-                envire_pointcloud->setSensorOrigin(pointclouds[i]->getSensorOrigin());
-                vertex->attachPointCloud(envire_pointcloud);
-
-                // add pointcloud to environment
-                envire::FrameNode* framenode = new envire::FrameNode();
-                framenode->setTransform(transform);
-                env->addChild(map2world_frame, framenode);
-                env->setFrameNode(envire_pointcloud, framenode);
-
-                // create edge to first vertex
-                g2o::EdgeSE3* edge = new g2o::EdgeSE3();
-                edge->vertices()[0] = first_vertex;
-                edge->vertices()[1] = vertex;
-                edge->setMeasurementFromState();
-                edge->setInformation( switchEnvireG2oCov(transform.getCovariance()).inverse() );
-                vertex->edges().insert(edge);
-
-                apriori_vertices.push_back(vertex);
-                next_vertex_id++;
+                APrioriPointcloud pointcloud;
+                pointcloud.transform = transform;
+                pointcloud.source = pointclouds[i];
+                addAPrioriVertex(pointcloud);
             }
         }
 
@@ -230,63 +313,413 @@ bool ExtendedSparseOptimizer::setAPrioriMap(const boost::shared_ptr<envire::Envi
     return false;
 }
 
-bool ExtendedSparseOptimizer::attachAPrioriMap()
+bool ExtendedSparseOptimizer::setAPrioriMap(const std::string& snapshot_path)
 {
-    if(!apriori_vertices.empty())
+    GraphSnapshot snapshot;
+    try
     {
-        // get current fixed vertex
-        g2o::OptimizableGraph::Vertex* current_fixed_vertex = NULL;
-        for(VertexIDMap::const_iterator it = _vertices.begin(); it != _vertices.end(); it++)
+        loadGraphSnapshot(snapshot_path, snapshot);
+    }
+    catch(const std::runtime_error& e)
+    {
+        std::cerr << "Couldn't load the a-priori map: " << e.what() << std::endl;
+        return false;
+    }
+
+    // the fixed vertex of the snapshot or the one with the smallest id is the fixed one
+    GraphSnapshot::Vertices::iterator fixed_vertex = snapshot.vertices.end();
+    for(GraphSnapshot::Vertices::iterator it = snapshot.vertices.begin(); it != snapshot.vertices.end(); it++)
+    {
+        if(fixed_vertex == snapshot.vertices.end() || (it->fixed && !fixed_vertex->fixed) || 
+           (it->fixed == fixed_vertex->fixed && it->id < fixed_vertex->id))
+            fixed_vertex = it;
+    }
+    if(fixed_vertex == snapshot.vertices.end())
+    {
+        std::cerr << "Couldn't find any vertices in the a-priori map." << std::endl;
+        return false;
+    }
+    if(is_nan(fixed_vertex->pose.matrix()))
+        return false;
+
+    resetAPrioriMap();
+
+    // the fixed vertex first, then all uncertain vertices
+    std::vector<GraphSnapshot::Vertices::iterator> vertices(1, fixed_vertex);
+    for(GraphSnapshot::Vertices::iterator it = snapshot.vertices.begin(); it != snapshot.vertices.end(); it++)
+    {
+        if(it != fixed_vertex && it->has_covariance && !is_nan(it->covariance) && !is_nan(it->pose.matrix()))
+            vertices.push_back(it);
+    }
+
+    for(std::vector<GraphSnapshot::Vertices::iterator>::const_iterator it = vertices.begin(); it != vertices.end(); it++)
+    {
+        APrioriPointcloud pointcloud;
+        Matrix6d covariance = it == vertices.begin() ? Matrix6d::Zero() : (*it)->covariance;
+        pointcloud.transform = envire::TransformWithUncertainty(Eigen::Affine3d((*it)->pose.matrix()), switchEnvireG2oCov(covariance));
+        pointcloud.snapshot_vertex = **it;
+        addAPrioriVertex(pointcloud);
+    }
+    return true;
+}
+
+void ExtendedSparseOptimizer::setAPrioriStreamingRadius(double radius)
+{
+    apriori_streaming_radius = radius;
+}
+
+void ExtendedSparseOptimizer::resetAPrioriMap()
+{
+    for(std::vector<graph_slam::VertexSE3_GICP*>::iterator it = apriori_vertices.begin(); it != apriori_vertices.end(); ++it)
+    {
+        vertex_index.remove((*it)->id());
+        for(g2o::HyperGraph::EdgeSet::iterator edge = (*it)->edges().begin(); edge != (*it)->edges().end(); ++edge)
+            delete (*edge);
+        delete (*it);
+    }
+    apriori_vertices.clear();
+    apriori_pointclouds.clear();
+    apriori_env.reset();
+    apriori_map_attached = false;
+}
+
+void ExtendedSparseOptimizer::addAPrioriVertex(APrioriPointcloud& pointcloud)
+{
+    graph_slam::VertexSE3_GICP* vertex = new graph_slam::VertexSE3_GICP();
+    vertex->setId(next_vertex_id);
+    vertex->setEstimate(Eigen::Isometry3d(pointcloud.transform.getTransform().matrix()));
+    vertex->setEdgeSearchState(true, vertex->estimate());
+
+    if(apriori_vertices.empty())
+        vertex->setFixed(true);
+    else
+    {
+        // create edge to first vertex
+        g2o::EdgeSE3* edge = new g2o::EdgeSE3();
+        edge->vertices()[0] = apriori_vertices.front();
+        edge->vertices()[1] = vertex;
+        edge->setMeasurementFromState();
+        edge->setInformation( switchEnvireG2oCov(pointcloud.transform.getCovariance()).inverse() );
+        vertex->edges().insert(edge);
+    }
+
+    apriori_vertices.push_back(vertex);
+    vertex_index.insert(vertex->id(), vertex->estimate().translation());
+    next_vertex_id++;
+
+    // when streaming, only the position of the vertex is known until it comes into range
+    if(apriori_streaming_radius > 0.0)
+    {
+        // the points are moved instead of copied
+        std::vector<Eigen::Vector3d> points;
+        points.swap(pointcloud.snapshot_vertex.points);
+        APrioriPointcloud& pending = apriori_pointclouds[vertex->id()];
+        pending = pointcloud;
+        pending.snapshot_vertex.points.swap(points);
+    }
+    else
+        loadAPrioriPointcloud(vertex, pointcloud);
+}
+
+void ExtendedSparseOptimizer::loadAPrioriPointcloud(graph_slam::VertexSE3_GICP* vertex, APrioriPointcloud& pointcloud)
+{
+    // vertices which have been saved without a pointcloud only contribute their pose
+    if(!pointcloud.source && !pointcloud.snapshot_vertex.has_pointcloud)
+        return;
+
+    // attach point cloud to vertex
+    envire::Pointcloud* envire_pointcloud = new envire::Pointcloud();
+    if(pointcloud.source)
+    {
+        envire_pointcloud->vertices = pointcloud.source->vertices;
+        envire_pointcloud->setSensorOrigin(pointcloud.source->getSensorOrigin());
+        vertex->attachPointCloud(envire_pointcloud, gicp_config, *scratch_cloud);
+    }
+    else
+    {
+        // the downsampled pointcloud of the snapshot is used as it is
+        GraphSnapshot::Vertex& snapshot_vertex = pointcloud.snapshot_vertex;
+        envire_pointcloud->vertices.swap(snapshot_vertex.points);
+        envire_pointcloud->setSensorOrigin(snapshot_vertex.sensor_origin);
+        if(snapshot_vertex.gicp_cloud)
+            vertex->attachPointCloud(envire_pointcloud, snapshot_vertex.gicp_pointcloud, snapshot_vertex.gicp_cloud);
+        else
+            vertex->attachPointCloud(envire_pointcloud, gicp_config, *scratch_cloud);
+    }
+
+    // add pointcloud to environment
+    envire::FrameNode* framenode = new envire::FrameNode();
+    framenode->setTransform(pointcloud.transform);
+    env->addChild(map2world_frame, framenode);
+    env->setFrameNode(envire_pointcloud, framenode);
+}
+
+void ExtendedSparseOptimizer::streamAPrioriMap()
+{
+    if(apriori_streaming_radius <= 0.0 || !last_vertex || apriori_vertices.empty())
+        return;
+
+    // load the pointclouds of the a-priori vertices in range, so they can become edge candidates
+    if(!apriori_pointclouds.empty())
+    {
+        std::vector<int> vertex_ids;
+        vertex_index.query(last_vertex->estimate().translation(), apriori_streaming_radius, vertex_ids);
+        for(std::vector<int>::const_iterator id = vertex_ids.begin(); id != vertex_ids.end(); id++)
         {
-            g2o::OptimizableGraph::Vertex* v = dynamic_cast<g2o::OptimizableGraph::Vertex*>(it->second);
-            if(v && v->fixed())
-                current_fixed_vertex = v;
+            APrioriPointclouds::iterator it = apriori_pointclouds.find(*id);
+            graph_slam::VertexSE3_GICP* vertex = getAPrioriVertex(*id);
+            if(it == apriori_pointclouds.end() || !vertex)
+                continue;
+            loadAPrioriPointcloud(vertex, it->second);
+            apriori_pointclouds.erase(it);
         }
+        if(apriori_pointclouds.empty())
+            apriori_env.reset();
+    }
 
-        // add new fixed vertex
-        graph_slam::VertexSE3_GICP* first_vertex = apriori_vertices.front();
-        if(!g2o::SparseOptimizer::addVertex(first_vertex))
-            return false;
-        if(current_fixed_vertex)
+    // once the a-priori map is connected, the loaded vertices are attached incrementally
+    if(apriori_map_attached)
+        attachAPrioriMap();
+}
+
+void ExtendedSparseOptimizer::saveSnapshot(const std::string& path)
+{
+    GraphSnapshot snapshot;
+    snapshot.next_vertex_id = next_vertex_id;
+    snapshot.last_vertex_id = last_vertex ? last_vertex->id() : -1;
+    snapshot.odometry_pose_last_vertex = odometry_pose_last_vertex;
+    snapshot.odometry_covariance_last_vertex = odometry_covariance_last_vertex;
+
+    snapshot.vertices.reserve(_vertices.size());
+    for(VertexIDMap::const_iterator it = _vertices.begin(); it != _vertices.end(); it++)
+    {
+        graph_slam::VertexSE3_GICP *vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(it->second);
+        if(!vertex)
+            continue;
+        GraphSnapshot::Vertex snapshot_vertex;
+        snapshot_vertex.id = vertex->id();
+        snapshot_vertex.fixed = vertex->fixed();
+        snapshot_vertex.pose = vertex->estimate();
+        snapshot_vertex.has_covariance = !vertex->fixed() && getVertexCovariance(snapshot_vertex.covariance, vertex);
+
+        envire::Pointcloud* envire_pointcloud = dynamic_cast<envire::Pointcloud*>(vertex->getEnvirePointCloud().get());
+        if(vertex->hasPointcloudAttached() && envire_pointcloud && loadPointcloud(vertex))
+        {
+            snapshot_vertex.has_pointcloud = true;
+            snapshot_vertex.sensor_origin = envire_pointcloud->getSensorOrigin();
+            snapshot_vertex.points = envire_pointcloud->vertices;
+            snapshot_vertex.gicp_cloud = vertex->getGICPPointCloud();
+        }
+        snapshot.vertices.push_back(snapshot_vertex);
+    }
+
+    // edges with a pending GICP alignment are left out
+    for(g2o::HyperGraph::EdgeSet::const_iterator it = _edges.begin(); it != _edges.end(); it++)
+    {
+        g2o::EdgeSE3* edge = dynamic_cast<g2o::EdgeSE3*>(*it);
+        graph_slam::EdgeSE3_GICP* gicp_edge = dynamic_cast<graph_slam::EdgeSE3_GICP*>(*it);
+        if(!edge || (gicp_edge && !gicp_edge->hasValidGICPMeasurement()))
+            continue;
+        GraphSnapshot::Edge snapshot_edge;
+        snapshot_edge.source_id = edge->vertices()[0]->id();
+        snapshot_edge.target_id = edge->vertices()[1]->id();
+        if(!gicp_edge)
+            snapshot_edge.kind = GraphSnapshot::ConstraintEdge;
+        else
+            snapshot_edge.kind = gicp_edge->usesCoarseToFine() ? GraphSnapshot::LoopClosureEdge : GraphSnapshot::OdometryEdge;
+        snapshot_edge.measurement = edge->measurement();
+        snapshot_edge.information = edge->information();
+        snapshot_edge.fitness_score = gicp_edge ? gicp_edge->getICPFitnessScore() : 0.0;
+        snapshot_edge.robust_kernel = getRobustKernelType(edge->robustKernel());
+        if(edge->robustKernel())
+            snapshot_edge.robust_kernel_width = edge->robustKernel()->delta();
+        snapshot.edges.push_back(snapshot_edge);
+    }
+
+    saveGraphSnapshot(path, snapshot);
+    enforcePointcloudBudget();
+}
+
+void ExtendedSparseOptimizer::loadSnapshot(const std::string& path)
+{
+    if(last_vertex != NULL || !vertices().empty())
+        throw std::runtime_error("Can't load the snapshot, the graph is not empty");
+
+    GraphSnapshot snapshot;
+    loadGraphSnapshot(path, snapshot);
+
+    for(GraphSnapshot::Vertices::iterator it = snapshot.vertices.begin(); it != snapshot.vertices.end(); it++)
+    {
+        graph_slam::VertexSE3_GICP* vertex = new graph_slam::VertexSE3_GICP();
+        vertex->setId(it->id);
+        vertex->setFixed(it->fixed);
+        vertex->setEstimate(it->pose);
+        vertex->setEdgeSearchState(true, vertex->estimate());
+
+        if(!g2o::SparseOptimizer::addVertex(vertex))
+        {
+            delete vertex;
+            throw std::runtime_error("failed to add a vertex of the snapshot.");
+        }
+        vertices_to_add.insert(vertex);
+        next_vertex_id = std::max(next_vertex_id, vertex->id() + 1);
+
+        // vertices which have been saved without a pointcloud only contribute their pose
+        if(!it->has_pointcloud)
+            continue;
+
+        // the downsampled pointcloud of the snapshot is used as it is
+        envire::Pointcloud* envire_pointcloud = new envire::Pointcloud();
+        envire_pointcloud->vertices.swap(it->points);
+        envire_pointcloud->setSensorOrigin(it->sensor_origin);
+        if(it->gicp_cloud)
+            vertex->attachPointCloud(envire_pointcloud, it->gicp_pointcloud, it->gicp_cloud);
+        else
+            vertex->attachPointCloud(envire_pointcloud, gicp_config, *scratch_cloud);
+        vertex_index.insert(vertex->id(), vertex->estimate().translation());
+
+        // add pointcloud to environment
+        envire::FrameNode* framenode = new envire::FrameNode();
+        framenode->setTransform(Eigen::Affine3d(vertex->estimate().matrix()));
+        env->addChild(map2world_frame, framenode);
+        env->setFrameNode(envire_pointcloud, framenode);
+        if(use_mls)
+            env->addInput(projection.get(), envire_pointcloud);
+    }
+
+    for(GraphSnapshot::Edges::const_iterator it = snapshot.edges.begin(); it != snapshot.edges.end(); it++)
+    {
+        graph_slam::VertexSE3_GICP* source_vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(this->vertex(it->source_id));
+        graph_slam::VertexSE3_GICP* target_vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(this->vertex(it->target_id));
+        if(!source_vertex || !target_vertex)
+        {
+            std::cerr << "skipped edge between the unknown vertices " << it->source_id << " and " << it->target_id << " of the snapshot." << std::endl;
+            continue;
+        }
+        g2o::EdgeSE3* edge = NULL;
+        if(it->kind == GraphSnapshot::ConstraintEdge)
         {
-            current_fixed_vertex->setFixed(false);
-            g2o::OptimizableGraph::Vertex* fixed_vertex_in_cov_graph = cov_graph.vertex(current_fixed_vertex->id());
-            if(fixed_vertex_in_cov_graph)
-                fixed_vertex_in_cov_graph->setFixed(false);
+            edge = new g2o::EdgeSE3();
+            edge->vertices()[0] = source_vertex;
+            edge->vertices()[1] = target_vertex;
+            edge->setMeasurement(it->measurement);
+            edge->setInformation(it->information);
         }
         else
-            std::cerr << "attachAPrioriMap: couldn't find a current fixed vertex." << std::endl;
-        vertices_to_add.insert(first_vertex);
+        {
+            graph_slam::EdgeSE3_GICP* gicp_edge = new graph_slam::EdgeSE3_GICP();
+            gicp_edge->setSourceVertex(source_vertex);
+            gicp_edge->setTargetVertex(target_vertex);
+            gicp_edge->setGICPConfiguration(gicp_config);
+            gicp_edge->useCoarseToFine(it->kind == GraphSnapshot::LoopClosureEdge);
+            gicp_edge->setGICPMeasurement(it->measurement, it->information, it->fitness_score);
+            edge = gicp_edge;
+        }
+        edge->setRobustKernel(createRobustKernel(it->robust_kernel, it->robust_kernel_width));
+        if(!g2o::SparseOptimizer::addEdge(edge))
+        {
+            std::cerr << "failed to add an edge of the snapshot." << std::endl;
+            delete edge;
+            continue;
+        }
+        edges_to_add.insert(edge);
+    }
+
+    next_vertex_id = std::max(next_vertex_id, snapshot.next_vertex_id);
+    last_vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(this->vertex(snapshot.last_vertex_id));
+    odometry_pose_last_vertex = snapshot.odometry_pose_last_vertex;
+    odometry_covariance_last_vertex = snapshot.odometry_covariance_last_vertex;
+    map_update_necessary = true;
+}
+
+bool ExtendedSparseOptimizer::attachAPrioriMap()
+{
+    if(!apriori_vertices.empty())
+    {
+        std::vector<graph_slam::VertexSE3_GICP*>::iterator begin = apriori_vertices.begin();
+        bool first_attachment = !apriori_map_attached;
+        if(first_attachment)
+        {
+            // get current fixed vertex
+            g2o::OptimizableGraph::Vertex* current_fixed_vertex = NULL;
+            for(VertexIDMap::const_iterator it = _vertices.begin(); it != _vertices.end(); it++)
+            {
+                g2o::OptimizableGraph::Vertex* v = dynamic_cast<g2o::OptimizableGraph::Vertex*>(it->second);
+                if(v && v->fixed())
+                    current_fixed_vertex = v;
+            }
 
-        // reinitalize the complete graph, because fixed vertex has changed
-        initialized = false;
+            // add new fixed vertex, its pointcloud is always needed
+            graph_slam::VertexSE3_GICP* first_vertex = apriori_vertices.front();
+            APrioriPointclouds::iterator pending = apriori_pointclouds.find(first_vertex->id());
+            if(pending != apriori_pointclouds.end())
+            {
+                loadAPrioriPointcloud(first_vertex, pending->second);
+                apriori_pointclouds.erase(pending);
+            }
+            if(!g2o::SparseOptimizer::addVertex(first_vertex))
+                return false;
+            if(current_fixed_vertex)
+            {
+                current_fixed_vertex->setFixed(false);
+                g2o::OptimizableGraph::Vertex* fixed_vertex_in_cov_graph = cov_graph.vertex(current_fixed_vertex->id());
+                if(fixed_vertex_in_cov_graph)
+                    fixed_vertex_in_cov_graph->setFixed(false);
+                marginal_covariances.invalidateAll();
+            }
+            else
+                std::cerr << "attachAPrioriMap: couldn't find a current fixed vertex." << std::endl;
+            vertices_to_add.insert(first_vertex);
+            envire::Pointcloud* first_pointcloud = dynamic_cast<envire::Pointcloud*>(first_vertex->getEnvirePointCloud().get());
+            if(use_mls && first_pointcloud)
+                env->addInput(projection.get(), first_pointcloud);
+
+            // reinitalize the complete graph, because fixed vertex has changed
+            initialized = false;
+            cov_graph_initialized = false;
+            coarse_graph_initialized = false;
+            apriori_map_attached = true;
+            begin++;
+
+            if(_verbose)
+                std::cerr << "Added a-priori map and switched fixed vertex from " << (current_fixed_vertex ? boost::lexical_cast<std::string>(current_fixed_vertex->id()) : "(na)") << " to " << first_vertex->id() << std::endl;
+        }
 
-        // add all vertecies and edges to the graph
-        for(unsigned i = 1; i < apriori_vertices.size(); i++)
+        // add all vertecies and edges to the graph, when streaming only the ones with a loaded pointcloud
+        std::vector<graph_slam::VertexSE3_GICP*> remaining_vertices;
+        unsigned attached = 0;
+        for(std::vector<graph_slam::VertexSE3_GICP*>::iterator it = begin; it != apriori_vertices.end(); it++)
         {
-            graph_slam::VertexSE3_GICP* vertex = apriori_vertices[i];
+            graph_slam::VertexSE3_GICP* vertex = *it;
+            if(apriori_pointclouds.count(vertex->id()))
+            {
+                remaining_vertices.push_back(vertex);
+                continue;
+            }
             g2o::EdgeSE3* edge = dynamic_cast<g2o::EdgeSE3*>(*vertex->edges().begin());
             vertex->edges().clear();
 
             if(!g2o::SparseOptimizer::addVertex(vertex))
+            {
+                delete edge;
+                delete vertex;
                 continue;
+            }
 
             if(!edge || !g2o::SparseOptimizer::addEdge(edge))
             {
                 g2o::SparseOptimizer::removeVertex(vertex);
+                delete edge;
                 continue;
             }
 
             vertices_to_add.insert(vertex);
             edges_to_add.insert(edge);
-        }
+            attached++;
 
-        // project pointclouds into mls 
-        if(use_mls)
-        {
-            for(unsigned i = 0; i < apriori_vertices.size(); i++)
+            // project pointclouds into mls 
+            if(use_mls)
             {
-                graph_slam::VertexSE3_GICP* vertex = apriori_vertices[i];
                 envire::EnvironmentItem::Ptr envire_item = vertex->getEnvirePointCloud();
                 envire::Pointcloud* envire_pointcloud = dynamic_cast<envire::Pointcloud*>(envire_item.get());
                 if(envire_pointcloud)
@@ -294,10 +727,10 @@ bool ExtendedSparseOptimizer::attachAPrioriMap()
             }
         }
 
-        if(_verbose)
-            std::cerr << "Added a-priori map and switched fixed vertex from " << (current_fixed_vertex ? boost::lexical_cast<std::string>(current_fixed_vertex->id()) : "(na)") << " to " << first_vertex->id() << std::endl;
+        if(_verbose && attached > 0 && !first_attachment)
+            std::cerr << "Attached " << attached << " a-priori vertices, " << remaining_vertices.size() << " are not in range yet" << std::endl;
 
-        apriori_vertices.clear();
+        apriori_vertices.swap(remaining_vertices);
     }
     return true;
 }
@@ -305,9 +738,18 @@ bool ExtendedSparseOptimizer::attachAPrioriMap()
 bool ExtendedSparseOptimizer::addInitalVertex(const envire::TransformWithUncertainty& transformation,
                                               std::vector<Eigen::Vector3d>& pointcloud, 
                                               const Eigen::Affine3d& sensor_origin)
+{
+    envire::Pointcloud* envire_pointcloud = new envire::Pointcloud();
+    envire_pointcloud->vertices = pointcloud;
+    envire_pointcloud->setSensorOrigin(sensor_origin);
+    return addInitalVertex(transformation, envire_pointcloud);
+}
+
+bool ExtendedSparseOptimizer::addInitalVertex(const envire::TransformWithUncertainty& transformation, envire::Pointcloud* envire_pointcloud)
 {
     if(last_vertex != NULL || !vertices().empty())
     {
+        delete envire_pointcloud;
         throw std::runtime_error("Can't add the inital Vertex, the graph is not empty");
     }
     Eigen::Isometry3d odometry_pose(transformation.getTransform().matrix());
@@ -315,6 +757,7 @@ bool ExtendedSparseOptimizer::addInitalVertex(const envire::TransformWithUncerta
     // check for nan values
     if(is_nan(odometry_pose.matrix()))
     {
+        delete envire_pointcloud;
         throw std::runtime_error("Odometry pose matrix contains not numerical entries!");
     }
 
@@ -323,10 +766,7 @@ bool ExtendedSparseOptimizer::addInitalVertex(const envire::TransformWithUncerta
     vertex->setId(next_vertex_id);
     
     // attach point cloud to vertex
-    envire::Pointcloud* envire_pointcloud = new envire::Pointcloud();
-    envire_pointcloud->vertices = pointcloud;
-    envire_pointcloud->setSensorOrigin(sensor_origin);
-    vertex->attachPointCloud(envire_pointcloud);
+    vertex->attachPointCloud(envire_pointcloud, gicp_config, *scratch_cloud);
     
     // added vertex to the graph
     if(!g2o::SparseOptimizer::addVertex(vertex))
@@ -346,6 +786,7 @@ bool ExtendedSparseOptimizer::addInitalVertex(const envire::TransformWithUncerta
     map_update_necessary = true;
 
     vertices_to_add.insert(vertex);
+    vertex_index.insert(vertex->id(), vertex->estimate().translation());
     last_vertex = vertex;
     next_vertex_id++;
 
@@ -380,10 +821,19 @@ bool ExtendedSparseOptimizer::addInitalVertex(const envire::TransformWithUncerta
 
 bool ExtendedSparseOptimizer::addVertex(const envire::TransformWithUncertainty& transformation, std::vector<Eigen::Vector3d>& pointcloud, 
                                         const Eigen::Affine3d& sensor_origin, bool delayed_icp_update)
+{
+    envire::Pointcloud* envire_pointcloud = new envire::Pointcloud();
+    envire_pointcloud->vertices = pointcloud;
+    envire_pointcloud->setSensorOrigin(sensor_origin);
+    return addVertex(transformation, envire_pointcloud, delayed_icp_update);
+}
+
+bool ExtendedSparseOptimizer::addVertex(const envire::TransformWithUncertainty& transformation, envire::Pointcloud* envire_pointcloud, bool delayed_icp_update)
 {
     if(next_vertex_id == std::numeric_limits<int>::max())
     {
         // this should not happen under normal circumstances
+        delete envire_pointcloud;
         throw std::runtime_error("Can't add any new vertex. Max id count has been reached.");
     }
     
@@ -394,17 +844,19 @@ bool ExtendedSparseOptimizer::addVertex(const envire::TransformWithUncertainty&
     // check for nan values
     if(is_nan(odometry_pose.matrix()))
     {
+        delete envire_pointcloud;
         throw std::runtime_error("Odometry pose matrix contains not numerical entries!");
     }
     else if(is_nan(odometry_covariance))
     {
+        delete envire_pointcloud;
         throw std::runtime_error("Odometry covariance matrix contains not numerical entries!");
     }
 
     // add vertex as inital vertex if necessary
     if(last_vertex == NULL)
     {
-        if(addInitalVertex(transformation, pointcloud, sensor_origin))
+        if(addInitalVertex(transformation, envire_pointcloud))
         {
             // set valid last odometry pose
             odometry_pose_last_vertex = odometry_pose;
@@ -426,10 +878,7 @@ bool ExtendedSparseOptimizer::addVertex(const envire::TransformWithUncertainty&
     vertex->setId(next_vertex_id);
     
     // attach point cloud to vertex
-    envire::Pointcloud* envire_pointcloud = new envire::Pointcloud();
-    envire_pointcloud->vertices = pointcloud;
-    envire_pointcloud->setSensorOrigin(sensor_origin);
-    vertex->attachPointCloud(envire_pointcloud);
+    vertex->attachPointCloud(envire_pointcloud, gicp_config, *scratch_cloud);
     
     // added vertex to the graph
     if(!g2o::SparseOptimizer::addVertex(vertex))
@@ -474,6 +923,7 @@ bool ExtendedSparseOptimizer::addVertex(const envire::TransformWithUncertainty&
     edges_to_add.insert(edge);
 
     vertices_to_add.insert(vertex);
+    vertex_index.insert(vertex->id(), vertex->estimate().translation());
     odometry_pose_last_vertex = odometry_pose;
     odometry_covariance_last_vertex = odometry_covariance;
     last_vertex = vertex;
@@ -491,310 +941,1141 @@ bool ExtendedSparseOptimizer::addVertex(const envire::TransformWithUncertainty&
     return true;
 }
 
-bool ExtendedSparseOptimizer::removeVertex(int vertex_id)
+/** Attaches the pointcloud of a scan to its vertex, this downsamples the pointcloud and computes its GICP data */
+static void attachScanPointcloud(const std::vector<graph_slam::VertexSE3_GICP*>* vertices, const std::vector<envire::Pointcloud*>* pointclouds,
+                                 const GICPConfiguration* gicp_config, size_t index)
 {
-    graph_slam::VertexSE3_GICP *vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(this->vertex(vertex_id));
-    if(vertex && isHandledByOptimizer(vertex))
-    {
-        removePointcloudFromVertex(vertex_id);
-        //TODO the vertex should be removed later too
-        
-    }
-    return false;
+    (*vertices)[index]->attachPointCloud((*pointclouds)[index], *gicp_config);
 }
 
-bool ExtendedSparseOptimizer::removePointcloudFromVertex(int vertex_id)
+/** Runs the GICP alignment of an odometry edge of a batch */
+static void runOdometryGICP(std::vector<char>* results, const std::vector<graph_slam::EdgeSE3_GICP*>* edges, size_t index)
 {
-    graph_slam::VertexSE3_GICP *vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(this->vertex(vertex_id));
-    if(vertex && isHandledByOptimizer(vertex) && vertex->hasPointcloudAttached())
-    {
-        // remove pointcloud from vertex
-        envire::EnvironmentItem::Ptr envire_item = vertex->getEnvirePointCloud();
-        envire::Pointcloud* envire_pointcloud = dynamic_cast<envire::Pointcloud*>(envire_item.get());
-        vertex->detachPointCloud();
-
-        // remove pointcloud from envire
-        if(use_mls)
-            env->removeInput(projection.get(), envire_pointcloud);
-        envire::FrameNode* fn = envire_pointcloud->getFrameNode();
-        env->detachItem(fn, true);
-        return true;
-    }
-    return false;
+    (*results)[index] = (*edges)[index]->setMeasurementFromGICP();
 }
 
-void ExtendedSparseOptimizer::setupMaxVertexGrid(unsigned max_vertices_per_cell, double grid_size_x, double grid_size_y, double cell_resolution)
+unsigned ExtendedSparseOptimizer::addVertices(const BatchScans& scans)
 {
-    if(vertex_grid.use_count() == 0)
+    // check all scans up front, so that the batch isn't added partially
+    std::string error;
+    if(scans.size() > (size_t)(std::numeric_limits<int>::max() - next_vertex_id))
+        error = "Can't add the batch of vertices. Max id count would be reached.";
+    for(BatchScans::const_iterator it = scans.begin(); it != scans.end() && error.empty(); it++)
     {
-        vertex_grid.reset(new VertexGrid(grid_size_x, grid_size_y, cell_resolution, max_vertices_per_cell));
-        use_vertex_grid = true;
+        if(is_nan(it->transformation.getTransform().matrix()))
+            error = "Odometry pose matrix contains not numerical entries!";
+        else if(is_nan(it->transformation.getCovariance()))
+            error = "Odometry covariance matrix contains not numerical entries!";
     }
-    vertex_grid->setMaxVerticesPerCell(max_vertices_per_cell);
-}
-
-void ExtendedSparseOptimizer::removeVerticesFromGrid()
-{
-    if(!use_vertex_grid)
-        return;
-    std::vector<int> vertices;
-    vertex_grid->removeVertices(vertices);
-    for(unsigned i = 0; i < vertices.size(); i++)
+    if(!error.empty())
     {
-        if(!removePointcloudFromVertex(vertices[i]) && _verbose)
-            std::cerr << "couldn't remove vertex with id " << vertices[i] << std::endl;
-        else if(_verbose)
-            std::cerr << "removed vertex with id " << vertices[i] << std::endl;
+        for(BatchScans::const_iterator it = scans.begin(); it != scans.end(); it++)
+            delete it->pointcloud;
+        throw std::runtime_error(error);
     }
-}
+    if(scans.empty())
+        return 0;
 
-void ExtendedSparseOptimizer::findEdgeCandidates()
-{
-    // compute marginals
-    g2o::SparseBlockMatrix<Eigen::MatrixXd> spinv;
-    VertexContainer vc;
-    for(g2o::OptimizableGraph::VertexContainer::const_iterator it = _activeVertices.begin(); it != _activeVertices.end(); it++)
+    // the inital vertex has no odometry edge
+    size_t first = 0;
+    if(last_vertex == NULL)
     {
-        graph_slam::VertexSE3_GICP *vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(*it);
-        if(vertex && vertex->hasPointcloudAttached() && isHandledByOptimizer(vertex))
-            vc.push_back(vertex);
+        try
+        {
+            addVertex(scans.front().transformation, scans.front().pointcloud);
+        }
+        catch (...)
+        {
+            for(unsigned i = 1; i < scans.size(); i++)
+                delete scans[i].pointcloud;
+            throw;
+        }
+        first = 1;
+    }
+    else if(is_nan(odometry_pose_last_vertex.matrix()))
+    {
+        // set valid last odometry pose
+        odometry_pose_last_vertex = Eigen::Isometry3d(scans.front().transformation.getTransform().matrix());
+        odometry_covariance_last_vertex = switchEnvireG2oCov(scans.front().transformation.getCovariance());
+    }
+    size_t count = scans.size() - first;
+    if(count == 0)
+        return 1;
+
+    // create the vertices and odometry edges, the initial poses are chained by the odometry deltas
+    std::vector<graph_slam::VertexSE3_GICP*> vertices(count);
+    std::vector<graph_slam::EdgeSE3_GICP*> edges(count);
+    std::vector<envire::Pointcloud*> pointclouds(count);
+    graph_slam::VertexSE3_GICP* previous_vertex = last_vertex;
+    Eigen::Isometry3d odometry_pose_previous = odometry_pose_last_vertex;
+    Matrix6d odometry_covariance_previous = odometry_covariance_last_vertex;
+    for(unsigned i = 0; i < count; i++)
+    {
+        const BatchScan& scan = scans[first + i];
+        Eigen::Isometry3d odometry_pose(scan.transformation.getTransform().matrix());
+        Matrix6d odometry_covariance = switchEnvireG2oCov(scan.transformation.getCovariance());
+        Eigen::Isometry3d odometry_pose_delta = odometry_pose_previous.inverse() * odometry_pose;
+        Matrix6d odometry_covariance_delta = odometry_covariance - odometry_covariance_previous;
+
+        graph_slam::VertexSE3_GICP* vertex = new graph_slam::VertexSE3_GICP();
+        vertex->setId(next_vertex_id + i);
+        vertex->setEstimate(previous_vertex->estimate() * odometry_pose_delta);
+
+        graph_slam::EdgeSE3_GICP* edge = new graph_slam::EdgeSE3_GICP();
+        edge->setSourceVertex(previous_vertex);
+        edge->setTargetVertex(vertex);
+        edge->setGICPConfiguration(gicp_config);
+        edge->setMeasurement(odometry_pose_delta);
+        edge->setInformation((Matrix6d::Identity() + odometry_covariance_delta).inverse());
+
+        vertices[i] = vertex;
+        edges[i] = edge;
+        pointclouds[i] = scan.pointcloud;
+        previous_vertex = vertex;
+        odometry_pose_previous = odometry_pose;
+        odometry_covariance_previous = odometry_covariance;
     }
-    cov_graph.computeMarginals(spinv, vc);
 
-    // find new candidates
-    for(g2o::OptimizableGraph::VertexContainer::const_iterator it = _activeVertices.begin(); it != _activeVertices.end(); it++)
+    // downsample the pointclouds and align the odometry edges in parallel
+    std::vector<char> results(count, false);
+    try
     {
-        graph_slam::VertexSE3_GICP *vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(*it);
-        if(vertex && vertex->hasPointcloudAttached() && !vertex->getEdgeSearchState().has_run)
+        thread_pool->parallelFor(count, boost::bind(&attachScanPointcloud, &vertices, &pointclouds, &gicp_config, _1));
+        thread_pool->parallelFor(count, boost::bind(&runOdometryGICP, &results, &edges, _1));
+        if(std::find(results.begin(), results.end(), false) != results.end())
+            throw std::runtime_error("compute transformation using gicp failed!");
+    }
+    catch (...)
+    {
+        for(unsigned i = 0; i < count; i++)
         {
-            findEdgeCandidates(vertex->id(), spinv);
+            // attached pointclouds are released by their vertex
+            if(vertices[i]->getEnvirePointCloud().get() != pointclouds[i])
+                delete pointclouds[i];
+            delete edges[i];
+            delete vertices[i];
         }
+        throw;
+    }
+
+    // add the vertices and edges to the graph in chronological order, on a failure the batch is removed again
+    for(unsigned i = 0; i < count; i++)
+    {
+        bool vertex_added = g2o::SparseOptimizer::addVertex(vertices[i]);
+        if(!vertex_added || !g2o::SparseOptimizer::addEdge(edges[i]))
+        {
+            // removing a vertex also deletes its edges and its pointcloud
+            if(vertex_added)
+                g2o::SparseOptimizer::removeVertex(vertices[i]);
+            else
+                delete vertices[i];
+            delete edges[i];
+            for(unsigned j = i; j > 0; j--)
+                g2o::SparseOptimizer::removeVertex(vertices[j-1]);
+            for(unsigned j = i + 1; j < count; j++)
+            {
+                delete edges[j];
+                delete vertices[j];
+            }
+            throw std::runtime_error(vertex_added ? "failed to add a new edge." : "failed to add a new vertex.");
+        }
+    }
+
+    for(unsigned i = 0; i < count; i++)
+    {
+        graph_slam::VertexSE3_GICP* vertex = vertices[i];
+        graph_slam::EdgeSE3_GICP* edge = edges[i];
+        edges_to_add.insert(edge);
+        vertices_to_add.insert(vertex);
+        vertex_index.insert(vertex->id(), vertex->estimate().translation());
+        odometry_pose_last_vertex = Eigen::Isometry3d(scans[first + i].transformation.getTransform().matrix());
+        odometry_covariance_last_vertex = switchEnvireG2oCov(scans[first + i].transformation.getCovariance());
+        last_vertex = vertex;
+        next_vertex_id++;
+
+        // add pointcloud to environment
+        envire::FrameNode* framenode = new envire::FrameNode();
+        framenode->setTransform(Eigen::Affine3d(vertex->estimate().matrix()));
+        env->addChild(map2world_frame, framenode);
+        env->setFrameNode(pointclouds[i], framenode);
+        if(use_mls)
+            env->addInput(projection.get(), pointclouds[i]);
+    }
+
+    return scans.size();
+}
+
+bool ExtendedSparseOptimizer::removeVertex(int vertex_id)
+{
+    return removeVertices(std::vector<int>(1, vertex_id)) == 1;
+}
+
+unsigned ExtendedSparseOptimizer::removeVertices(const std::vector<int>& vertex_ids)
+{
+    bool elements_pending = !vertices_to_add.empty() || !edges_to_add.empty();
+    unsigned removed = 0;
+    for(std::vector<int>::const_iterator it = vertex_ids.begin(); it != vertex_ids.end(); it++)
+    {
+        graph_slam::VertexSE3_GICP *vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(this->vertex(*it));
+        if(vertex && isRemovable(vertex) && marginalizeVertex(vertex))
+            removed++;
+    }
+    if(removed == 0)
+        return 0;
+
+    // the index mapping of both graphs has been cleared by the removal
+    cov_graph.initializeOptimization();
+    cov_graph_initialized = false;
+    marginal_covariances.invalidateAll();
+    window_vertices.clear();
+    coarse_graph_initialized = false;
+    coarse_pending_vertices.clear();
+    coarse_pending_edges.clear();
+    if(initialized && !elements_pending)
+    {
+        // restore the indices, the sparsified edges are valid constraints
+        if(!initializeOptimization())
+            throw std::runtime_error("initialize optimization failed!");
+    }
+    // the sparsified edges are pending for the covariance graph, so the next optimization has to do a complete initialization
+    initialized = false;
+    map_update_necessary = true;
+    return removed;
+}
+
+bool ExtendedSparseOptimizer::isRemovable(const graph_slam::VertexSE3_GICP* vertex) const
+{
+    // the hessian index can't be used here, it is invalid after the first removal
+    if(vertex->fixed() || vertex == last_vertex || vertices_to_add.count(const_cast<graph_slam::VertexSE3_GICP*>(vertex)) ||
+       std::find(apriori_vertices.begin(), apriori_vertices.end(), vertex) != apriori_vertices.end())
+        return false;
+
+    // pending GICP edges might not have a valid measurement yet, other pending edges like the sparsified ones have
+    for(g2o::HyperGraph::EdgeSet::const_iterator it = vertex->edges().begin(); it != vertex->edges().end(); it++)
+    {
+        if(!dynamic_cast<const g2o::EdgeSE3*>(*it) || (edges_to_add.count(*it) && dynamic_cast<const graph_slam::EdgeSE3_GICP*>(*it)))
+            return false;
+    }
+    return true;
+}
+
+bool ExtendedSparseOptimizer::marginalizeVertex(graph_slam::VertexSE3_GICP* vertex)
+{
+    // the neighbors in ascending order of their ids, the vertex itself has the index zero
+    std::map<int, unsigned> indices;
+    indices[vertex->id()] = 0;
+    std::vector<graph_slam::VertexSE3_GICP*> neighbors;
+    for(g2o::HyperGraph::EdgeSet::const_iterator it = vertex->edges().begin(); it != vertex->edges().end(); it++)
+    {
+        for(unsigned i = 0; i < (*it)->vertices().size(); i++)
+        {
+            graph_slam::VertexSE3_GICP* neighbor = dynamic_cast<graph_slam::VertexSE3_GICP*>((*it)->vertices()[i]);
+            if(!neighbor)
+                return false;
+            if(neighbor != vertex)
+                indices[neighbor->id()] = 0;
+        }
+    }
+    for(std::map<int, unsigned>::iterator it = indices.begin(); it != indices.end(); it++)
+    {
+        if(it->first == vertex->id())
+            continue;
+        neighbors.push_back(dynamic_cast<graph_slam::VertexSE3_GICP*>(this->vertex(it->first)));
+        it->second = neighbors.size();
+    }
+
+    // linearize the edges at the current estimate
+    LinearizedConstraints constraints;
+    for(g2o::HyperGraph::EdgeSet::const_iterator it = vertex->edges().begin(); it != vertex->edges().end(); it++)
+    {
+        g2o::EdgeSE3* edge = dynamic_cast<g2o::EdgeSE3*>(*it);
+        edge->computeError();
+        edge->linearizeOplus();
+        LinearizedConstraint constraint;
+        constraint.from = indices[edge->vertices()[0]->id()];
+        constraint.to = indices[edge->vertices()[1]->id()];
+        constraint.jacobian_from = edge->jacobianOplusXi();
+        constraint.jacobian_to = edge->jacobianOplusXj();
+        constraint.information = edge->information();
+        constraints.push_back(constraint);
+    }
+
+    SparsifiedConstraints tree;
+    if(!sparsifyMarginal(neighbors.size(), constraints, tree))
+    {
+        std::cerr << "couldn't marginalize vertex with id " << vertex->id() << std::endl;
+        return false;
+    }
+
+    // remove the vertex and its edges from both graphs
+    int vertex_id = vertex->id();
+    if(vertex->hasPointcloudAttached())
+        detachPointcloud(vertex);
+    vertex_index.remove(vertex_id);
+    dirty_vertices.erase(vertex_id);
+    published_vertices.erase(vertex_id);
+    if(use_vertex_grid)
+        vertex_grid->removeVertex(vertex_id);
+    g2o::HyperGraph::Vertex* cov_vertex = cov_graph.vertex(vertex_id);
+    if(cov_vertex)
+        cov_graph.removeVertex(cov_vertex);
+    for(g2o::HyperGraph::EdgeSet::const_iterator it = vertex->edges().begin(); it != vertex->edges().end(); it++)
+        edges_to_add.erase(*it);
+    g2o::SparseOptimizer::removeVertex(vertex);
+
+    // add the sparsified constraints as plain SE3 edges, so they can't be taken for GICP measurements.
+    // The measurements are the current relative poses, the next optimization adds them to both graphs.
+    for(SparsifiedConstraints::const_iterator it = tree.begin(); it != tree.end(); it++)
+    {
+        graph_slam::VertexSE3_GICP* source_vertex = neighbors[it->from];
+        graph_slam::VertexSE3_GICP* target_vertex = neighbors[it->to];
+        g2o::EdgeSE3* edge = new g2o::EdgeSE3();
+        edge->vertices()[0] = source_vertex;
+        edge->vertices()[1] = target_vertex;
+        edge->setMeasurement(source_vertex->estimate().inverse() * target_vertex->estimate());
+        edge->setInformation(it->information);
+        if(!g2o::SparseOptimizer::addEdge(edge))
+        {
+            std::cerr << "failed to add a sparsified edge." << std::endl;
+            delete edge;
+            continue;
+        }
+        edges_to_add.insert(edge);
+    }
+
+    if(_verbose)
+        std::cerr << "removed vertex with id " << vertex_id << ", replaced by " << tree.size() << " sparsified edges" << std::endl;
+    return true;
+}
+
+bool ExtendedSparseOptimizer::removePointcloudFromVertex(int vertex_id)
+{
+    graph_slam::VertexSE3_GICP *vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(this->vertex(vertex_id));
+    return vertex && isHandledByOptimizer(vertex) && releasePointcloud(vertex);
+}
+
+bool ExtendedSparseOptimizer::releasePointcloud(graph_slam::VertexSE3_GICP* vertex)
+{
+    if(!vertex->hasPointcloudAttached())
+        return false;
+    detachPointcloud(vertex);
+    vertex_index.remove(vertex->id());
+    dirty_vertices.erase(vertex->id());
+    published_vertices.erase(vertex->id());
+    return true;
+}
+
+void ExtendedSparseOptimizer::detachPointcloud(graph_slam::VertexSE3_GICP* vertex)
+{
+    if(pointcloud_store)
+        pointcloud_store->removeVertex(vertex->id());
+
+    // remove pointcloud from vertex
+    envire::EnvironmentItem::Ptr envire_item = vertex->getEnvirePointCloud();
+    envire::Pointcloud* envire_pointcloud = dynamic_cast<envire::Pointcloud*>(envire_item.get());
+    vertex->detachPointCloud();
+
+    // remove pointcloud from envire
+    envire::FrameNode* fn = envire_pointcloud->getFrameNode();
+    if(use_mls)
+    {
+        // the footprint shares the framenode, so its cells are outdated as well
+        std::list<envire::CartesianMap*> maps = fn->getMaps();
+        for(std::list<envire::CartesianMap*>::const_iterator it = maps.begin(); it != maps.end(); it++)
+            mls_update.removePointcloud(dynamic_cast<envire::Pointcloud*>(*it));
+        env->removeInput(projection.get(), envire_pointcloud);
+    }
+    env->detachItem(fn, true);
+}
+
+void ExtendedSparseOptimizer::setupMaxVertexGrid(unsigned max_vertices_per_cell, double grid_size_x, double grid_size_y, double cell_resolution)
+{
+    if(vertex_grid.use_count() == 0)
+    {
+        vertex_grid.reset(new VertexGrid(grid_size_x, grid_size_y, cell_resolution, max_vertices_per_cell));
+        use_vertex_grid = true;
+    }
+    vertex_grid->setMaxVerticesPerCell(max_vertices_per_cell);
+}
+
+void ExtendedSparseOptimizer::removeVerticesFromGrid()
+{
+    if(!use_vertex_grid)
+        return;
+    std::vector<int> vertices;
+    vertex_grid->removeVertices(vertices);
+    if(vertices.empty())
+        return;
+
+    // the removal can invalidate the hessian indices, so the vertices handled by the optimizer are collected beforehand
+    std::vector<char> handled(vertices.size(), 0);
+    for(unsigned i = 0; i < vertices.size(); i++)
+    {
+        g2o::OptimizableGraph::Vertex* vertex = dynamic_cast<g2o::OptimizableGraph::Vertex*>(this->vertex(vertices[i]));
+        handled[i] = vertex && isHandledByOptimizer(vertex);
+    }
+    removeVertices(vertices);
+
+    // vertices which can't be removed completely at least release their pointclouds
+    for(unsigned i = 0; i < vertices.size(); i++)
+    {
+        graph_slam::VertexSE3_GICP *vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(this->vertex(vertices[i]));
+        if(!vertex)
+            continue;
+        if((!handled[i] || !releasePointcloud(vertex)) && _verbose)
+            std::cerr << "couldn't remove vertex with id " << vertices[i] << std::endl;
+        else if(_verbose)
+            std::cerr << "removed pointcloud of vertex with id " << vertices[i] << std::endl;
+    }
+}
+
+void ExtendedSparseOptimizer::findEdgeCandidates()
+{
+    retryRejectedLoopClosures();
+    if(loop_closure_worker)
+    {
+        submitLoopClosureSnapshot();
+        return;
+    }
+
+    // compute outdated marginals, afterwards the search only reads the cached ones
+    std::vector<int> vertex_ids;
+    std::vector<graph_slam::VertexSE3_GICP*> source_vertices;
+    for(g2o::OptimizableGraph::VertexContainer::const_iterator it = _activeVertices.begin(); it != _activeVertices.end(); it++)
+    {
+        graph_slam::VertexSE3_GICP *vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(*it);
+        if(!vertex || !vertex->hasPointcloudAttached())
+            continue;
+        if(isHandledByOptimizer(vertex) || vertex->fixed())
+            vertex_ids.push_back(vertex->id());
+        if(!vertex->getEdgeSearchState().has_run)
+            source_vertices.push_back(vertex);
         // TODO add a check for vertices, if the pose has significantly changed
     }
+    marginal_covariances.prepare(vertex_ids);
+    double max_target_variance = getMaxPositionVariance(vertex_ids);
+
+    // find new candidates in parallel
+    std::vector<EdgeCandidateList> candidates(source_vertices.size());
+    std::vector<char> searched(source_vertices.size(), false);
+    thread_pool->parallelFor(source_vertices.size(), boost::bind(&ExtendedSparseOptimizer::searchEdgeCandidatesTask, this,
+                                                                 &source_vertices, max_target_variance, &candidates, &searched, _1));
+
+    // the candidates are added in the order of the vertices, so the result doesn't depend on the scheduling
+    for(unsigned i = 0; i < source_vertices.size(); i++)
+    {
+        if(searched[i])
+            addEdgeCandidates(source_vertices[i], candidates[i]);
+    }
+}
+
+void ExtendedSparseOptimizer::searchEdgeCandidatesTask(const std::vector<graph_slam::VertexSE3_GICP*>* source_vertices, double max_target_variance,
+                                                       std::vector<EdgeCandidateList>* candidates, std::vector<char>* searched, size_t index)
+{
+    (*searched)[index] = searchEdgeCandidates((*source_vertices)[index], NULL, max_target_variance, (*candidates)[index]);
 }
 
 void ExtendedSparseOptimizer::findEdgeCandidates(int vertex_id, const g2o::SparseBlockMatrix<Eigen::MatrixXd>& spinv)
+{
+    findEdgeCandidates(vertex_id, &spinv, getMaxPositionVariance(spinv));
+}
+
+double ExtendedSparseOptimizer::getMaxPositionVariance(const g2o::SparseBlockMatrix<Eigen::MatrixXd>& spinv) const
+{
+    // the trace is an upper bound of the largest eigenvalue of a covariance matrix
+    double max_variance = apriori_vertices.empty() ? 0.0 : Eigen::Matrix3d::Identity().trace();
+    for(size_t i = 0; i < spinv.blockCols().size(); i++)
+    {
+        const Eigen::MatrixXd* block = spinv.block(i, i);
+        if(block)
+            max_variance = std::max(max_variance, block->topLeftCorner<3,3>().trace());
+    }
+    return max_variance;
+}
+
+double ExtendedSparseOptimizer::getMaxPositionVariance(const std::vector<int>& vertex_ids)
+{
+    double max_variance = apriori_vertices.empty() ? 0.0 : Eigen::Matrix3d::Identity().trace();
+    Matrix6d covariance;
+    for(std::vector<int>::const_iterator it = vertex_ids.begin(); it != vertex_ids.end(); it++)
+    {
+        if(marginal_covariances.getCovariance(covariance, *it))
+            max_variance = std::max(max_variance, covariance.topLeftCorner<3,3>().trace());
+    }
+    return max_variance;
+}
+
+void ExtendedSparseOptimizer::findEdgeCandidates(int vertex_id, const g2o::SparseBlockMatrix<Eigen::MatrixXd>* spinv, double max_target_variance)
 {
     graph_slam::VertexSE3_GICP *source_vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(this->vertex(vertex_id));
+    EdgeCandidateList candidates;
+    if(source_vertex && searchEdgeCandidates(source_vertex, spinv, max_target_variance, candidates))
+        addEdgeCandidates(source_vertex, candidates);
+}
+
+bool ExtendedSparseOptimizer::searchEdgeCandidates(const graph_slam::VertexSE3_GICP* source_vertex, const g2o::SparseBlockMatrix<Eigen::MatrixXd>* spinv,
+                                                   double max_target_variance, EdgeCandidateList& candidates)
+{
     Matrix6d source_covariance;
-    if(source_vertex && source_vertex->hasPointcloudAttached() && getVertexCovariance(source_covariance, source_vertex, spinv))
+    if(!source_vertex->hasPointcloudAttached() || 
+       !(spinv ? getVertexCovariance(source_covariance, source_vertex, *spinv) : getCachedVertexCovariance(source_covariance, source_vertex)))
+        return false;
+
+    // A mahalanobis distance below the max sensor distance can only occur within 
+    // max_sensor_distance * sqrt(largest eigenvalue of the combined position covariance).
+    int vertex_id = source_vertex->id();
+    double max_variance = source_covariance.topLeftCorner<3,3>().trace() + max_target_variance;
+    double search_radius = gicp_config.max_sensor_distance * std::sqrt(std::max(1.0, max_variance));
+    std::vector<int> vertex_ids;
+    vertex_index.query(source_vertex->estimate().translation(), search_radius, vertex_ids);
+
+    for(std::vector<int>::const_iterator it = vertex_ids.begin(); it != vertex_ids.end(); it++)
     {
-        // search in active vertices
-        for(g2o::OptimizableGraph::VertexContainer::iterator it = _activeVertices.begin(); it != _activeVertices.end(); it++)
+        if(!(vertex_id < *it-1 || vertex_id > *it+1))
+            continue;
+
+        // the target is either an active or an a-priori vertex
+        graph_slam::VertexSE3_GICP *target_vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(this->vertex(*it));
+        bool apriori_target_vertex = false;
+        if(!target_vertex)
+        {
+            target_vertex = getAPrioriVertex(*it);
+            apriori_target_vertex = true;
+        }
+        if(!target_vertex || !target_vertex->hasPointcloudAttached())
+            continue;
+
+        // check if vertices have already an edge
+        unsigned equal_edges = 0;
+        for(g2o::HyperGraph::EdgeSet::const_iterator sv_edge = source_vertex->edges().begin(); sv_edge != source_vertex->edges().end(); sv_edge++)
         {
-            graph_slam::VertexSE3_GICP *target_vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(*it);
-            if(target_vertex && target_vertex->hasPointcloudAttached() && (vertex_id < target_vertex->id()-1 || vertex_id > target_vertex->id()+1))
+            equal_edges += target_vertex->edges().count(*sv_edge);
+        }
+        
+        // there should never be more than one edge between two vertices
+        assert(equal_edges <= 1);
+        if(equal_edges != 0)
+            continue;
+        
+        Matrix6d target_covariance = Matrix6d::Identity();
+        if(!apriori_target_vertex && 
+           !(spinv ? getVertexCovariance(target_covariance, target_vertex, *spinv) : getCachedVertexCovariance(target_covariance, target_vertex)))
+            continue;
+        
+        // try to add a new edge
+        Eigen::Matrix3d position_covariance = source_covariance.topLeftCorner<3,3>() + target_covariance.topLeftCorner<3,3>();
+        
+        double mahalanobis_distance = computeMahalanobisDistance<double, 3>(source_vertex->estimate().translation(), 
+                                                                position_covariance, 
+                                                                target_vertex->estimate().translation());
+        double euclidean_distance = (target_vertex->estimate().translation() - source_vertex->estimate().translation()).norm();
+        double distance = mahalanobis_distance > euclidean_distance ? euclidean_distance : mahalanobis_distance;
+        
+        if(distance <= gicp_config.max_sensor_distance)
+            candidates.push_back(std::make_pair(target_vertex->id(), distance));
+    }
+    return true;
+}
+
+void ExtendedSparseOptimizer::addEdgeCandidates(graph_slam::VertexSE3_GICP* source_vertex, const EdgeCandidateList& candidates)
+{
+    for(EdgeCandidateList::const_iterator it = candidates.begin(); it != candidates.end(); it++)
+    {
+        graph_slam::VertexSE3_GICP *target_vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(this->vertex(it->first));
+        if(!target_vertex)
+            target_vertex = getAPrioriVertex(it->first);
+        if(!target_vertex)
+            continue;
+        source_vertex->addEdgeCandidate(target_vertex->id(), it->second);
+        target_vertex->addEdgeCandidate(source_vertex->id(), it->second);
+        new_edges_added = true;
+    }
+
+    // save search pose
+    source_vertex->setEdgeSearchState(true, source_vertex->estimate());
+}
+
+bool ExtendedSparseOptimizer::selectBestEdgeCandidate(EdgeCandidateSelection& selection)
+{
+    while(true)
+    {
+        // get vertex with highest missing edge error, the queue contains all 
+        // optimized vertices with pointcloud and a missing edge error above zero
+        if(edge_candidate_queue.empty())
+            return false;
+        graph_slam::VertexSE3_GICP* source_vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(this->vertex(edge_candidate_queue.top()));
+        if(!source_vertex)
+        {
+            edge_candidate_queue.pop();
+            continue;
+        }
+        
+        VertexSE3_GICP::EdgeCandidate candidate;
+        int target_id;
+        if(source_vertex && source_vertex->getBestEdgeCandidate(candidate, target_id))
+        {
+            graph_slam::VertexSE3_GICP *target_vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(this->vertex(target_id));
+
+            // check if vertex is a a-priori vertex
+            bool apriori_target_vertex = false;
+            if(!target_vertex)
             {
-                // check if vertices have already an edge
-                unsigned equal_edges = 0;
-                for(g2o::HyperGraph::EdgeSet::const_iterator sv_edge = source_vertex->edges().begin(); sv_edge != source_vertex->edges().end(); sv_edge++)
-                {
-                    equal_edges += target_vertex->edges().count(*sv_edge);
-                }
-                
-                // there should never be more than one edge between two vertices
-                assert(equal_edges <= 1);
-                
-                Matrix6d target_covariance;
-                if(equal_edges == 0 && getVertexCovariance(target_covariance, target_vertex, spinv))
-                {
-                    // try to add a new edge
-                    Eigen::Matrix3d position_covariance = source_covariance.topLeftCorner<3,3>() + target_covariance.topLeftCorner<3,3>();
-                    
-                    double mahalanobis_distance = computeMahalanobisDistance<double, 3>(source_vertex->estimate().translation(), 
-                                                                            position_covariance, 
-                                                                            target_vertex->estimate().translation());
-                    double euclidean_distance = (target_vertex->estimate().translation() - source_vertex->estimate().translation()).norm();
-                    double distance = mahalanobis_distance > euclidean_distance ? euclidean_distance : mahalanobis_distance;
-                    
-                    if(distance <= gicp_config.max_sensor_distance)
-                    {
-                        source_vertex->addEdgeCandidate(target_vertex->id(), distance);
-                        target_vertex->addEdgeCandidate(source_vertex->id(), distance);
-                        new_edges_added = true;
-                    }
-                }
+                target_vertex = getAPrioriVertex(target_id);
+                apriori_target_vertex = target_vertex != NULL;
+            }
+
+            if(!target_vertex || !target_vertex->hasPointcloudAttached() || 
+               !loadPointcloud(source_vertex) || !loadPointcloud(target_vertex))
+            {
+                source_vertex->removeEdgeCandidate(target_id);
+                continue;
             }
+            
+            selection.source_vertex = source_vertex;
+            selection.target_vertex = target_vertex;
+            selection.candidate = candidate;
+            selection.apriori_target_vertex = apriori_target_vertex;
+            return true;
+        }
+    }
+}
+
+void ExtendedSparseOptimizer::selectBestEdgeCandidates(std::vector<EdgeCandidateSelection>& selections, unsigned count)
+{
+    selections.clear();
+    while(selections.size() < count)
+    {
+        EdgeCandidateSelection selection;
+        if(!selectBestEdgeCandidate(selection))
+        {
+            new_edges_added = false;
+            break;
+        }
+        
+        // mark the candidate as tested, this removes its error in the same way 
+        // as the serial case does, so the next selection will be the same
+        selection.source_vertex->updateEdgeCandidate(selection.target_vertex->id(), true);
+        selection.target_vertex->updateEdgeCandidate(selection.source_vertex->id(), true);
+        selections.push_back(selection);
+    }
+}
+
+graph_slam::EdgeSE3_GICP* ExtendedSparseOptimizer::createCandidateEdge(const EdgeCandidateSelection& selection)
+{
+    graph_slam::EdgeSE3_GICP* edge = new graph_slam::EdgeSE3_GICP();
+    edge->setSourceVertex(selection.source_vertex);
+    edge->setTargetVertex(selection.target_vertex);
+    edge->setGICPConfiguration(gicp_config);
+    edge->useCoarseToFine(true);
+    return edge;
+}
+
+void ExtendedSparseOptimizer::handleTestedEdgeCandidate(EdgeCandidateSelection& selection)
+{
+    graph_slam::VertexSE3_GICP* source_vertex = selection.source_vertex;
+    graph_slam::VertexSE3_GICP* target_vertex = selection.target_vertex;
+    graph_slam::EdgeSE3_GICP* edge = selection.edge;
+    selection.edge = NULL;
+    
+    if(!selection.gicp_result)
+    {
+        delete edge;
+        throw std::runtime_error("compute transformation using gicp failed!");
+    }
+    
+    // add the new edge to the graph if the icp allignment was successful and agrees with the graph
+    if(edge->hasValidGICPMeasurement() && isConsistentLoopClosure(edge))
+    {
+        setLoopClosureKernel(edge, loop_closure_config.robust_kernel_width);
+        if(g2o::SparseOptimizer::addEdge(edge))
+        {
+            edges_to_add.insert(edge);
+            loop_closure_added = true;
+            loop_closure_count++;
+            rejected_loop_closures.erase(std::make_pair(std::min(source_vertex->id(), target_vertex->id()), std::max(source_vertex->id(), target_vertex->id())));
+            source_vertex->removeEdgeCandidate(target_vertex->id());
+            target_vertex->removeEdgeCandidate(source_vertex->id());
+
+            if(selection.apriori_target_vertex)
+                attachAPrioriMap();
+
+            if(_verbose)
+                std::cerr << "Added new edge between vertex " << source_vertex->id() << " and " << target_vertex->id() 
+                            << ". Mahalanobis distance was " << selection.candidate.mahalanobis_distance << ", edge error was " << selection.candidate.error << std::endl;
+        }
+        else
+        {
+            std::cerr << "failed to add a new edge." << std::endl;
+            delete edge;
+        }
+    }
+    else
+    {
+        // the alignment might agree with the graph once it has been corrected by other edges
+        if(edge->hasValidGICPMeasurement())
+            rejectLoopClosure(edge, selection.candidate.mahalanobis_distance);
+        delete edge;
+        source_vertex->updateEdgeCandidate(target_vertex->id(), true);
+        target_vertex->updateEdgeCandidate(source_vertex->id(), true);
+    }
+}
+
+void ExtendedSparseOptimizer::rejectLoopClosure(const graph_slam::EdgeSE3_GICP* edge, double mahalanobis_distance)
+{
+    const graph_slam::VertexSE3_GICP* source_vertex = static_cast<const graph_slam::VertexSE3_GICP*>(edge->vertices()[0]);
+    const graph_slam::VertexSE3_GICP* target_vertex = static_cast<const graph_slam::VertexSE3_GICP*>(edge->vertices()[1]);
+    RejectedLoopClosure& rejected = rejected_loop_closures[std::make_pair(std::min(source_vertex->id(), target_vertex->id()), 
+                                                                          std::max(source_vertex->id(), target_vertex->id()))];
+    rejected.relative_pose = source_vertex->id() < target_vertex->id() ? source_vertex->estimate().inverse() * target_vertex->estimate() :
+                                                                         target_vertex->estimate().inverse() * source_vertex->estimate();
+    rejected.loop_closure_count = loop_closure_count;
+    rejected.mahalanobis_distance = mahalanobis_distance;
+    rejected.rejections++;
+    rejected.retry_pending = false;
+}
+
+void ExtendedSparseOptimizer::retryRejectedLoopClosures()
+{
+    for(RejectedLoopClosures::iterator it = rejected_loop_closures.begin(); it != rejected_loop_closures.end();)
+    {
+        graph_slam::VertexSE3_GICP *source_vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(this->vertex(it->first.first));
+        graph_slam::VertexSE3_GICP *target_vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(this->vertex(it->first.second));
+        if(!source_vertex)
+            source_vertex = getAPrioriVertex(it->first.first);
+        if(!target_vertex)
+            target_vertex = getAPrioriVertex(it->first.second);
+        if(!source_vertex || !target_vertex)
+        {
+            rejected_loop_closures.erase(it++);
+            continue;
+        }
+
+        // a pair is only retried a limited number of times and only if the graph has changed since its rejection
+        RejectedLoopClosure& rejected = it->second;
+        Eigen::Isometry3d relative_pose = source_vertex->estimate().inverse() * target_vertex->estimate();
+        if(rejected.retry_pending || rejected.rejections > loop_closure_config.max_retries ||
+           (rejected.loop_closure_count == loop_closure_count && 
+            (relative_pose.translation() - rejected.relative_pose.translation()).norm() <= loop_closure_config.retry_distance))
+        {
+            it++;
+            continue;
+        }
+
+        if(loop_closure_worker)
+        {
+            LoopClosureWorker::Retry retry;
+            retry.source_id = source_vertex->id();
+            retry.target_id = target_vertex->id();
+            retry.mahalanobis_distance = rejected.mahalanobis_distance;
+            loop_closure_retries.push_back(retry);
+        }
+        else
+        {
+            source_vertex->updateEdgeCandidate(target_vertex->id(), false);
+            target_vertex->updateEdgeCandidate(source_vertex->id(), false);
+            new_edges_added = true;
+        }
+        rejected.retry_pending = true;
+        it++;
+    }
+}
+
+bool ExtendedSparseOptimizer::isConsistentLoopClosure(graph_slam::EdgeSE3_GICP* edge)
+{
+    if(loop_closure_config.max_innovation_chi2 <= 0.0)
+        return true;
+
+    // The joint marginal of both vertices is used. The covariances of vertices which are not yet optimized are unknown,
+    // for them a unit covariance without any correlation is assumed, like in the candidate search. 
+    // Depending on the odometry since the last optimization, the gate is too wide or too narrow for such vertices.
+    const g2o::OptimizableGraph::Vertex* source = static_cast<const g2o::OptimizableGraph::Vertex*>(edge->vertices()[0]);
+    const g2o::OptimizableGraph::Vertex* target = static_cast<const g2o::OptimizableGraph::Vertex*>(edge->vertices()[1]);
+    Matrix6d source_covariance, target_covariance, cross_covariance;
+    bool source_known = getVertexCovariance(source_covariance, source);
+    bool target_known = getVertexCovariance(target_covariance, target);
+    if(!source_known)
+        source_covariance = Matrix6d::Identity();
+    if(!target_known)
+        target_covariance = Matrix6d::Identity();
+    if(!source_known || !target_known || !marginal_covariances.getCrossCovariance(cross_covariance, source->id(), target->id()))
+        cross_covariance = Matrix6d::Zero();
+
+    // innovation of the edge at the current estimate and its covariance
+    edge->computeError();
+    edge->linearizeOplus();
+    Matrix6d correlation = edge->jacobianOplusXi() * cross_covariance * edge->jacobianOplusXj().transpose();
+    Matrix6d innovation_covariance = edge->jacobianOplusXi() * source_covariance * edge->jacobianOplusXi().transpose() +
+                                     edge->jacobianOplusXj() * target_covariance * edge->jacobianOplusXj().transpose() +
+                                     correlation + correlation.transpose() + edge->information().inverse();
+    Eigen::LDLT<Matrix6d> ldlt(innovation_covariance);
+    double chi2 = edge->error().dot(ldlt.solve(edge->error()));
+    if(chi2 <= loop_closure_config.max_innovation_chi2)
+        return true;
+
+    if(_verbose)
+        std::cerr << "Rejected edge between vertex " << edge->vertices()[0]->id() << " and " << edge->vertices()[1]->id() 
+                    << ". Innovation chi2 was " << chi2 << std::endl;
+    return false;
+}
+
+void ExtendedSparseOptimizer::setLoopClosureKernel(g2o::OptimizableGraph::Edge* edge, double width) const
+{
+    edge->setRobustKernel(createRobustKernel(loop_closure_config.robust_kernel, width));
+}
+
+void ExtendedSparseOptimizer::tryBestEdgeCandidates(unsigned count)
+{
+    if(!new_edges_added || loop_closure_worker)
+        return;
+
+    if(thread_pool->getThreadCount() > 1 && count > 1)
+    {
+        tryBestEdgeCandidatesParallel(count);
+        return;
+    }
+
+    unsigned edge_candidates_tested = 0;
+    while(edge_candidates_tested < count)
+    {
+        EdgeCandidateSelection selection;
+        if(!selectBestEdgeCandidate(selection))
+        {
+            new_edges_added = false;
+            return;
         }
         
-        // search in a-priori vertices
-        for(std::vector<graph_slam::VertexSE3_GICP*>::iterator it = apriori_vertices.begin(); it != apriori_vertices.end(); it++)
+        selection.edge = createCandidateEdge(selection);
+        selection.gicp_result = selection.edge->setMeasurementFromGICP();
+        handleTestedEdgeCandidate(selection);
+        edge_candidates_tested++;
+    }
+}
+
+/** Runs the GICP alignment of a single selected candidate */
+static void runCandidateGICP(std::vector<char>* results, const std::vector<graph_slam::EdgeSE3_GICP*>* edges, size_t index)
+{
+    (*results)[index] = (*edges)[index]->setMeasurementFromGICP();
+}
+
+void ExtendedSparseOptimizer::tryBestEdgeCandidatesParallel(unsigned count)
+{
+    // select the best candidates up front
+    std::vector<EdgeCandidateSelection> selections;
+    selectBestEdgeCandidates(selections, count);
+    
+    if(selections.empty())
+        return;
+    
+    // run the alignments in parallel
+    std::vector<graph_slam::EdgeSE3_GICP*> edges(selections.size());
+    std::vector<char> results(selections.size(), false);
+    for(unsigned i = 0; i < selections.size(); i++)
+        edges[i] = createCandidateEdge(selections[i]);
+    try
+    {
+        thread_pool->parallelFor(edges.size(), boost::bind(&runCandidateGICP, &results, &edges, _1));
+    }
+    catch (...)
+    {
+        for(unsigned i = 0; i < edges.size(); i++)
+            delete edges[i];
+        throw;
+    }
+    
+    // add the valid edges in order of selection
+    for(unsigned i = 0; i < selections.size(); i++)
+    {
+        EdgeCandidateSelection& selection = selections[i];
+        selection.edge = edges[i];
+        selection.gicp_result = results[i];
+        if(selection.gicp_result && selection.edge->hasValidGICPMeasurement())
+        {
+            // undo the test mark, so the candidate can be removed
+            selection.source_vertex->updateEdgeCandidate(selection.target_vertex->id(), false);
+            selection.target_vertex->updateEdgeCandidate(selection.source_vertex->id(), false);
+        }
+        try
+        {
+            handleTestedEdgeCandidate(selection);
+        }
+        catch (...)
+        {
+            for(unsigned j = i + 1; j < edges.size(); j++)
+                delete edges[j];
+            throw;
+        }
+    }
+}
+
+void ExtendedSparseOptimizer::setWorkerThreadCount(unsigned threads)
+{
+    if(threads != thread_pool->getThreadCount())
+        thread_pool.reset(new ThreadPool(threads));
+}
+
+void ExtendedSparseOptimizer::setAsyncLoopClosure(bool enable, unsigned alignments_per_snapshot)
+{
+    async_alignments_per_snapshot = alignments_per_snapshot;
+    if(enable && !loop_closure_worker)
+        loop_closure_worker.reset(new LoopClosureWorker());
+    else if(!enable && loop_closure_worker)
+    {
+        // waits for the current snapshot, results which haven't been added yet are dropped
+        loop_closure_worker->clear();
+        loop_closure_worker.reset();
+    }
+}
+
+/** Orders vertices by their id */
+static bool compareVertexId(const graph_slam::VertexSE3_GICP* vertex, int vertex_id)
+{
+    return vertex->id() < vertex_id;
+}
+
+graph_slam::VertexSE3_GICP* ExtendedSparseOptimizer::getAPrioriVertex(int vertex_id) const
+{
+    // the a-priori vertices are sorted by id
+    std::vector<graph_slam::VertexSE3_GICP*>::const_iterator it = std::lower_bound(apriori_vertices.begin(), apriori_vertices.end(), vertex_id, compareVertexId);
+    if(it != apriori_vertices.end() && (*it)->id() == vertex_id)
+        return *it;
+    return NULL;
+}
+
+void ExtendedSparseOptimizer::submitLoopClosureSnapshot()
+{
+    // don't block if the worker is still busy with the last snapshot
+    if(loop_closure_worker->isBusy())
+        return;
+
+    // check if there are vertices which haven't been searched yet
+    VertexContainer vc;
+    std::vector<int> vertex_ids;
+    bool search_pending = false;
+    for(g2o::OptimizableGraph::VertexContainer::const_iterator it = _activeVertices.begin(); it != _activeVertices.end(); it++)
+    {
+        graph_slam::VertexSE3_GICP *vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(*it);
+        if(vertex && vertex->hasPointcloudAttached() && isHandledByOptimizer(vertex))
+        {
+            vc.push_back(vertex);
+            vertex_ids.push_back(vertex->id());
+            if(!vertex->getEdgeSearchState().has_run)
+                search_pending = true;
+        }
+    }
+    if(!search_pending && loop_closure_retries.empty())
+        return;
+
+    // compute outdated marginals
+    marginal_covariances.prepare(vertex_ids);
+
+    // load the spilled vertices in the search radius of the pending vertices, as the worker can't load them
+    if(pointcloud_store)
+    {
+        double max_target_variance = getMaxPositionVariance(vertex_ids);
+        std::vector<int> target_ids;
+        Matrix6d covariance;
+        for(VertexContainer::const_iterator it = vc.begin(); it != vc.end(); it++)
         {
-            graph_slam::VertexSE3_GICP *target_vertex = *it;
-            if(target_vertex && target_vertex->hasPointcloudAttached() && (vertex_id < target_vertex->id()-1 || vertex_id > target_vertex->id()+1))
+            graph_slam::VertexSE3_GICP *vertex = static_cast<graph_slam::VertexSE3_GICP*>(*it);
+            if(vertex->getEdgeSearchState().has_run || !getVertexCovariance(covariance, vertex))
+                continue;
+            if(!loadPointcloud(vertex))
+                std::cerr << "failed to load the pointcloud of vertex " << vertex->id() << std::endl;
+
+            double max_variance = covariance.topLeftCorner<3,3>().trace() + max_target_variance;
+            double search_radius = gicp_config.max_sensor_distance * std::sqrt(std::max(1.0, max_variance));
+            vertex_index.query(vertex->estimate().translation(), search_radius, target_ids);
+            for(std::vector<int>::const_iterator target_id = target_ids.begin(); target_id != target_ids.end(); target_id++)
             {
-                // check if vertices have already an edge
-                unsigned equal_edges = 0;
-                for(g2o::HyperGraph::EdgeSet::const_iterator sv_edge = source_vertex->edges().begin(); sv_edge != source_vertex->edges().end(); sv_edge++)
-                {
-                    equal_edges += target_vertex->edges().count(*sv_edge);
-                }
-                
-                // there should never be more than one edge between two vertices
-                assert(equal_edges <= 1);
-                
-                Matrix6d target_covariance = Matrix6d::Identity();
-                if(equal_edges == 0)
-                {
-                    // try to add a new edge
-                    Eigen::Matrix3d position_covariance = source_covariance.topLeftCorner<3,3>() + target_covariance.topLeftCorner<3,3>();
-                    
-                    double mahalanobis_distance = computeMahalanobisDistance<double, 3>(source_vertex->estimate().translation(), 
-                                                                            position_covariance, 
-                                                                            target_vertex->estimate().translation());
-                    double euclidean_distance = (target_vertex->estimate().translation() - source_vertex->estimate().translation()).norm();
-                    double distance = mahalanobis_distance > euclidean_distance ? euclidean_distance : mahalanobis_distance;
-                    
-                    if(distance <= gicp_config.max_sensor_distance)
-                    {
-                        source_vertex->addEdgeCandidate(target_vertex->id(), distance);
-                        target_vertex->addEdgeCandidate(source_vertex->id(), distance);
-                        new_edges_added = true;
-                    }
-                }
+                graph_slam::VertexSE3_GICP *target = dynamic_cast<graph_slam::VertexSE3_GICP*>(this->vertex(*target_id));
+                if(target && pointcloud_store->isSpilled(target->id()) && !loadPointcloud(target))
+                    std::cerr << "failed to load the pointcloud of vertex " << target->id() << std::endl;
+            }
+        }
+    }
+
+    // create snapshot of the active vertices
+    LoopClosureWorker::Snapshot snapshot;
+    snapshot.gicp_config = gicp_config;
+    snapshot.max_alignments = async_alignments_per_snapshot;
+    snapshot.retries.swap(loop_closure_retries);
+    snapshot.vertices.reserve(vc.size() + apriori_vertices.size());
+    for(VertexContainer::const_iterator it = vc.begin(); it != vc.end(); it++)
+    {
+        graph_slam::VertexSE3_GICP *vertex = static_cast<graph_slam::VertexSE3_GICP*>(*it);
+        Matrix6d covariance;
+        if((pointcloud_store && pointcloud_store->isSpilled(vertex->id())) || !getVertexCovariance(covariance, vertex))
+            continue;
+
+        LoopClosureWorker::VertexSnapshot vertex_snapshot;
+        vertex_snapshot.id = vertex->id();
+        vertex_snapshot.pose = vertex->estimate();
+        vertex_snapshot.position_covariance = covariance.topLeftCorner<3,3>();
+        vertex_snapshot.pointcloud = vertex->getGICPPointCloud();
+        if(!vertex->getEdgeSearchState().has_run)
+        {
+            vertex_snapshot.search_pending = true;
+            for(g2o::HyperGraph::EdgeSet::const_iterator edge = vertex->edges().begin(); edge != vertex->edges().end(); edge++)
+            {
+                for(std::vector<g2o::HyperGraph::Vertex*>::const_iterator v = (*edge)->vertices().begin(); v != (*edge)->vertices().end(); v++)
+                    vertex_snapshot.connected_vertices.insert((*v)->id());
             }
+            vertex->setEdgeSearchState(true, vertex->estimate());
         }
+        snapshot.vertices.push_back(vertex_snapshot);
+    }
 
-        // save search pose
-        source_vertex->setEdgeSearchState(true, source_vertex->estimate());
+    // add a-priori vertices
+    for(std::vector<graph_slam::VertexSE3_GICP*>::const_iterator it = apriori_vertices.begin(); it != apriori_vertices.end(); it++)
+    {
+        graph_slam::VertexSE3_GICP *vertex = *it;
+        if(!vertex->hasPointcloudAttached())
+            continue;
+        LoopClosureWorker::VertexSnapshot vertex_snapshot;
+        vertex_snapshot.id = vertex->id();
+        vertex_snapshot.pose = vertex->estimate();
+        vertex_snapshot.position_covariance = Eigen::Matrix3d::Identity();
+        vertex_snapshot.pointcloud = vertex->getGICPPointCloud();
+        snapshot.vertices.push_back(vertex_snapshot);
     }
+
+    loop_closure_worker->process(snapshot);
 }
 
-void ExtendedSparseOptimizer::tryBestEdgeCandidates(unsigned count)
+void ExtendedSparseOptimizer::addAsyncLoopClosures()
 {
-    if(!new_edges_added)
+    LoopClosureWorker::LoopClosures loop_closures;
+    if(!loop_closure_worker->takeLoopClosures(loop_closures))
         return;
 
-    unsigned edge_candidates_tested = 0;
-    while(edge_candidates_tested < count)
+    for(LoopClosureWorker::LoopClosures::const_iterator it = loop_closures.begin(); it != loop_closures.end(); it++)
     {
-        // get vertex with highest missing edge error
-        double vertex_error = 0.0;
-        graph_slam::VertexSE3_GICP* source_vertex = NULL;
-        for(g2o::OptimizableGraph::VertexContainer::iterator it = _activeVertices.begin(); it != _activeVertices.end(); it++)
+        graph_slam::VertexSE3_GICP *source_vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(this->vertex(it->source_id));
+        graph_slam::VertexSE3_GICP *target_vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(this->vertex(it->target_id));
+        bool apriori_vertex = false;
+        if(!source_vertex)
         {
-            graph_slam::VertexSE3_GICP* vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(*it);
-            if(vertex && vertex->hasPointcloudAttached() && vertex->getMissingEdgesError() > vertex_error)
-            {
-                vertex_error = vertex->getMissingEdgesError();
-                source_vertex = vertex;
-            }
+            source_vertex = getAPrioriVertex(it->source_id);
+            apriori_vertex = source_vertex != NULL;
         }
-        
-        if(vertex_error == 0.0)
+        if(!target_vertex)
         {
-            new_edges_added = false;
-            return;
+            target_vertex = getAPrioriVertex(it->target_id);
+            apriori_vertex = apriori_vertex || target_vertex != NULL;
         }
-        
-        VertexSE3_GICP::EdgeCandidate candidate;
-        int target_id;
-        if(source_vertex && source_vertex->getBestEdgeCandidate(candidate, target_id))
-        {
-            graph_slam::VertexSE3_GICP *target_vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(this->vertex(target_id));
 
-            // check if vertex is a a-priori vertex
-            bool apriori_target_vertex = false;
-            if(!target_vertex && !apriori_vertices.empty())
+        // the vertices might have been removed in the meantime
+        if(!source_vertex || !target_vertex || !source_vertex->hasPointcloudAttached() || !target_vertex->hasPointcloudAttached())
+            continue;
+
+        // the vertices might have been connected in the meantime, e.g. by an earlier result of this batch
+        bool connected = false;
+        for(g2o::HyperGraph::EdgeSet::const_iterator edge = source_vertex->edges().begin(); edge != source_vertex->edges().end() && !connected; edge++)
+        {
+            for(std::vector<g2o::HyperGraph::Vertex*>::const_iterator v = (*edge)->vertices().begin(); v != (*edge)->vertices().end(); v++)
             {
-                for(std::vector<graph_slam::VertexSE3_GICP*>::iterator it = apriori_vertices.begin(); it != apriori_vertices.end(); it++)
+                if(*v == target_vertex)
                 {
-                    if(target_id == (*it)->id())
-                    {
-                        target_vertex = *it;
-                        apriori_target_vertex = true;
-                        break;
-                    }
+                    connected = true;
+                    break;
                 }
             }
+        }
+        if(connected)
+            continue;
 
-            if(!target_vertex || !target_vertex->hasPointcloudAttached())
-            {
-                source_vertex->removeEdgeCandidate(target_id);
-                continue;
-            }
-            
-            graph_slam::EdgeSE3_GICP* edge = new graph_slam::EdgeSE3_GICP();
-            edge->setSourceVertex(source_vertex);
-            edge->setTargetVertex(target_vertex);
-            edge->setGICPConfiguration(gicp_config);
+        graph_slam::EdgeSE3_GICP* edge = new graph_slam::EdgeSE3_GICP();
+        edge->setSourceVertex(source_vertex);
+        edge->setTargetVertex(target_vertex);
+        edge->setGICPConfiguration(gicp_config);
+        edge->useCoarseToFine(true);
+        edge->setGICPMeasurement(it->measurement, it->information, it->fitness_score);
 
-            if(!edge->setMeasurementFromGICP())
-                throw std::runtime_error("compute transformation using gicp failed!");
-            
-            // add the new edge to the graph if the icp allignment was successful
-            if(edge->hasValidGICPMeasurement())
-            {
-                if(g2o::SparseOptimizer::addEdge(edge))
-                {
-                    edges_to_add.insert(edge);
-                    source_vertex->removeEdgeCandidate(target_id);
-                    target_vertex->removeEdgeCandidate(source_vertex->id());
+        // the graph might have changed since the snapshot was taken
+        if(!isConsistentLoopClosure(edge))
+        {
+            rejectLoopClosure(edge, it->mahalanobis_distance);
+            delete edge;
+            continue;
+        }
+        setLoopClosureKernel(edge, loop_closure_config.robust_kernel_width);
 
-                    if(apriori_target_vertex)
-                        attachAPrioriMap();
+        if(g2o::SparseOptimizer::addEdge(edge))
+        {
+            edges_to_add.insert(edge);
+            loop_closure_added = true;
+            loop_closure_count++;
+            rejected_loop_closures.erase(std::make_pair(std::min(source_vertex->id(), target_vertex->id()), std::max(source_vertex->id(), target_vertex->id())));
 
-                    if(_verbose)
-                        std::cerr << "Added new edge between vertex " << source_vertex->id() << " and " << target_vertex->id() 
-                                    << ". Mahalanobis distance was " << candidate.mahalanobis_distance << ", edge error was " << candidate.error << std::endl;
-                }
-                else
-                {
-                    std::cerr << "failed to add a new edge." << std::endl;
-                    delete edge;
-                }
-            }
-            else
-            {
-                delete edge;
-                source_vertex->updateEdgeCandidate(target_id, true);
-                target_vertex->updateEdgeCandidate(source_vertex->id(), true);
-            }
-            edge_candidates_tested++;
+            if(apriori_vertex)
+                attachAPrioriMap();
+
+            if(_verbose)
+                std::cerr << "Added new edge between vertex " << source_vertex->id() << " and " << target_vertex->id() 
+                            << ". Mahalanobis distance was " << it->mahalanobis_distance << std::endl;
+        }
+        else
+        {
+            std::cerr << "failed to add a new edge." << std::endl;
+            delete edge;
         }
     }
 }
 
 int ExtendedSparseOptimizer::optimize(int iterations, bool online)
 {
+    // add edges found by the loop closure worker
+    if(loop_closure_worker)
+        addAsyncLoopClosures();
+
+    // load and attach the a-priori vertices in range
+    streamAPrioriMap();
+
     if(activeVertices().size() == 0 && vertices_to_add.size() < 2)
     {
         // nothing to optimize
         return 0;
     }
 
+    // the flag might still be set by the early termination of the last optimization
+    terminate_flag = false;
+    window_vertices.clear();
+
     int err = -1;
     if(vertices_to_add.size() || edges_to_add.size())
     {
         // Update the cov graph, which provides the local covariances
-        // This is a hack, since the covariances provided by this otimizer are in the space of the updates
-        for(g2o::HyperGraph::VertexSet::const_iterator it = vertices_to_add.begin(); it != vertices_to_add.end(); it++)
+        updateCovGraph(iterations);
+
+        // the coarse graph is extended by the new elements on the next loop closure
+        if(keyframe_distance > 0 && coarse_graph_initialized)
         {
-            g2o::VertexSE3* v = new g2o::VertexSE3();
-            v->setId((*it)->id());
-            v->setFixed(dynamic_cast<g2o::VertexSE3*>(*it)->fixed());
-            cov_graph.addVertex(v);
+            coarse_pending_vertices.insert(vertices_to_add.begin(), vertices_to_add.end());
+            coarse_pending_edges.insert(edges_to_add.begin(), edges_to_add.end());
         }
-        for(g2o::HyperGraph::EdgeSet::const_iterator it = edges_to_add.begin(); it != edges_to_add.end(); it++)
+
+        // a windowed optimization is sufficient as long as the new elements are within the window
+        bool windowed = initialized && isWindowSufficient();
+
+        // a new loop closure is corrected in the coarse graph first
+        if(initialized && !windowed && loop_closure_added && keyframe_distance > 0)
         {
-            g2o::EdgeSE3* e = new g2o::EdgeSE3();
-            e->vertices()[0] = cov_graph.vertex((*it)->vertices()[0]->id());
-            e->vertices()[1] = cov_graph.vertex((*it)->vertices()[1]->id());
-            e->setMeasurement(Eigen::Isometry3d::Identity());
-            e->setInformation(dynamic_cast<g2o::EdgeSE3*>(*it)->information());
-            cov_graph.addEdge(e);
+            GRAPH_SLAM_SCOPED_TIMER(solver_time);
+            optimizeCoarseGraph(coarse_iterations);
         }
-        cov_graph.initializeOptimization();
-        cov_graph.optimize(iterations);
 
         // update hessian matrix
-        if(initialized && online)
+        if(initialized && (online || windowed))
         {
             if(!updateInitialization(vertices_to_add, edges_to_add))
                 throw std::runtime_error("update optimization failed!");
 
             // do optimization
-            err = g2o::SparseOptimizer::optimize(iterations, online);
+            GRAPH_SLAM_SCOPED_TIMER(solver_time);
+            if(windowed)
+                err = optimizeWindow(iterations);
+            else
+                err = g2o::SparseOptimizer::optimize(iterations, online);
         }
         else
         {
@@ -803,9 +2084,20 @@ int ExtendedSparseOptimizer::optimize(int iterations, bool online)
             initialized = true;
 
             // do optimization
+            GRAPH_SLAM_SCOPED_TIMER(solver_time);
             err = g2o::SparseOptimizer::optimize(iterations, false);
         }
 
+        // the new vertices can now be selected as source of new edges
+        for(g2o::HyperGraph::VertexSet::const_iterator it = vertices_to_add.begin(); it != vertices_to_add.end(); it++)
+        {
+            graph_slam::VertexSE3_GICP *vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(*it);
+            if(vertex)
+                vertex->setEdgeCandidateQueue(&edge_candidate_queue);
+            if(vertex && pointcloud_store && vertex->hasPointcloudAttached())
+                pointcloud_store->addVertex(vertex);
+        }
+
         // add new vertices to grid
         if(use_vertex_grid)
         {
@@ -823,17 +2115,440 @@ int ExtendedSparseOptimizer::optimize(int iterations, bool online)
 
         vertices_to_add.clear();
         edges_to_add.clear();
+        loop_closure_added = false;
+    }
+    else if(window_size > 0 && initialized)
+    {
+        // do optimization
+        GRAPH_SLAM_SCOPED_TIMER(solver_time);
+        err = optimizeWindow(iterations);
     }
     else
     {
         // do optimization
+        GRAPH_SLAM_SCOPED_TIMER(solver_time);
         err = g2o::SparseOptimizer::optimize(iterations, online);
     }
     map_update_necessary = true;
 
+    // after a windowed optimization only the vertices of the window can have moved
+    updateDirtyVertices(window_vertices.empty() ? _activeVertices : window_vertices);
+
+    enforcePointcloudBudget();
+
+    return err;
+}
+
+void ExtendedSparseOptimizer::updateCovGraph(int iterations)
+{
+    GRAPH_SLAM_SCOPED_TIMER(cov_graph_time);
+
+    // This is a hack, since the covariances provided by this otimizer are in the space of the updates
+    std::set<int> new_vertex_ids;
+    std::vector< std::pair<int, int> > new_edge_ids;
+    g2o::HyperGraph::VertexSet new_cov_vertices;
+    g2o::HyperGraph::EdgeSet new_cov_edges;
+    for(g2o::HyperGraph::VertexSet::const_iterator it = vertices_to_add.begin(); it != vertices_to_add.end(); it++)
+    {
+        g2o::VertexSE3* v = new g2o::VertexSE3();
+        v->setId((*it)->id());
+        v->setFixed(dynamic_cast<g2o::VertexSE3*>(*it)->fixed());
+        cov_graph.addVertex(v);
+        new_cov_vertices.insert(v);
+        new_vertex_ids.insert(v->id());
+    }
+    for(g2o::HyperGraph::EdgeSet::const_iterator it = edges_to_add.begin(); it != edges_to_add.end(); it++)
+    {
+        g2o::EdgeSE3* e = new g2o::EdgeSE3();
+        e->vertices()[0] = cov_graph.vertex((*it)->vertices()[0]->id());
+        e->vertices()[1] = cov_graph.vertex((*it)->vertices()[1]->id());
+        e->setMeasurement(Eigen::Isometry3d::Identity());
+        e->setInformation(dynamic_cast<g2o::EdgeSE3*>(*it)->information());
+        cov_graph.addEdge(e);
+        new_cov_edges.insert(e);
+        new_edge_ids.push_back(std::make_pair(e->vertices()[0]->id(), e->vertices()[1]->id()));
+    }
+    // only the cached covariances affected by the new elements are outdated
+    marginal_covariances.handleNewElements(new_vertex_ids, new_edge_ids);
+    if(cov_graph_initialized)
+    {
+        // Only the new elements are added to the structure of the hessian, the linear
+        // solver still computes a complete factorization in the following iteration.
+        // Since all measurements are the identity, this single iteration is sufficient.
+        if(!cov_graph.updateInitialization(new_cov_vertices, new_cov_edges))
+            throw std::runtime_error("update of the covariance graph failed!");
+        cov_graph.optimize(1, true);
+    }
+    else
+    {
+        cov_graph.initializeOptimization();
+        cov_graph.optimize(iterations);
+        cov_graph_initialized = true;
+    }
+}
+
+void ExtendedSparseOptimizer::getRecentVertexIds(std::set<int>& vertex_ids) const
+{
+    // the ids are assigned in ascending order
+    vertex_ids.clear();
+    for(int id = next_vertex_id - 1; id >= 0 && vertex_ids.size() < window_size; id--)
+    {
+        const g2o::OptimizableGraph::Vertex* vertex = dynamic_cast<const g2o::OptimizableGraph::Vertex*>(this->vertex(id));
+        if(vertex && (isHandledByOptimizer(vertex) || vertices_to_add.count(const_cast<g2o::OptimizableGraph::Vertex*>(vertex))))
+            vertex_ids.insert(id);
+    }
+}
+
+bool ExtendedSparseOptimizer::isWindowSufficient() const
+{
+    if(window_size == 0 || _vertices.size() <= window_size)
+        return false;
+
+    // a new fixed vertex changes the whole graph
+    for(g2o::HyperGraph::VertexSet::const_iterator it = vertices_to_add.begin(); it != vertices_to_add.end(); it++)
+    {
+        if(static_cast<const g2o::OptimizableGraph::Vertex*>(*it)->fixed())
+            return false;
+    }
+
+    std::set<int> recent_vertex_ids;
+    getRecentVertexIds(recent_vertex_ids);
+    // a new edge reaching out of the window affects the whole graph
+    for(g2o::HyperGraph::EdgeSet::const_iterator it = edges_to_add.begin(); it != edges_to_add.end(); it++)
+    {
+        for(std::vector<g2o::HyperGraph::Vertex*>::const_iterator v = (*it)->vertices().begin(); v != (*it)->vertices().end(); v++)
+        {
+            if(!recent_vertex_ids.count((*v)->id()))
+                return false;
+        }
+    }
+    return true;
+}
+
+/** Creates a robust kernel of the same type and width as the given one, NULL if the type is unknown */
+static g2o::RobustKernel* cloneRobustKernel(const g2o::RobustKernel* kernel)
+{
+    return kernel ? createRobustKernel(getRobustKernelType(kernel), kernel->delta()) : NULL;
+}
+
+int ExtendedSparseOptimizer::optimizeWindow(int iterations)
+{
+    // the most recent vertices and all vertices connected to them are optimized
+    std::set<int> recent_vertex_ids;
+    getRecentVertexIds(recent_vertex_ids);
+    g2o::HyperGraph::VertexSet free_vertices;
+    for(std::set<int>::const_iterator id = recent_vertex_ids.begin(); id != recent_vertex_ids.end(); id++)
+    {
+        g2o::HyperGraph::Vertex* vertex = this->vertex(*id);
+        free_vertices.insert(vertex);
+        for(g2o::HyperGraph::EdgeSet::const_iterator e = vertex->edges().begin(); e != vertex->edges().end(); e++)
+            free_vertices.insert((*e)->vertices().begin(), (*e)->vertices().end());
+    }
+
+    // the vertices on the boundary of the window are fixed
+    g2o::HyperGraph::EdgeSet window_edges;
+    g2o::HyperGraph::VertexSet window_graph_vertices = free_vertices;
+    for(g2o::HyperGraph::VertexSet::const_iterator it = free_vertices.begin(); it != free_vertices.end(); it++)
+    {
+        for(g2o::HyperGraph::EdgeSet::const_iterator e = (*it)->edges().begin(); e != (*it)->edges().end(); e++)
+        {
+            window_edges.insert(*e);
+            window_graph_vertices.insert((*e)->vertices().begin(), (*e)->vertices().end());
+        }
+    }
+
+    // copy the window into the window graph
+    window_graph.clear();
+    for(g2o::HyperGraph::VertexSet::const_iterator it = window_graph_vertices.begin(); it != window_graph_vertices.end(); it++)
+    {
+        const g2o::VertexSE3* vertex = dynamic_cast<const g2o::VertexSE3*>(*it);
+        if(!vertex)
+            continue;
+        g2o::VertexSE3* v = new g2o::VertexSE3();
+        v->setId(vertex->id());
+        v->setEstimate(vertex->estimate());
+        v->setFixed(vertex->fixed() || !free_vertices.count(*it));
+        window_graph.addVertex(v);
+    }
+    for(g2o::HyperGraph::EdgeSet::const_iterator it = window_edges.begin(); it != window_edges.end(); it++)
+    {
+        g2o::EdgeSE3* edge = dynamic_cast<g2o::EdgeSE3*>(*it);
+        if(!edge || !window_graph.vertex(edge->vertices()[0]->id()) || !window_graph.vertex(edge->vertices()[1]->id()))
+            continue;
+        // runs delayed GICP alignments
+        edge->computeError();
+        g2o::EdgeSE3* e = new g2o::EdgeSE3();
+        e->vertices()[0] = window_graph.vertex(edge->vertices()[0]->id());
+        e->vertices()[1] = window_graph.vertex(edge->vertices()[1]->id());
+        e->setMeasurement(edge->measurement());
+        e->setInformation(edge->information());
+        if(edge->robustKernel())
+            e->setRobustKernel(cloneRobustKernel(edge->robustKernel()));
+        window_graph.addEdge(e);
+    }
+
+    if(!window_graph.initializeOptimization())
+        throw std::runtime_error("initialize window optimization failed!");
+    int err = window_graph.optimize(iterations);
+
+    // copy back the optimized poses
+    for(g2o::HyperGraph::VertexSet::const_iterator it = free_vertices.begin(); it != free_vertices.end(); it++)
+    {
+        g2o::VertexSE3* vertex = dynamic_cast<g2o::VertexSE3*>(*it);
+        const g2o::VertexSE3* v = dynamic_cast<const g2o::VertexSE3*>(window_graph.vertex((*it)->id()));
+        if(!vertex || !v || vertex->fixed())
+            continue;
+        vertex->setEstimate(v->estimate());
+        window_vertices.push_back(vertex);
+    }
+    return err;
+}
+
+/** Returns the linear map of the error of a g2o::EdgeSE3 with a small error pose E to the error
+ * of the pose offset^-1 * E * offset. The rotational part of the error is the vector part of a
+ * quaternion, i.e. half of the rotation angle. */
+static Matrix6d computeErrorConjugation(const Eigen::Isometry3d& offset)
+{
+    Eigen::Matrix3d rotation_t = offset.linear().transpose();
+    Eigen::Vector3d t = offset.translation();
+    Eigen::Matrix3d skew;
+    skew << 0.0, -t.z(), t.y(),
+            t.z(), 0.0, -t.x(),
+            -t.y(), t.x(), 0.0;
+    Matrix6d conjugation = Matrix6d::Zero();
+    conjugation.topLeftCorner<3,3>() = rotation_t;
+    conjugation.topRightCorner<3,3>() = -2.0 * rotation_t * skew;
+    conjugation.bottomRightCorner<3,3>() = rotation_t;
+    return conjugation;
+}
+
+int ExtendedSparseOptimizer::optimizeCoarseGraph(int iterations)
+{
+    // only the elements added since the last coarse optimization are new, unless the graph is rebuilt
+    std::vector<int> vertex_ids;
+    g2o::HyperGraph::EdgeSet new_edges;
+    if(coarse_graph_initialized)
+    {
+        for(g2o::HyperGraph::VertexSet::const_iterator it = coarse_pending_vertices.begin(); it != coarse_pending_vertices.end(); it++)
+        {
+            if(dynamic_cast<const g2o::VertexSE3*>(*it))
+                vertex_ids.push_back((*it)->id());
+        }
+        new_edges.swap(coarse_pending_edges);
+    }
+    else
+    {
+        for(g2o::HyperGraph::VertexIDMap::const_iterator it = _vertices.begin(); it != _vertices.end(); it++)
+        {
+            if(dynamic_cast<const g2o::VertexSE3*>(it->second))
+                vertex_ids.push_back(it->first);
+        }
+        new_edges = _edges;
+        coarse_graph.clear();
+        coarse_vertex_keyframes.clear();
+        coarse_edges.clear();
+        coarse_keyframe_vertices = 0;
+    }
+    coarse_pending_vertices.clear();
+    coarse_pending_edges.clear();
+    // the ids are assigned in ascending order, so the vertices of a keyframe are usually connected by odometry edges
+    std::sort(vertex_ids.begin(), vertex_ids.end());
+
+    // new vertices are appended to the last keyframe. If they are inserted before it or a new
+    // vertex is fixed, the keyframes change and the coarse graph has to be rebuilt.
+    if(coarse_graph_initialized && !vertex_ids.empty())
+    {
+        bool rebuild = vertex_ids.front() <= coarse_vertex_keyframes.rbegin()->first;
+        for(std::vector<int>::const_iterator id = vertex_ids.begin(); id != vertex_ids.end() && !rebuild; id++)
+            rebuild = this->vertex(*id)->fixed();
+        if(rebuild)
+        {
+            coarse_graph_initialized = false;
+            return optimizeCoarseGraph(iterations);
+        }
+    }
+
+    // each vertex is represented by the last keyframe before it, fixed vertices are keyframes of their own
+    g2o::HyperGraph::VertexSet new_coarse_vertices;
+    g2o::VertexSE3* keyframe = coarse_vertex_keyframes.empty() ? NULL : coarse_vertex_keyframes.rbegin()->second;
+    bool has_fixed_keyframe = false;
+    for(std::vector<int>::const_iterator id = vertex_ids.begin(); id != vertex_ids.end(); id++)
+    {
+        g2o::VertexSE3* vertex = static_cast<g2o::VertexSE3*>(this->vertex(*id));
+        if(!keyframe || keyframe->fixed() || vertex->fixed() || coarse_keyframe_vertices >= keyframe_distance)
+        {
+            keyframe = vertex;
+            coarse_keyframe_vertices = 0;
+            g2o::VertexSE3* v = new g2o::VertexSE3();
+            v->setId(vertex->id());
+            v->setFixed(vertex->fixed());
+            coarse_graph.addVertex(v);
+            new_coarse_vertices.insert(v);
+            has_fixed_keyframe = has_fixed_keyframe || vertex->fixed();
+        }
+        coarse_vertex_keyframes[vertex->id()] = keyframe;
+        coarse_keyframe_vertices++;
+    }
+    if(coarse_graph.vertices().size() < 2)
+    {
+        coarse_graph_initialized = false;
+        return 0;
+    }
+    if(!coarse_graph_initialized && !has_fixed_keyframe)
+        static_cast<g2o::VertexSE3*>(coarse_graph.vertex(vertex_ids.front()))->setFixed(true);
+
+    // only the edges between different keyframes are part of the coarse graph
+    g2o::HyperGraph::EdgeSet new_coarse_edges;
+    for(g2o::HyperGraph::EdgeSet::const_iterator it = new_edges.begin(); it != new_edges.end(); it++)
+    {
+        g2o::EdgeSE3* edge = dynamic_cast<g2o::EdgeSE3*>(*it);
+        if(!edge || !coarse_vertex_keyframes.count(edge->vertices()[0]->id()) || !coarse_vertex_keyframes.count(edge->vertices()[1]->id()))
+            continue;
+        const g2o::VertexSE3* source_keyframe = coarse_vertex_keyframes[edge->vertices()[0]->id()];
+        const g2o::VertexSE3* target_keyframe = coarse_vertex_keyframes[edge->vertices()[1]->id()];
+        if(source_keyframe == target_keyframe)
+            continue;
+        g2o::EdgeSE3* e = new g2o::EdgeSE3();
+        e->vertices()[0] = coarse_graph.vertex(source_keyframe->id());
+        e->vertices()[1] = coarse_graph.vertex(target_keyframe->id());
+        if(edge->robustKernel())
+            e->setRobustKernel(cloneRobustKernel(edge->robustKernel()));
+        coarse_graph.addEdge(e);
+        new_coarse_edges.insert(e);
+        coarse_edges.push_back(std::make_pair(edge, e));
+    }
+
+    // The vertices have been moved by the optimizations since the last coarse optimization,
+    // so the keyframe poses and the measurements are updated from the current poses.
+    for(g2o::HyperGraph::VertexIDMap::const_iterator it = coarse_graph.vertices().begin(); it != coarse_graph.vertices().end(); it++)
+        static_cast<g2o::VertexSE3*>(it->second)->setEstimate(static_cast<const g2o::VertexSE3*>(this->vertex(it->first))->estimate());
+
+    // The edges are moved to the keyframes using the current relative poses of the vertices to their keyframes.
+    // Since these offsets are fixed, the error of the moved edge is the original error conjugated
+    // with the target offset, and the information is transformed accordingly.
+    for(CoarseEdges::const_iterator it = coarse_edges.begin(); it != coarse_edges.end(); it++)
+    {
+        g2o::EdgeSE3* edge = it->first;
+        const g2o::VertexSE3* source = static_cast<const g2o::VertexSE3*>(edge->vertices()[0]);
+        const g2o::VertexSE3* target = static_cast<const g2o::VertexSE3*>(edge->vertices()[1]);
+        const g2o::VertexSE3* source_keyframe = coarse_vertex_keyframes[source->id()];
+        const g2o::VertexSE3* target_keyframe = coarse_vertex_keyframes[target->id()];
+        // runs delayed GICP alignments
+        edge->computeError();
+        Eigen::Isometry3d target_in_keyframe = target_keyframe->estimate().inverse() * target->estimate();
+        Matrix6d conjugation = computeErrorConjugation(target_in_keyframe);
+        it->second->setMeasurement((source_keyframe->estimate().inverse() * source->estimate()) * edge->measurement() * 
+                                   target_in_keyframe.inverse());
+        it->second->setInformation(conjugation.transpose() * edge->information() * conjugation);
+    }
+
+    bool update = coarse_graph_initialized;
+    if(update)
+    {
+        if(!coarse_graph.updateInitialization(new_coarse_vertices, new_coarse_edges))
+            throw std::runtime_error("update of the coarse graph failed!");
+    }
+    else if(!coarse_graph.initializeOptimization())
+        throw std::runtime_error("initialize coarse optimization failed!");
+    coarse_graph_initialized = true;
+    int err = coarse_graph.optimize(iterations, update);
+
+    // the corrections of the keyframes have to be computed before the keyframes are moved
+    std::map<int, Eigen::Isometry3d, std::less<int>, Eigen::aligned_allocator< std::pair<const int, Eigen::Isometry3d> > > corrections;
+    for(g2o::HyperGraph::VertexIDMap::const_iterator it = coarse_graph.vertices().begin(); it != coarse_graph.vertices().end(); it++)
+    {
+        const g2o::VertexSE3* v = static_cast<const g2o::VertexSE3*>(it->second);
+        const g2o::VertexSE3* original = static_cast<const g2o::VertexSE3*>(this->vertex(it->first));
+        corrections[it->first] = v->estimate() * original->estimate().inverse();
+    }
+    for(std::map<int, g2o::VertexSE3*>::const_iterator it = coarse_vertex_keyframes.begin(); it != coarse_vertex_keyframes.end(); it++)
+    {
+        g2o::VertexSE3* vertex = static_cast<g2o::VertexSE3*>(this->vertex(it->first));
+        if(!vertex->fixed())
+            vertex->setEstimate(corrections[it->second->id()] * vertex->estimate());
+    }
     return err;
 }
 
+void ExtendedSparseOptimizer::setVertexUpdateTolerances(double translation_tolerance, double rotation_tolerance, double covariance_tolerance)
+{
+    this->translation_tolerance = translation_tolerance;
+    this->rotation_tolerance = rotation_tolerance;
+    this->covariance_tolerance = covariance_tolerance;
+}
+
+void ExtendedSparseOptimizer::setPointcloudMemoryBudget(size_t max_resident_bytes, double min_spill_distance, const std::string& spill_file_path)
+{
+    if(max_resident_bytes > 0)
+    {
+        if(pointcloud_store)
+        {
+            pointcloud_store->setMemoryBudget(max_resident_bytes, min_spill_distance);
+            return;
+        }
+        pointcloud_store.reset(new PointcloudStore(spill_file_path, max_resident_bytes, min_spill_distance));
+        for(VertexIDMap::const_iterator it = _vertices.begin(); it != _vertices.end(); it++)
+        {
+            graph_slam::VertexSE3_GICP *vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(it->second);
+            if(vertex && vertex->hasPointcloudAttached() && !vertices_to_add.count(vertex))
+                pointcloud_store->addVertex(vertex);
+        }
+        mls_update.setPointcloudStore(pointcloud_store.get());
+    }
+    else if(pointcloud_store)
+    {
+        for(VertexIDMap::const_iterator it = _vertices.begin(); it != _vertices.end(); it++)
+        {
+            graph_slam::VertexSE3_GICP *vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(it->second);
+            if(vertex && !loadPointcloud(vertex))
+                std::cerr << "failed to load the pointcloud of vertex " << vertex->id() << std::endl;
+        }
+        mls_update.setPointcloudStore(NULL);
+        pointcloud_store.reset();
+    }
+}
+
+bool ExtendedSparseOptimizer::loadPointcloud(graph_slam::VertexSE3_GICP* vertex)
+{
+    return !pointcloud_store || pointcloud_store->load(vertex, gicp_config);
+}
+
+void ExtendedSparseOptimizer::enforcePointcloudBudget()
+{
+    if(!pointcloud_store || !last_vertex)
+        return;
+    unsigned spilled = pointcloud_store->enforceBudget(last_vertex->estimate().translation());
+    if(_verbose && spilled > 0)
+        std::cerr << "spilled " << spilled << " pointclouds, " << pointcloud_store->getResidentMemory() << " bytes remain in memory" << std::endl;
+}
+
+bool ExtendedSparseOptimizer::hasMoved(const Eigen::Isometry3d& published_pose, const Eigen::Isometry3d& pose) const
+{
+    if((published_pose.translation() - pose.translation()).norm() > translation_tolerance)
+        return true;
+    Eigen::AngleAxisd rotation_delta(Eigen::Matrix3d(published_pose.linear().transpose() * pose.linear()));
+    return std::abs(rotation_delta.angle()) > rotation_tolerance;
+}
+
+void ExtendedSparseOptimizer::updateDirtyVertices(const g2o::OptimizableGraph::VertexContainer& vertices)
+{
+    // the poses are compared to the ones written to envire, so small changes can't add up unnoticed
+    for(g2o::OptimizableGraph::VertexContainer::const_iterator it = vertices.begin(); it != vertices.end(); it++)
+    {
+        graph_slam::VertexSE3_GICP *vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(*it);
+        if(!vertex || !vertex->hasPointcloudAttached())
+            continue;
+        PublishedVertexStates::const_iterator published = published_vertices.find(vertex->id());
+        if(published != published_vertices.end() && !hasMoved(published->second.pose, vertex->estimate()))
+            continue;
+
+        dirty_vertices.insert(vertex->id());
+        vertex_index.insert(vertex->id(), vertex->estimate().translation());
+        if(use_vertex_grid)
+            vertex_grid->moveVertex(vertex->id(), vertex->estimate().translation());
+    }
+}
+
 void ExtendedSparseOptimizer::setMLSMapConfiguration(bool use_mls, const envire::MLSConfiguration& mls_config, const std::string& mls_id, 
 						     double grid_size_x, double grid_size_y, double cell_resolution_x, double cell_resolution_y, double min_z, double max_z)
 {
@@ -856,6 +2571,7 @@ void ExtendedSparseOptimizer::setMLSMapConfiguration(bool use_mls, const envire:
 	// Setup mls projection
         projection.reset(new envire::MLSProjection());
         projection->setAreaOfInterest(-0.5 * grid_size_x, 0.5 * grid_size_x, -0.5 * grid_size_y, 0.5 * grid_size_y, min_z, max_z);
+        mls_update.setAreaOfInterest(-0.5 * grid_size_x, 0.5 * grid_size_x, -0.5 * grid_size_y, 0.5 * grid_size_y, min_z, max_z);
         env->setFrameNode(mls, map2world_frame);
         env->addOutput(projection.get(), mls);
 	
@@ -869,6 +2585,7 @@ void ExtendedSparseOptimizer::setMLSMapConfiguration(bool use_mls, const envire:
     {
         envire::MultiLevelSurfaceGrid* mls = env->getOutput<envire::MultiLevelSurfaceGrid*>(projection.get());
         mls->clear();
+        mls_update.clear();
         this->use_mls = false;
     }
 }
@@ -879,51 +2596,99 @@ bool ExtendedSparseOptimizer::updateEnvire()
     if(!map_update_necessary)
         return true;
 
-    // update framenodes
-    unsigned err_counter = 0;
-    g2o::SparseBlockMatrix<Eigen::MatrixXd> spinv;
-    VertexContainer vc;
-    for(VertexIDMap::const_iterator it = _vertices.begin(); it != _vertices.end(); it++)
+    // the moved vertices and the vertices whose covariance might have changed
+    std::set<int> update_ids = dirty_vertices;
+    for(PublishedVertexStates::const_iterator it = published_vertices.begin(); it != published_vertices.end(); it++)
     {
-        graph_slam::VertexSE3_GICP *vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(it->second);
-        if(!vertex->hasPointcloudAttached() || !isHandledByOptimizer(vertex))
+        if(marginal_covariances.getRevision(it->first) != it->second.covariance_revision)
+            update_ids.insert(it->first);
+    }
+
+    std::vector<int> vertex_ids;
+    std::vector<graph_slam::VertexSE3_GICP*> update_vertices;
+    for(std::set<int>::const_iterator id = update_ids.begin(); id != update_ids.end(); id++)
+    {
+        graph_slam::VertexSE3_GICP *vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(this->vertex(*id));
+        if(!vertex || !vertex->hasPointcloudAttached())
+        {
+            published_vertices.erase(*id);
             continue;
-        vc.push_back(vertex);
+        }
+        update_vertices.push_back(vertex);
+        if(isHandledByOptimizer(vertex) || vertex->fixed())
+            vertex_ids.push_back(vertex->id());
     }
-    if(!vc.empty())
-        cov_graph.computeMarginals(spinv, vc);
+    // compute outdated marginals in one step
+    marginal_covariances.prepare(vertex_ids);
 
-    for(VertexIDMap::const_iterator it = _vertices.begin(); it != _vertices.end(); it++)
+    // compute the transformations in parallel, the tasks only read the cached marginals
+    EnvireTransforms transforms(update_vertices.size());
+    thread_pool->parallelFor(update_vertices.size(), boost::bind(&ExtendedSparseOptimizer::computeEnvireTransformTask, this,
+                                                                 &update_vertices, &transforms, _1));
+
+    // update framenodes
+    unsigned err_counter = 0;
+    std::set<const envire::Pointcloud*> moved_pointclouds;
+    for(unsigned i = 0; i < update_vertices.size(); i++)
     {
-        graph_slam::VertexSE3_GICP *vertex = dynamic_cast<graph_slam::VertexSE3_GICP*>(it->second);
-        if(vertex)
+        graph_slam::VertexSE3_GICP *vertex = update_vertices[i];
+        int id = vertex->id();
+        envire::CartesianMap* map = dynamic_cast<envire::CartesianMap*>(vertex->getEnvirePointCloud().get());
+        envire::FrameNode* framenode = map ? map->getFrameNode() : NULL;
+        if(!framenode)
         {
-            if(!vertex->hasPointcloudAttached())
+            err_counter++;
+            continue;
+        }
+
+        const envire::TransformWithUncertainty& transform = transforms[i];
+        PublishedVertexStates::iterator published = published_vertices.find(id);
+        if(published != published_vertices.end() && !dirty_vertices.count(id))
+        {
+            // only the covariance might have changed
+            published->second.covariance_revision = marginal_covariances.getRevision(id);
+            if((transform.getCovariance() - published->second.covariance).norm() <= covariance_tolerance * published->second.covariance.norm())
                 continue;
-            envire::CartesianMap* map = dynamic_cast<envire::CartesianMap*>(vertex->getEnvirePointCloud().get());
-            if(map)
-            {
-                envire::FrameNode* framenode = map->getFrameNode();
-                if(framenode)
-                {
-                    framenode->setTransform(getEnvireTransformWithUncertainty(vertex, &spinv));
-                    continue;
-                }
-            }
         }
-        err_counter++;
+
+        framenode->setTransform(transform);
+        PublishedVertexState& state = published_vertices[id];
+        state.pose = vertex->estimate();
+        state.covariance = transform.getCovariance();
+        state.covariance_revision = marginal_covariances.getRevision(id);
+
+        // the footprint shares the framenode, so it has been moved as well
+        std::list<envire::CartesianMap*> maps = framenode->getMaps();
+        for(std::list<envire::CartesianMap*>::const_iterator it = maps.begin(); it != maps.end(); it++)
+        {
+            envire::Pointcloud* pointcloud = dynamic_cast<envire::Pointcloud*>(*it);
+            if(pointcloud)
+                moved_pointclouds.insert(pointcloud);
+        }
     }
+    dirty_vertices.clear();
 
+    // only project new, moved and removed pointclouds
     if(use_mls)
-    {
-        envire::MultiLevelSurfaceGrid* mls = env->getOutput<envire::MultiLevelSurfaceGrid*>(projection.get());
-        mls->clear();
-        projection->updateAll();
-    }
+        mls_update.update(*env, *projection, &moved_pointclouds);
+
+    // the projection might have loaded spilled pointclouds
+    enforcePointcloudBudget();
 
     return !err_counter;
 }
 
+void ExtendedSparseOptimizer::computeEnvireTransformTask(const std::vector<graph_slam::VertexSE3_GICP*>* vertices, EnvireTransforms* transforms, size_t index) const
+{
+    const graph_slam::VertexSE3_GICP* vertex = (*vertices)[index];
+    envire::TransformWithUncertainty& transform = (*transforms)[index];
+    transform = envire::TransformWithUncertainty::Identity();
+    transform.setTransform(Eigen::Affine3d(vertex->estimate().matrix()));
+    Matrix6d covariance;
+    if(getCachedVertexCovariance(covariance, vertex))
+        transform.setCovariance(switchEnvireG2oCov(covariance));
+}
+
 bool ExtendedSparseOptimizer::getVertexCovariance(Matrix6d& covariance, const g2o::OptimizableGraph::Vertex* vertex, const g2o::SparseBlockMatrix<Eigen::MatrixXd>& spinv)
 {
     if(vertex && isHandledByOptimizer(vertex))
@@ -961,12 +2726,15 @@ bool ExtendedSparseOptimizer::getVertexCovariance(Matrix6d& covariance, const g2
 
 bool ExtendedSparseOptimizer::getVertexCovariance(Matrix6d& covariance, const g2o::OptimizableGraph::Vertex* vertex)
 {
-    if(vertex && isHandledByOptimizer(vertex))
-    {
-        g2o::SparseBlockMatrix<Eigen::MatrixXd> spinv;
-        cov_graph.computeMarginals(spinv, vertex);
-        return getVertexCovariance(covariance, vertex, spinv);
-    }
+    if(vertex && (isHandledByOptimizer(vertex) || vertex->fixed()))
+        return marginal_covariances.getCovariance(covariance, vertex->id());
+    return false;
+}
+
+bool ExtendedSparseOptimizer::getCachedVertexCovariance(Matrix6d& covariance, const g2o::OptimizableGraph::Vertex* vertex) const
+{
+    if(vertex && (isHandledByOptimizer(vertex) || vertex->fixed()))
+        return marginal_covariances.getCachedCovariance(covariance, vertex->id());
     return false;
 }
 
@@ -2,11 +2,19 @@
 #define GRAPH_SLAM_EXTENDED_SPARSE_OPTIMIZER_HPP
 
 #include <g2o/core/sparse_optimizer.h>
+#include <g2o/core/sparse_optimizer_terminate_action.h>
 #include <base/samples/RigidBodyState.hpp>
 #include <graph_slam/edge_se3_gicp.hpp>
 #include <graph_slam/matrix_helper.hpp>
 #include <graph_slam/vertex_grid.hpp>
 #include <graph_slam/graph_slam_config.hpp>
+#include <graph_slam/thread_pool.hpp>
+#include <graph_slam/loop_closure_worker.hpp>
+#include <graph_slam/spatial_hash_grid.hpp>
+#include <graph_slam/marginal_covariances.hpp>
+#include <graph_slam/incremental_mls_projection.hpp>
+#include <graph_slam/pointcloud_store.hpp>
+#include <graph_slam/graph_snapshot.hpp>
 #include <envire/core/Transform.hpp>
 #include <boost/shared_ptr.hpp>
 #include <envire/core/Environment.hpp>
@@ -19,11 +27,15 @@ class ExtendedSparseOptimizer : public g2o::SparseOptimizer
 {
 public:
     
-    /** Available linear solvers */
+    /** Available linear solvers.
+     * PCG and EigenCholesky can't compute marginal covariances, in that case CSparse is used for them. */
     enum LinearSolver
     {
 	CSparse = 0,
-	Cholmod
+	Cholmod,
+	PCG,
+	EigenCholesky,
+	CholmodSupernodal
     };
 
     /** Available optimization algorithms */
@@ -34,7 +46,8 @@ public:
     };
     
     
-    ExtendedSparseOptimizer(OptimizationAlgorithm optimizer = GaussNewton, LinearSolver solver = CSparse);
+    ExtendedSparseOptimizer(OptimizationAlgorithm optimizer = GaussNewton, LinearSolver solver = CSparse,
+                            const LinearSolverConfiguration& solver_config = LinearSolverConfiguration());
     virtual ~ExtendedSparseOptimizer();
 
     
@@ -47,6 +60,36 @@ public:
     
     /** Removes all vertices and edges */
     virtual void clear();
+    
+    /** Enables the sliding window optimization. Only the given number of most recent vertices
+     * and the vertices connected to them are optimized, the vertices on the boundary of the 
+     * window are kept fixed. The whole graph is only optimized if a new edge reaches out of the window.
+     * A window size of zero disables the sliding window, which is the default.
+     * 
+     * @param window_size number of most recent vertices in the window
+     */
+    void setSlidingWindowSize(unsigned window_size) {this->window_size = window_size;}
+    
+    /** Enables the hierarchical optimization. After a new loop closure a coarse graph of keyframes 
+     * is optimized first and its corrections are propagated to the other vertices, before the whole 
+     * graph is optimized. Every keyframe_distance-th vertex is a keyframe, the following vertices
+     * are moved rigidly with it. A keyframe distance of zero disables the hierarchical optimization, 
+     * which is the default. The coarse graph is kept and extended by the new vertices and edges,
+     * it is only rebuilt if vertices have been removed or the fixed vertex has changed.
+     * 
+     * @param keyframe_distance number of vertices represented by a keyframe
+     * @param coarse_iterations number of iterations of the coarse graph optimization
+     */
+    void setHierarchicalOptimization(unsigned keyframe_distance, int coarse_iterations = 10) 
+        {this->keyframe_distance = keyframe_distance; this->coarse_iterations = coarse_iterations; coarse_graph_initialized = false;}
+    
+    /** Sets a threshold for the relative decrease of the error per iteration.
+     * The optimization stops before the given number of iterations, if the gain 
+     * of an iteration is below this threshold. A value of zero disables the early termination.
+     * 
+     * @param gain_threshold minimal relative gain of an iteration
+     */
+    void setGainThreshold(double gain_threshold);
 
     
     /** Add a a-priori set of vertices and edges from a given environment
@@ -59,6 +102,43 @@ public:
      */
     bool setAPrioriMap(const boost::shared_ptr<envire::Environment>& apriori_env);
     
+    /** Same as above, but the a-priori map is loaded from a snapshot written by saveSnapshot().
+     * The downsampled pointclouds of the snapshot are used without filtering them again.
+     * The uncertain vertices are connected to the fixed vertex of the snapshot,
+     * using their marginal covariances.
+     * 
+     * @param snapshot_path path of the snapshot
+     */
+    bool setAPrioriMap(const std::string& snapshot_path);
+    
+    /** Enables the streaming of the a-priori map. Instead of loading all a-priori vertices at once,
+     * they are only indexed by their position. The pointclouds of the a-priori vertices are loaded
+     * when the newest vertex comes within the given radius. Once the a-priori map is connected to 
+     * the graph, only the fixed a-priori vertex and the loaded vertices are attached, and further
+     * vertices are attached incrementally without a reinitialization of the graph.
+     * A radius of zero disables the streaming, which is the default. It has to be set before setAPrioriMap().
+     * 
+     * @param radius radius around the newest vertex in meters
+     */
+    void setAPrioriStreamingRadius(double radius);
+    
+    /** Saves the graph to a binary snapshot, including the pointclouds of the vertices, 
+     * their downsampled pointclouds with the point covariances and the marginal covariances.
+     * The edges keep their kind and robust kernel. Edges with a pending GICP alignment are not saved.
+     * Throws a std::runtime_error if the snapshot can't be written.
+     * 
+     * @param path path of the snapshot
+     */
+    void saveSnapshot(const std::string& path);
+    
+    /** Restores a graph saved by saveSnapshot() into an empty optimizer, the restored vertices
+     * and edges are optimized with the next call of optimize().
+     * Throws a std::runtime_error if the graph is not empty or the snapshot can't be read.
+     * 
+     * @param path path of the snapshot
+     */
+    void loadSnapshot(const std::string& path);
+    
     
     /** Adds a new vertex to the graph.
      * The delta transformation from the previous vertex will be computed, using
@@ -72,6 +152,45 @@ public:
     bool addVertex(const envire::TransformWithUncertainty& transformation, std::vector<Eigen::Vector3d>& pointcloud, 
                    const Eigen::Affine3d& sensor_origin = Eigen::Affine3d::Identity(), bool delayed_icp_update = false);
     
+    /** Adds a new vertex to the graph.
+     * Same as above, but the ownership of the pointcloud is transferred to the optimizer, 
+     * so the range measurements aren't copied. The sensor origin is taken from the pointcloud.
+     * The pointcloud is also released if this method throws.
+     * 
+     * @param transformation initial, i.e. odometry based, pose of the vertex
+     * @param pointcloud range measurements
+     * @param delayed_icp_update run icp optimization at the same time as the graph optimization 
+     */
+    bool addVertex(const envire::TransformWithUncertainty& transformation, envire::Pointcloud* pointcloud, bool delayed_icp_update = false);
+
+    /** A scan of a sequence added by addVertices() */
+    struct BatchScan
+    {
+        /** initial, i.e. odometry based, pose of the vertex */
+        envire::TransformWithUncertainty transformation;
+        /** range measurements, the ownership is transferred to the optimizer */
+        envire::Pointcloud* pointcloud;
+        BatchScan() : pointcloud(NULL) {}
+        BatchScan(const envire::TransformWithUncertainty& transformation, envire::Pointcloud* pointcloud) :
+                  transformation(transformation), pointcloud(pointcloud) {}
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+    typedef std::vector<BatchScan, Eigen::aligned_allocator<BatchScan> > BatchScans;
+
+    /** Adds a sequence of scans to the graph, e.g. for the offline mapping of logged data.
+     * It is equivalent to calling addVertex() for each scan, but the pointclouds are downsampled
+     * and the odometry edges between consecutive scans are aligned by GICP in parallel on the worker threads.
+     * The graph is neither initialized nor optimized, so the following calls of optimize() and
+     * updateEnvire() handle the whole sequence at once, including the search for edge candidates
+     * and the MLS projection.
+     * The pointclouds are also released if this method throws. If the batch can't be added completely,
+     * none of its vertices stay in the graph, except for the initial vertex of an empty graph.
+     * 
+     * @param scans sequence of scans in chronological order
+     * @return number of added vertices
+     */
+    unsigned addVertices(const BatchScans& scans);
+    
     /** Adds the initial vertex to the graph.
      * The pose of this vertex is the fixed reference and will therefore not be optimized.
      * This method is called by addVertex() automatically if it's the first vertex. 
@@ -82,6 +201,14 @@ public:
      */
     bool addInitalVertex(const envire::TransformWithUncertainty& transformation, std::vector<Eigen::Vector3d>& pointcloud, const Eigen::Affine3d& sensor_origin = Eigen::Affine3d::Identity());
     
+    /** Adds the initial vertex to the graph.
+     * Same as above, but the ownership of the pointcloud is transferred to the optimizer.
+     * 
+     * @param transformation initial, i.e. odometry based, pose of the vertex
+     * @param pointcloud range measurements
+     */
+    bool addInitalVertex(const envire::TransformWithUncertainty& transformation, envire::Pointcloud* pointcloud);
+    
     /** Removes the range measurements attached to a given vertex.
      * Doesn't remove the vertex itself.
      * 
@@ -89,12 +216,23 @@ public:
      */
     bool removePointcloudFromVertex(int vertex_id);
     
-    /** NOTE This is currently the same as removePointcloudFromVertex().
-     * It should remove a vertex later completely.
+    /** Removes a vertex and its edges completely from the graph.
+     * The vertex is marginalized, and the resulting dense constraints between its neighbors
+     * are approximated by a tree of new edges, so that the graph stays sparse.
+     * Fixed vertices, a-priori vertices, the newest vertex and vertices with GICP edges which 
+     * haven't been optimized yet can't be removed.
      * 
      * @param vertex_id id of the vertex
+     * @return true if the vertex has been removed
      */
     bool removeVertex(int vertex_id);
+    
+    /** Same as removeVertex(), but the optimizer is only initialized once for all vertices.
+     * 
+     * @param vertex_ids ids of the vertices
+     * @return number of removed vertices
+     */
+    unsigned removeVertices(const std::vector<int>& vertex_ids);
 
     
     /** With this method a 2D grid based removal of old vertices can be activated.
@@ -114,11 +252,15 @@ public:
     /** Does a search for edge candidates for all vertices, for which
      * it hasn't been done yet. Using this method, a search for candidates 
      * is only triggered once per vertex in its lifetime.
+     * If the asynchronous loop closure mode is enabled, a snapshot of the 
+     * graph is handed over to the background worker instead.
      */
     void findEdgeCandidates();
     
     /** Uses the mahalanobis distance to find possible candidates 
      * for additional edges from a given vertex to all other vertices.
+     * Only vertices within a radius, derived from the max sensor distance and
+     * the position covariances, are looked up in a spatial index and tested.
      * 
      * @param vertex_id id of a vertex
      * @param spinv combined covariance matrix of all vertices
@@ -130,12 +272,41 @@ public:
      * mahalanobis distance. New edges are only added to the graph if the found 
      * GICP transformation is considered as valid.
      * 
+     * If more than one worker thread is configured, the best candidates are
+     * selected up front and their GICP alignments run in parallel. The valid
+     * edges are then added in the same order as in the serial case.
+     * 
      * @param count amount of candidates that should be optimized
      */
     void tryBestEdgeCandidates(unsigned count = 1);
     
+    /** Sets the number of worker threads used to run GICP alignments.
+     * A value of one or less runs all alignments on the calling thread.
+     * 
+     * @param threads number of worker threads
+     */
+    void setWorkerThreadCount(unsigned threads);
+    
+    /** Returns the number of worker threads. */
+    unsigned getWorkerThreadCount() const {return thread_pool->getThreadCount();}
+    
+    /** Enables the asynchronous loop closure mode.
+     * In this mode findEdgeCandidates() hands over a snapshot of the vertex poses 
+     * and pointclouds to a background worker, which searches for edge candidates
+     * and validates them using GICP. The validated edges are added to the graph
+     * in the next call of optimize(). tryBestEdgeCandidates() has no effect in this mode.
+     * 
+     * @param enable enables or disables the asynchronous mode
+     * @param alignments_per_snapshot maximum amount of GICP alignments per snapshot
+     */
+    void setAsyncLoopClosure(bool enable, unsigned alignments_per_snapshot = 1);
+    
+    /** Returns true if the asynchronous loop closure mode is enabled. */
+    bool isAsyncLoopClosureEnabled() const {return loop_closure_worker.get() != 0;}
+    
     
     /** Returns the covariance matrix for a given vertex.
+     * The marginal covariances are cached and only recomputed if they are outdated.
      * 
      * @param covariance 6x6 covariance matrix
      * @param vertex
@@ -169,7 +340,43 @@ public:
     void setMLSMapConfiguration(bool use_mls, const envire::MLSConfiguration& mls_config, const std::string& mls_id, 
 				double grid_size_x, double grid_size_y, double cell_resolution_x, double cell_resolution_y, double min_z, double max_z);
     
-    /** Updates the transformations of all pointclouds in envire and 
+    /** Sets the pose change of a pointcloud, above which it is projected again
+     * into the multi-level surface map. Only new, moved and removed pointclouds are
+     * updated in the map, unless most of the map is affected.
+     * 
+     * @param translation_threshold translation threshold in meters
+     * @param rotation_threshold rotation threshold in radians
+     */
+    void setMLSUpdateThresholds(double translation_threshold, double rotation_threshold) {mls_update.setUpdateThresholds(translation_threshold, rotation_threshold);}
+    
+    /** Sets the tolerances, below which a vertex is not considered as changed.
+     * Only vertices moved by the optimization are updated in the spatial index and the 
+     * vertex grid, and only moved vertices or vertices with a changed covariance are
+     * updated in envire.
+     * 
+     * @param translation_tolerance translation tolerance in meters
+     * @param rotation_tolerance rotation tolerance in radians
+     * @param covariance_tolerance tolerance of the relative change of the covariance in envire
+     */
+    void setVertexUpdateTolerances(double translation_tolerance, double rotation_tolerance, double covariance_tolerance);
+    
+    /** Limits the memory used by the pointclouds of the vertices. If the budget is exceeded after
+     * an optimization, the pointclouds of the vertices farthest away from the newest vertex are 
+     * spilled to a file. They are loaded back when they are needed for a GICP alignment or the
+     * multi-level surface map. With asynchronous loop closures, the spilled pointclouds within the
+     * search radius of the vertices waiting for a loop closure search are loaded back for the snapshots,
+     * all others are left out. A budget of zero loads all pointclouds back and disables the limit.
+     * 
+     * @param max_resident_bytes memory budget in bytes
+     * @param min_spill_distance pointclouds within this distance to the newest vertex are never spilled
+     * @param spill_file_path path of the spill file, it is only used when the limit gets enabled
+     */
+    void setPointcloudMemoryBudget(size_t max_resident_bytes, double min_spill_distance, const std::string& spill_file_path);
+    
+    /** Returns the ids of the vertices moved by the optimization since the last call of updateEnvire(). */
+    const std::set<int>& getDirtyVertices() const {return dirty_vertices;}
+    
+    /** Updates the transformations of the changed pointclouds in envire and 
      * project them to the multi-level surface map.
      */
     bool updateEnvire();
@@ -184,6 +391,13 @@ public:
      */
     void updateGICPConfiguration(const GICPConfiguration& gicp_config);
     
+    /** Sets the robust kernel and the consistency check of new loop closure edges.
+     * The kernel is applied to the loop closure edges added afterwards.
+     * 
+     * @loop_closure_config loop closure specific configuration
+     */
+    void setLoopClosureConfiguration(const LoopClosureConfiguration& loop_closure_config) {this->loop_closure_config = loop_closure_config;}
+    
     /** Sets the transformation to the map offset in the world frame.
      * The offset of the map is in its center.
      */
@@ -232,10 +446,156 @@ protected:
     bool getVertexCovariance(Matrix6d& covariance, const g2o::OptimizableGraph::Vertex* vertex, const g2o::SparseBlockMatrix<Eigen::MatrixXd>& spinv);
     
 private:
+    /** The state of a vertex as it has been written to envire */
+    struct PublishedVertexState
+    {
+        Eigen::Isometry3d pose;
+        Matrix6d covariance;
+        size_t covariance_revision;
+    };
+    typedef std::map<int, PublishedVertexState, std::less<int>, 
+                     Eigen::aligned_allocator< std::pair<const int, PublishedVertexState> > > PublishedVertexStates;
+    
+    /** A selected edge candidate between two vertices */
+    struct EdgeCandidateSelection
+    {
+        graph_slam::VertexSE3_GICP* source_vertex;
+        graph_slam::VertexSE3_GICP* target_vertex;
+        VertexSE3_GICP::EdgeCandidate candidate;
+        bool apriori_target_vertex;
+        graph_slam::EdgeSE3_GICP* edge;
+        bool gicp_result;
+        EdgeCandidateSelection() : source_vertex(NULL), target_vertex(NULL), apriori_target_vertex(false), edge(NULL), gicp_result(false) {};
+    };
+    
+    /** Selects the edge candidate with the highest missing edge error.
+     * Returns false if there are no candidates left.
+     */
+    bool selectBestEdgeCandidate(EdgeCandidateSelection& selection);
+    /** Selects up to count of the best edge candidates at once.
+     * The selected candidates are marked as tested, so they can't be selected twice.
+     */
+    void selectBestEdgeCandidates(std::vector<EdgeCandidateSelection>& selections, unsigned count);
+    /** Creates a new GICP edge for a selected candidate */
+    graph_slam::EdgeSE3_GICP* createCandidateEdge(const EdgeCandidateSelection& selection);
+    /** Adds the edge of a tested candidate to the graph if the GICP alignment was valid */
+    void handleTestedEdgeCandidate(EdgeCandidateSelection& selection);
+    /** Runs the GICP alignments of the best candidates in parallel */
+    void tryBestEdgeCandidatesParallel(unsigned count);
+    /** Checks if the error of a new loop closure is explained by the joint marginal covariance of its vertices 
+     * and the covariance of the edge. The edge needs a valid GICP measurement. */
+    bool isConsistentLoopClosure(graph_slam::EdgeSE3_GICP* edge);
+    /** Remembers a loop closure which has been rejected by the consistency check, so it can be retried later */
+    void rejectLoopClosure(const graph_slam::EdgeSE3_GICP* edge, double mahalanobis_distance);
+    /** Makes the rejected loop closures candidates again if the graph has changed since their rejection.
+     * Both the synchronous search and the loop closure worker use the same policy. */
+    void retryRejectedLoopClosures();
+    /** Sets the configured robust kernel of a loop closure edge */
+    void setLoopClosureKernel(g2o::OptimizableGraph::Edge* edge, double width) const;
+    /** Hands over a snapshot of the graph to the loop closure worker */
+    void submitLoopClosureSnapshot();
+    /** Adds the loop closures found by the loop closure worker to the graph */
+    void addAsyncLoopClosures();
+    /** Returns an a-priori vertex with the given id or NULL */
+    graph_slam::VertexSE3_GICP* getAPrioriVertex(int vertex_id) const;
+    /** Returns an upper bound of the position variance of all vertices in spinv and the a-priori vertices */
+    double getMaxPositionVariance(const g2o::SparseBlockMatrix<Eigen::MatrixXd>& spinv) const;
+    /** Returns an upper bound of the position variance of the given vertices and the a-priori vertices, using the cached covariances */
+    double getMaxPositionVariance(const std::vector<int>& vertex_ids);
+    /** Finds edge candidates for a given vertex, using the position variance bound of all possible target vertices.
+     * If spinv is NULL the cached covariances are used. */
+    void findEdgeCandidates(int vertex_id, const g2o::SparseBlockMatrix<Eigen::MatrixXd>* spinv, double max_target_variance);
+    /** Edge candidates of a source vertex, pairs of target vertex id and distance */
+    typedef std::vector< std::pair<int, double> > EdgeCandidateList;
+    /** Searches the edge candidates of a source vertex without adding them.
+     * It only reads the graph, so it can run concurrently for several source vertices.
+     * If spinv is NULL the cached covariances are used.
+     * Returns false if the covariance of the source vertex is not available. */
+    bool searchEdgeCandidates(const graph_slam::VertexSE3_GICP* source_vertex, const g2o::SparseBlockMatrix<Eigen::MatrixXd>* spinv,
+                              double max_target_variance, EdgeCandidateList& candidates);
+    /** Task of the parallel candidate search, searches the candidates of the source vertex with the given index */
+    void searchEdgeCandidatesTask(const std::vector<graph_slam::VertexSE3_GICP*>* source_vertices, double max_target_variance,
+                                  std::vector<EdgeCandidateList>* candidates, std::vector<char>* searched, size_t index);
+    /** Adds the found edge candidates to a source vertex and its targets and marks its search as done */
+    void addEdgeCandidates(graph_slam::VertexSE3_GICP* source_vertex, const EdgeCandidateList& candidates);
+    /** Returns the covariance of a vertex if it is cached, the cache isn't modified */
+    bool getCachedVertexCovariance(Matrix6d& covariance, const g2o::OptimizableGraph::Vertex* vertex) const;
+    typedef std::vector<envire::TransformWithUncertainty, Eigen::aligned_allocator<envire::TransformWithUncertainty> > EnvireTransforms;
+    /** Task of the parallel framenode update, computes the transformation of the vertex with the given index using the cached covariances */
+    void computeEnvireTransformTask(const std::vector<graph_slam::VertexSE3_GICP*>* vertices, EnvireTransforms* transforms, size_t index) const;
+    
+    /** Adds the new vertices and edges to the cov_graph and optimizes it */
+    void updateCovGraph(int iterations);
     /** Sets up the optimizer and the linear matrix solver */
-    void setupOptimizer(OptimizationAlgorithm optimizer, LinearSolver solver);
+    void setupOptimizer(OptimizationAlgorithm optimizer, LinearSolver solver, const LinearSolverConfiguration& solver_config);
     /** Initializes all member variables with valid values. */
     void initValues();
+    /** Adds the given vertices which have been moved to the dirty vertices and updates 
+     * their positions in the spatial index and the vertex grid */
+    void updateDirtyVertices(const g2o::OptimizableGraph::VertexContainer& vertices);
+    /** Returns the ids of the window_size most recent vertices */
+    void getRecentVertexIds(std::set<int>& vertex_ids) const;
+    /** Checks if the new vertices and edges can be handled by optimizing the sliding window */
+    bool isWindowSufficient() const;
+    /** Optimizes the sliding window in a separate graph and copies the poses back */
+    int optimizeWindow(int iterations);
+    /** Optimizes the coarse graph of keyframes and moves the other vertices with their keyframes */
+    int optimizeCoarseGraph(int iterations);
+    /** Checks if a vertex can be removed from the graph */
+    bool isRemovable(const graph_slam::VertexSE3_GICP* vertex) const;
+    /** Replaces a vertex and its edges by the sparsified marginal constraints between its neighbors.
+     * The new constraints are plain SE3 edges, they are added to edges_to_add.
+     * The optimizer has to be initialized afterwards. */
+    bool marginalizeVertex(graph_slam::VertexSE3_GICP* vertex);
+    /** Source of the pointcloud of an a-priori vertex */
+    struct APrioriPointcloud
+    {
+        envire::TransformWithUncertainty transform;
+        /** pointcloud in the a-priori environment, if NULL the pointcloud of the snapshot vertex is used */
+        const envire::Pointcloud* source;
+        GraphSnapshot::Vertex snapshot_vertex;
+        APrioriPointcloud() : source(NULL) {};
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+    typedef std::map<int, APrioriPointcloud, std::less<int>, 
+                     Eigen::aligned_allocator< std::pair<const int, APrioriPointcloud> > > APrioriPointclouds;
+
+    /** State of a loop closure at its last rejection */
+    struct RejectedLoopClosure
+    {
+        /** pose of the target in the source frame */
+        Eigen::Isometry3d relative_pose;
+        /** number of added loop closures */
+        unsigned loop_closure_count;
+        double mahalanobis_distance;
+        unsigned rejections;
+        bool retry_pending;
+        RejectedLoopClosure() : relative_pose(Eigen::Isometry3d::Identity()), loop_closure_count(0),
+                                mahalanobis_distance(0.0), rejections(0), retry_pending(false) {};
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+    typedef std::map<std::pair<int, int>, RejectedLoopClosure, std::less< std::pair<int, int> >, 
+                     Eigen::aligned_allocator< std::pair<const std::pair<int, int>, RejectedLoopClosure> > > RejectedLoopClosures;
+    
+    /** Adds a vertex to the a-priori map, the first vertex is fixed and all other vertices are connected to it.
+     * When streaming, the pointcloud is only loaded once the vertex comes into range. */
+    void addAPrioriVertex(APrioriPointcloud& pointcloud);
+    /** Attaches the pointcloud of an a-priori vertex and adds it to the environment */
+    void loadAPrioriPointcloud(graph_slam::VertexSE3_GICP* vertex, APrioriPointcloud& pointcloud);
+    /** Loads the a-priori vertices in range and attaches them if the a-priori map is already connected */
+    void streamAPrioriMap();
+    /** Deletes all a-priori vertices, which are not yet attached */
+    void resetAPrioriMap();
+    /** Loads the pointcloud of a vertex back if it has been spilled */
+    bool loadPointcloud(graph_slam::VertexSE3_GICP* vertex);
+    /** Spills pointclouds until the memory budget is met */
+    void enforcePointcloudBudget();
+    /** Detaches the pointcloud of a vertex and removes it from the environment */
+    void detachPointcloud(graph_slam::VertexSE3_GICP* vertex);
+    /** Detaches the pointcloud of a vertex and removes the vertex from the lookup structures */
+    bool releasePointcloud(graph_slam::VertexSE3_GICP* vertex);
+    /** Checks if a pose has changed by more than the tolerances */
+    bool hasMoved(const Eigen::Isometry3d& published_pose, const Eigen::Isometry3d& pose) const;
     /** Checks if a vertex is already part of the optimization process. */
     bool isHandledByOptimizer(const g2o::OptimizableGraph::Vertex* vertex) const {return vertex->hessianIndex() >= 0;};
     
@@ -245,6 +605,7 @@ private:
     g2o::HyperGraph::VertexSet vertices_to_add;
     g2o::HyperGraph::EdgeSet edges_to_add;
     GICPConfiguration gicp_config;
+    LoopClosureConfiguration loop_closure_config;
     Eigen::Isometry3d odometry_pose_last_vertex;
     Matrix6d odometry_covariance_last_vertex;
     Matrix6d covariance_last_optimized_vertex;
@@ -252,15 +613,64 @@ private:
     bool new_edges_added;
     boost::shared_ptr<envire::Environment> env;
     envire::MLSProjection::Ptr projection;
+    IncrementalMLSProjection mls_update;
     envire::FrameNode* map2world_frame;
     boost::shared_ptr<VertexGrid> vertex_grid;
     bool use_mls;
     bool use_vertex_grid;
     bool map_update_necessary;
     g2o::SparseOptimizer cov_graph;
+    /** true as long as the structure of the cov_graph can be updated incrementally */
+    bool cov_graph_initialized;
+    g2o::SparseOptimizer window_graph;
+    /** vertices optimized in the last window optimization, empty after a full optimization */
+    g2o::OptimizableGraph::VertexContainer window_vertices;
+    unsigned window_size;
+    g2o::SparseOptimizer coarse_graph;
+    /** true as long as the coarse graph can be extended incrementally */
+    bool coarse_graph_initialized;
+    /** keyframe of each vertex represented by the coarse graph */
+    std::map<int, g2o::VertexSE3*> coarse_vertex_keyframes;
+    /** number of vertices represented by the last keyframe */
+    unsigned coarse_keyframe_vertices;
+    /** edges between different keyframes and their counterparts in the coarse graph */
+    typedef std::vector< std::pair<g2o::EdgeSE3*, g2o::EdgeSE3*> > CoarseEdges;
+    CoarseEdges coarse_edges;
+    /** elements added to the graph since the last coarse optimization */
+    g2o::HyperGraph::VertexSet coarse_pending_vertices;
+    g2o::HyperGraph::EdgeSet coarse_pending_edges;
+    unsigned keyframe_distance;
+    int coarse_iterations;
+    /** true if a loop closure has been added since the last optimization */
+    bool loop_closure_added;
+    /** number of loop closures added since the graph has been cleared */
+    unsigned loop_closure_count;
+    RejectedLoopClosures rejected_loop_closures;
+    /** rejected loop closures which are handed over with the next snapshot to the loop closure worker */
+    LoopClosureWorker::Retries loop_closure_retries;
+    MarginalCovariances marginal_covariances;
     Eigen::Isometry3d map2world;
     Eigen::Isometry3d robot_start2world;
     std::vector<graph_slam::VertexSE3_GICP*> apriori_vertices;
+    /** pending pointclouds of the a-priori vertices when streaming */
+    APrioriPointclouds apriori_pointclouds;
+    boost::shared_ptr<envire::Environment> apriori_env;
+    double apriori_streaming_radius;
+    bool apriori_map_attached;
+    boost::shared_ptr<ThreadPool> thread_pool;
+    boost::shared_ptr<g2o::SparseOptimizerTerminateAction> terminate_action;
+    bool terminate_flag;
+    VertexSE3_GICP::PCLPointCloudPtr scratch_cloud;
+    SpatialHashGrid vertex_index;
+    VertexSE3_GICP::EdgeCandidateQueue edge_candidate_queue;
+    boost::shared_ptr<LoopClosureWorker> loop_closure_worker;
+    unsigned async_alignments_per_snapshot;
+    double translation_tolerance;
+    double rotation_tolerance;
+    double covariance_tolerance;
+    std::set<int> dirty_vertices;
+    PublishedVertexStates published_vertices;
+    boost::shared_ptr<PointcloudStore> pointcloud_store;
 };
     
 } // end namespace
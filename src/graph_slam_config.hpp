@@ -5,6 +5,21 @@
 namespace graph_slam 
 {
 
+/**
+ * Available methods to downsample the pointclouds of the vertices
+ */
+enum PointCloudDownsampling
+{
+    /** centroid of each voxel, using the pcl::VoxelGrid */
+    VoxelCentroid = 0,
+    /** approximated centroid of each voxel, using the pcl::ApproximateVoxelGrid */
+    ApproximateVoxel,
+    /** random subset of the points, defined by the point_cloud_density */
+    RandomSubsample,
+    /** centroid of each voxel, using a native hashed voxel grid */
+    HashedVoxel
+};
+
 /**
  * Configuration for GICP optimizer
  */
@@ -22,13 +37,89 @@ struct GICPConfiguration
     double position_sigma;
     double orientation_sigma;
     double max_sensor_distance;
+    PointCloudDownsampling downsampling_method;
+    double voxel_leaf_size_x;
+    double voxel_leaf_size_y;
+    double voxel_leaf_size_z;
+    /** derive the information matrix of the edges from the final GICP correspondences, 
+     *  instead of using a constant information matrix */
+    bool correspondence_based_information;
+    /** number of resolution levels used in the loop closure alignment, one disables the coarse-to-fine registration */
+    unsigned resolution_levels;
+    /** factor between the voxel leaf sizes of two successive resolution levels */
+    double resolution_level_scale;
+    /** factor between the max correspondence distances of two successive resolution levels */
+    double correspondence_distance_scale;
     
     GICPConfiguration() : max_correspondence_distance(2.5),
                           maximum_iterations(50), transformation_epsilon(1e-5),
                           euclidean_fitness_epsilon(1.0), correspondence_randomness(20),
                           maximum_optimizer_iterations(20), rotation_epsilon(2e-3),
                           point_cloud_density(0.2), max_fitness_score(1.0),
-                          position_sigma(0.001), orientation_sigma(0.0001), max_sensor_distance(2.0) {};
+                          position_sigma(0.001), orientation_sigma(0.0001), max_sensor_distance(2.0),
+                          downsampling_method(VoxelCentroid), voxel_leaf_size_x(0.1),
+                          voxel_leaf_size_y(0.1), voxel_leaf_size_z(0.05),
+                          correspondence_based_information(false), resolution_levels(1),
+                          resolution_level_scale(2.0), correspondence_distance_scale(2.0) {};
+};
+
+/**
+ * Parameters of the linear solvers of the optimizer
+ */
+struct LinearSolverConfiguration
+{
+    /** tolerance of the squared residual norm of the PCG solver */
+    double pcg_tolerance;
+    /** if false the PCG tolerance is relative to the squared norm of the right hand side */
+    bool pcg_absolute_tolerance;
+    /** maximum iterations of the PCG solver, a negative value allows twice the dimension of the system */
+    int pcg_max_iterations;
+    /** start the PCG solver with the solution of the previous system */
+    bool pcg_warm_start;
+    /** order the variables block wise before the factorization by CSparse, Cholmod or Eigen */
+    bool block_ordering;
+
+    LinearSolverConfiguration() : pcg_tolerance(1e-6), pcg_absolute_tolerance(true), pcg_max_iterations(-1),
+                                  pcg_warm_start(true), block_ordering(true) {};
+};
+
+/**
+ * Robust kernels which can be applied to the loop closure edges
+ */
+enum RobustKernelType
+{
+    /** plain least squares */
+    NoRobustKernel = 0,
+    /** quadratic up to the kernel width, linear beyond it */
+    HuberKernel,
+    /** logarithmic growth of the cost beyond the kernel width */
+    CauchyKernel,
+    /** dynamic covariance scaling, downweights edges with a large error similar to switchable constraints */
+    DCSKernel
+};
+
+/**
+ * Acceptance and weighting of the loop closure edges
+ */
+struct LoopClosureConfiguration
+{
+    /** robust kernel of the loop closure edges, odometry edges are never robustified */
+    RobustKernelType robust_kernel;
+    /** width of the robust kernel */
+    double robust_kernel_width;
+    /** maximum chi-square value of the innovation of a new loop closure, 
+     *  the innovation covariance contains the marginal covariances of both vertices and the edge covariance.
+     *  A non-positive value disables the consistency check, which is the default. 
+     *  The 99.9% quantile for six degrees of freedom is 22.46. */
+    double max_innovation_chi2;
+    /** a loop closure rejected by the consistency check is tested again after a new loop closure has been added
+     *  or once the relative position of its vertices has changed by more than this distance */
+    double retry_distance;
+    /** maximum number of times a rejected loop closure is tested again */
+    unsigned max_retries;
+
+    LoopClosureConfiguration() : robust_kernel(NoRobustKernel), robust_kernel_width(1.0), max_innovation_chi2(0.0),
+                                 retry_distance(0.1), max_retries(3) {};
 };
 
 }
@@ -0,0 +1,279 @@
+#include "graph_snapshot.hpp"
+#include <fstream>
+#include <cstring>
+#include <stdexcept>
+#include <boost/cstdint.hpp>
+
+namespace graph_slam
+{
+
+static const char snapshot_magic[8] = {'G', 'S', 'L', 'A', 'M', 'S', 'N', 'P'};
+/** has to be increased on every change of the format */
+static const boost::uint32_t snapshot_version = 3;
+
+template<typename T>
+static void write(std::ostream& os, const T& value)
+{
+    os.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<typename T>
+static void read(std::istream& is, T& value)
+{
+    is.read(reinterpret_cast<char*>(&value), sizeof(T));
+    if(!is.good())
+        throw std::runtime_error("unexpected end of the graph snapshot");
+}
+
+static boost::uint64_t remainingBytes(std::istream& is)
+{
+    std::streampos position = is.tellg();
+    is.seekg(0, std::ios::end);
+    std::streampos end = is.tellg();
+    is.seekg(position);
+    if(position < 0 || end < position || !is.good())
+        throw std::runtime_error("failed to determine the size of the graph snapshot");
+    return end - position;
+}
+
+/** Checks a number of elements against the remaining size of the stream,
+ * so that a corrupted snapshot can't cause huge allocations */
+static void checkCount(std::istream& is, boost::uint64_t count, size_t min_element_size)
+{
+    if(count > remainingBytes(is) / min_element_size)
+        throw std::runtime_error("invalid element count in the graph snapshot");
+}
+
+static boost::uint64_t readCount(std::istream& is, size_t min_element_size)
+{
+    boost::uint64_t count;
+    read(is, count);
+    checkCount(is, count, min_element_size);
+    return count;
+}
+
+template<typename Derived>
+static void writeMatrix(std::ostream& os, const Eigen::MatrixBase<Derived>& matrix)
+{
+    typename Derived::PlainObject plain = matrix;
+    os.write(reinterpret_cast<const char*>(plain.data()), plain.size() * sizeof(typename Derived::Scalar));
+}
+
+template<typename Derived>
+static void readMatrix(std::istream& is, Eigen::MatrixBase<Derived>& matrix)
+{
+    is.read(reinterpret_cast<char*>(matrix.derived().data()), matrix.size() * sizeof(typename Derived::Scalar));
+    if(!is.good())
+        throw std::runtime_error("unexpected end of the graph snapshot");
+}
+
+static void writeLevel(std::ostream& os, const VertexSE3_GICP::GICPPointCloud& level)
+{
+    boost::uint64_t point_count = level.cloud ? level.cloud->size() : 0;
+    write(os, point_count);
+    for(boost::uint64_t i = 0; i < point_count; i++)
+    {
+        const pcl::PointXYZ& point = level.cloud->points[i];
+        write(os, point.x);
+        write(os, point.y);
+        write(os, point.z);
+    }
+    boost::uint8_t has_covariances = level.covariances && level.covariances->size() == point_count;
+    write(os, has_covariances);
+    if(has_covariances)
+    {
+        write(os, (boost::uint32_t)level.covariance_neighbors);
+        for(PointCovariances::const_iterator it = level.covariances->begin(); it != level.covariances->end(); it++)
+            writeMatrix(os, *it);
+    }
+}
+
+static boost::shared_ptr<VertexSE3_GICP::GICPPointCloud> readLevel(std::istream& is, const VertexSE3_GICP::PCLPointCloudPtr& cloud)
+{
+    boost::uint64_t point_count = readCount(is, 3 * sizeof(float));
+    cloud->points.resize(point_count);
+    cloud->width = point_count;
+    cloud->height = 1;
+    for(boost::uint64_t i = 0; i < point_count; i++)
+    {
+        pcl::PointXYZ& point = cloud->points[i];
+        read(is, point.x);
+        read(is, point.y);
+        read(is, point.z);
+    }
+
+    boost::shared_ptr<VertexSE3_GICP::GICPPointCloud> level(new VertexSE3_GICP::GICPPointCloud);
+    level->cloud = cloud;
+    boost::uint8_t has_covariances;
+    read(is, has_covariances);
+    if(has_covariances)
+    {
+        boost::uint32_t covariance_neighbors;
+        read(is, covariance_neighbors);
+        checkCount(is, point_count, 9 * sizeof(double));
+        VertexSE3_GICP::PointCovariancesPtr covariances(new PointCovariances(point_count));
+        for(PointCovariances::iterator it = covariances->begin(); it != covariances->end(); it++)
+            readMatrix(is, *it);
+        level->covariances = covariances;
+        level->covariance_neighbors = covariance_neighbors;
+    }
+    if(!cloud->empty())
+    {
+        level->search_tree.reset(new VertexSE3_GICP::PCLSearchTree);
+        level->search_tree->setInputCloud(cloud);
+    }
+    return level;
+}
+
+void saveGraphSnapshot(const std::string& path, const GraphSnapshot& snapshot)
+{
+    std::ofstream os(path.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+    if(!os.is_open())
+        throw std::runtime_error("failed to open " + path + " for writing the graph snapshot");
+
+    os.write(snapshot_magic, sizeof(snapshot_magic));
+    write(os, snapshot_version);
+    write(os, (boost::int32_t)snapshot.next_vertex_id);
+    write(os, (boost::int32_t)snapshot.last_vertex_id);
+    writeMatrix(os, snapshot.odometry_pose_last_vertex.matrix());
+    writeMatrix(os, snapshot.odometry_covariance_last_vertex);
+
+    write(os, (boost::uint64_t)snapshot.vertices.size());
+    for(GraphSnapshot::Vertices::const_iterator it = snapshot.vertices.begin(); it != snapshot.vertices.end(); it++)
+    {
+        write(os, (boost::int32_t)it->id);
+        write(os, (boost::uint8_t)it->fixed);
+        writeMatrix(os, it->pose.matrix());
+        write(os, (boost::uint8_t)it->has_covariance);
+        writeMatrix(os, it->covariance);
+        write(os, (boost::uint8_t)it->has_pointcloud);
+        if(!it->has_pointcloud)
+            continue;
+        writeMatrix(os, it->sensor_origin.matrix());
+        write(os, (boost::uint64_t)it->points.size());
+        if(!it->points.empty())
+            os.write(reinterpret_cast<const char*>(&it->points[0]), it->points.size() * sizeof(Eigen::Vector3d));
+
+        // the finest level followed by the coarser ones
+        boost::uint32_t level_count = it->gicp_cloud ? it->gicp_cloud->coarse_levels.size() + 1 : 0;
+        write(os, level_count);
+        if(level_count > 0)
+        {
+            writeLevel(os, *it->gicp_cloud);
+            for(unsigned i = 0; i < it->gicp_cloud->coarse_levels.size(); i++)
+                writeLevel(os, *it->gicp_cloud->coarse_levels[i]);
+        }
+    }
+
+    write(os, (boost::uint64_t)snapshot.edges.size());
+    for(GraphSnapshot::Edges::const_iterator it = snapshot.edges.begin(); it != snapshot.edges.end(); it++)
+    {
+        write(os, (boost::int32_t)it->source_id);
+        write(os, (boost::int32_t)it->target_id);
+        write(os, (boost::uint8_t)it->kind);
+        writeMatrix(os, it->measurement.matrix());
+        writeMatrix(os, it->information);
+        write(os, it->fitness_score);
+        write(os, (boost::uint8_t)it->robust_kernel);
+        write(os, it->robust_kernel_width);
+    }
+
+    os.flush();
+    if(!os.good())
+        throw std::runtime_error("failed to write the graph snapshot to " + path);
+}
+
+void loadGraphSnapshot(const std::string& path, GraphSnapshot& snapshot)
+{
+    std::ifstream is(path.c_str(), std::ios::in | std::ios::binary);
+    if(!is.is_open())
+        throw std::runtime_error("failed to open the graph snapshot " + path);
+
+    char magic[sizeof(snapshot_magic)];
+    is.read(magic, sizeof(magic));
+    if(!is.good() || std::memcmp(magic, snapshot_magic, sizeof(magic)) != 0)
+        throw std::runtime_error(path + " is not a graph snapshot");
+    boost::uint32_t version;
+    read(is, version);
+    if(version != snapshot_version)
+        throw std::runtime_error("the graph snapshot " + path + " has an unsupported version");
+
+    boost::int32_t next_vertex_id, last_vertex_id;
+    read(is, next_vertex_id);
+    read(is, last_vertex_id);
+    snapshot.next_vertex_id = next_vertex_id;
+    snapshot.last_vertex_id = last_vertex_id;
+    readMatrix(is, snapshot.odometry_pose_last_vertex.matrix());
+    readMatrix(is, snapshot.odometry_covariance_last_vertex);
+
+    // a vertex consists at least of its id, the flags, the pose and the covariance
+    boost::uint64_t vertex_count = readCount(is, sizeof(boost::int32_t) + 3 * sizeof(boost::uint8_t) + (16 + 36) * sizeof(double));
+    snapshot.vertices.clear();
+    snapshot.vertices.resize(vertex_count);
+    for(GraphSnapshot::Vertices::iterator it = snapshot.vertices.begin(); it != snapshot.vertices.end(); it++)
+    {
+        boost::int32_t id;
+        boost::uint8_t fixed, has_covariance, has_pointcloud;
+        read(is, id);
+        read(is, fixed);
+        it->id = id;
+        it->fixed = fixed;
+        readMatrix(is, it->pose.matrix());
+        read(is, has_covariance);
+        it->has_covariance = has_covariance;
+        readMatrix(is, it->covariance);
+        read(is, has_pointcloud);
+        it->has_pointcloud = has_pointcloud;
+        if(!it->has_pointcloud)
+            continue;
+        readMatrix(is, it->sensor_origin.matrix());
+        boost::uint64_t point_count = readCount(is, sizeof(Eigen::Vector3d));
+        it->points.resize(point_count);
+        if(point_count > 0)
+        {
+            is.read(reinterpret_cast<char*>(&it->points[0]), point_count * sizeof(Eigen::Vector3d));
+            if(!is.good())
+                throw std::runtime_error("unexpected end of the graph snapshot");
+        }
+
+        boost::uint32_t level_count;
+        read(is, level_count);
+        it->gicp_pointcloud.reset(new VertexSE3_GICP::PCLPointCloud);
+        if(level_count > 0)
+        {
+            boost::shared_ptr<VertexSE3_GICP::GICPPointCloud> gicp_cloud = readLevel(is, it->gicp_pointcloud);
+            for(unsigned i = 1; i < level_count; i++)
+                gicp_cloud->coarse_levels.push_back(readLevel(is, VertexSE3_GICP::PCLPointCloudPtr(new VertexSE3_GICP::PCLPointCloud)));
+            it->gicp_cloud = gicp_cloud;
+        }
+        else
+            it->gicp_cloud.reset();
+    }
+
+    boost::uint64_t edge_count = readCount(is, 2 * sizeof(boost::int32_t) + 2 * sizeof(boost::uint8_t) + (16 + 36 + 2) * sizeof(double));
+    snapshot.edges.clear();
+    snapshot.edges.resize(edge_count);
+    for(GraphSnapshot::Edges::iterator it = snapshot.edges.begin(); it != snapshot.edges.end(); it++)
+    {
+        boost::int32_t source_id, target_id;
+        boost::uint8_t kind, robust_kernel;
+        read(is, source_id);
+        read(is, target_id);
+        read(is, kind);
+        if(kind > GraphSnapshot::ConstraintEdge)
+            throw std::runtime_error("invalid edge kind in the graph snapshot");
+        it->source_id = source_id;
+        it->target_id = target_id;
+        it->kind = (GraphSnapshot::EdgeKind)kind;
+        readMatrix(is, it->measurement.matrix());
+        readMatrix(is, it->information);
+        read(is, it->fitness_score);
+        read(is, robust_kernel);
+        if(robust_kernel > DCSKernel)
+            throw std::runtime_error("invalid robust kernel in the graph snapshot");
+        it->robust_kernel = (RobustKernelType)robust_kernel;
+        read(is, it->robust_kernel_width);
+    }
+}
+
+}
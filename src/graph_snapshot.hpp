@@ -0,0 +1,94 @@
+#ifndef GRAPH_SLAM_GRAPH_SNAPSHOT_HPP
+#define GRAPH_SLAM_GRAPH_SNAPSHOT_HPP
+
+#include <string>
+#include <vector>
+#include <Eigen/Geometry>
+#include <Eigen/StdVector>
+#include <graph_slam/vertex_se3_gicp.hpp>
+#include <graph_slam/matrix_helper.hpp>
+#include <graph_slam/graph_slam_config.hpp>
+
+namespace graph_slam
+{
+
+/**
+ * State of a pose graph as it is stored in a binary snapshot file.
+ * Besides the poses and constraints, the snapshot contains the pointclouds of the
+ * vertices in full resolution and their already downsampled GICP pointclouds including
+ * the point covariances, so that a graph can be restored without filtering again.
+ */
+struct GraphSnapshot
+{
+    struct Vertex
+    {
+        int id;
+        bool fixed;
+        Eigen::Isometry3d pose;
+        /** marginal covariance of the pose, only valid if has_covariance is set */
+        bool has_covariance;
+        Matrix6d covariance;
+        /** the vertex had a pointcloud attached, the sensor origin, the points and the GICP data are only valid if it is set */
+        bool has_pointcloud;
+        Eigen::Affine3d sensor_origin;
+        std::vector<Eigen::Vector3d> points;
+        /** downsampled pointcloud, it is only set by loadGraphSnapshot() */
+        VertexSE3_GICP::PCLPointCloudPtr gicp_pointcloud;
+        /** GICP data of the downsampled pointcloud and its coarser levels,
+         * the search trees aren't stored but rebuilt on loading */
+        VertexSE3_GICP::GICPPointCloudConstPtr gicp_cloud;
+        Vertex() : id(-1), fixed(false), pose(Eigen::Isometry3d::Identity()), has_covariance(false),
+                   covariance(Matrix6d::Identity()), has_pointcloud(false), sensor_origin(Eigen::Affine3d::Identity()) {}
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+
+    enum EdgeKind
+    {
+        /** GICP edge between consecutive vertices */
+        OdometryEdge = 0,
+        /** GICP edge found by the loop closure search */
+        LoopClosureEdge,
+        /** plain SE3 constraint without a pointcloud alignment, e.g. a sparsified constraint */
+        ConstraintEdge
+    };
+
+    struct Edge
+    {
+        int source_id;
+        int target_id;
+        EdgeKind kind;
+        Eigen::Isometry3d measurement;
+        Matrix6d information;
+        double fitness_score;
+        RobustKernelType robust_kernel;
+        double robust_kernel_width;
+        Edge() : source_id(-1), target_id(-1), kind(OdometryEdge), measurement(Eigen::Isometry3d::Identity()),
+                 information(Matrix6d::Identity()), fitness_score(0.0), robust_kernel(NoRobustKernel), robust_kernel_width(1.0) {}
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+
+    typedef std::vector<Vertex, Eigen::aligned_allocator<Vertex> > Vertices;
+    typedef std::vector<Edge, Eigen::aligned_allocator<Edge> > Edges;
+
+    int next_vertex_id;
+    int last_vertex_id;
+    Eigen::Isometry3d odometry_pose_last_vertex;
+    Matrix6d odometry_covariance_last_vertex;
+    Vertices vertices;
+    Edges edges;
+
+    GraphSnapshot() : next_vertex_id(0), last_vertex_id(-1), odometry_pose_last_vertex(Eigen::Isometry3d::Identity()),
+                      odometry_covariance_last_vertex(Matrix6d::Zero()) {}
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+/** Writes a snapshot to a file, throws a std::runtime_error if the file can't be written */
+void saveGraphSnapshot(const std::string& path, const GraphSnapshot& snapshot);
+
+/** Reads a snapshot from a file, throws a std::runtime_error if the file can't be read,
+ * is corrupted or has been written by an incompatible version */
+void loadGraphSnapshot(const std::string& path, GraphSnapshot& snapshot);
+
+}
+
+#endif
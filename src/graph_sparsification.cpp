@@ -0,0 +1,129 @@
+#include "graph_sparsification.hpp"
+#include <cmath>
+#include <limits>
+
+namespace graph_slam
+{
+
+/** Inverts a symmetric positive semi-definite matrix, a small regularization keeps it invertible */
+static Eigen::MatrixXd invertInformation(const Eigen::MatrixXd& information)
+{
+    Eigen::MatrixXd regularized = information;
+    regularized.diagonal().array() += 1e-9 * std::max(1.0, information.diagonal().cwiseAbs().maxCoeff());
+    return regularized.ldlt().solve(Eigen::MatrixXd::Identity(information.rows(), information.cols()));
+}
+
+/** Removes the first block of the given size from the information matrix by its Schur complement */
+static Eigen::MatrixXd marginalizeFirstBlock(const Eigen::MatrixXd& information, int block_size)
+{
+    int remaining = information.rows() - block_size;
+    return information.bottomRightCorner(remaining, remaining) -
+           information.bottomLeftCorner(remaining, block_size) * invertInformation(information.topLeftCorner(block_size, block_size)) *
+           information.topRightCorner(block_size, remaining);
+}
+
+bool sparsifyMarginal(unsigned neighbor_count, const LinearizedConstraints& constraints, SparsifiedConstraints& tree)
+{
+    tree.clear();
+    const unsigned vertex_count = neighbor_count + 1;
+
+    // build the information matrix of the markov blanket
+    Eigen::MatrixXd information = Eigen::MatrixXd::Zero(6 * vertex_count, 6 * vertex_count);
+    for(LinearizedConstraints::const_iterator it = constraints.begin(); it != constraints.end(); it++)
+    {
+        if(it->from >= vertex_count || it->to >= vertex_count || it->from == it->to || is_nan(it->information) ||
+           is_nan(it->jacobian_from) || is_nan(it->jacobian_to))
+            return false;
+        information.block<6,6>(6 * it->from, 6 * it->from) += it->jacobian_from.transpose() * it->information * it->jacobian_from;
+        information.block<6,6>(6 * it->to, 6 * it->to) += it->jacobian_to.transpose() * it->information * it->jacobian_to;
+        Matrix6d off_diagonal = it->jacobian_from.transpose() * it->information * it->jacobian_to;
+        information.block<6,6>(6 * it->from, 6 * it->to) += off_diagonal;
+        information.block<6,6>(6 * it->to, 6 * it->from) += off_diagonal.transpose();
+    }
+
+    if(neighbor_count < 2)
+        return true;
+
+    // marginalize the vertex
+    Eigen::MatrixXd marginal = marginalizeFirstBlock(information, 6);
+
+    // the informations of the relative poses between all pairs of neighbors
+    std::vector< std::vector<double> > weights(neighbor_count, std::vector<double>(neighbor_count, -std::numeric_limits<double>::infinity()));
+    std::vector< std::vector<Matrix6d, Eigen::aligned_allocator<Matrix6d> > > pair_informations(neighbor_count,
+                                                    std::vector<Matrix6d, Eigen::aligned_allocator<Matrix6d> >(neighbor_count));
+    for(unsigned a = 0; a < neighbor_count; a++)
+    {
+        for(unsigned b = a + 1; b < neighbor_count; b++)
+        {
+            // move the pair to the end and marginalize all other neighbors
+            Eigen::VectorXi order(6 * neighbor_count);
+            unsigned index = 0;
+            for(unsigned i = 0; i < neighbor_count; i++)
+            {
+                if(i == a || i == b)
+                    continue;
+                for(unsigned j = 0; j < 6; j++)
+                    order(index++) = 6 * i + j;
+            }
+            for(unsigned j = 0; j < 6; j++)
+                order(index++) = 6 * a + j;
+            for(unsigned j = 0; j < 6; j++)
+                order(index++) = 6 * b + j;
+            Eigen::PermutationMatrix<Eigen::Dynamic> permutation(order);
+            Eigen::MatrixXd ordered = permutation.transpose() * marginal * permutation;
+            Eigen::MatrixXd pair_information = neighbor_count > 2 ? marginalizeFirstBlock(ordered, 6 * (neighbor_count - 2)) : ordered;
+
+            // the information of b given a is the information of the relative pose
+            Matrix6d relative = pair_information.bottomRightCorner<6,6>();
+            relative = 0.5 * (relative + relative.transpose());
+            Eigen::LDLT<Matrix6d> ldlt(relative);
+            if(ldlt.info() != Eigen::Success || !ldlt.isPositive() || ldlt.vectorD().minCoeff() <= 0.0)
+                continue;
+            pair_informations[a][b] = relative;
+            weights[a][b] = weights[b][a] = ldlt.vectorD().array().log().sum();
+        }
+    }
+
+    // maximum spanning tree (Prim), the neighbors are not necessarily connected
+    std::vector<bool> in_tree(neighbor_count, false);
+    std::vector<double> best_weight(neighbor_count, -std::numeric_limits<double>::infinity());
+    std::vector<int> best_parent(neighbor_count, -1);
+    for(unsigned root = 0; root < neighbor_count; root++)
+    {
+        if(in_tree[root])
+            continue;
+        unsigned next = root;
+        while(true)
+        {
+            in_tree[next] = true;
+            if(best_parent[next] >= 0)
+            {
+                SparsifiedConstraint constraint;
+                constraint.from = std::min<unsigned>(best_parent[next], next);
+                constraint.to = std::max<unsigned>(best_parent[next], next);
+                constraint.information = pair_informations[constraint.from][constraint.to];
+                tree.push_back(constraint);
+            }
+            for(unsigned i = 0; i < neighbor_count; i++)
+            {
+                if(!in_tree[i] && weights[next][i] > best_weight[i])
+                {
+                    best_weight[i] = weights[next][i];
+                    best_parent[i] = next;
+                }
+            }
+            int best = -1;
+            for(unsigned i = 0; i < neighbor_count; i++)
+            {
+                if(!in_tree[i] && best_parent[i] >= 0 && (best < 0 || best_weight[i] > best_weight[best]))
+                    best = i;
+            }
+            if(best < 0)
+                break;
+            next = best;
+        }
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,53 @@
+#ifndef GRAPH_SLAM_GRAPH_SPARSIFICATION_HPP
+#define GRAPH_SLAM_GRAPH_SPARSIFICATION_HPP
+
+#include <vector>
+#include <Eigen/StdVector>
+#include <graph_slam/matrix_helper.hpp>
+
+namespace graph_slam
+{
+
+/** A binary pose constraint, linearized at the current estimate.
+ * The index zero denotes the vertex to marginalize, the indices 1 to n its neighbors.
+ */
+struct LinearizedConstraint
+{
+    unsigned from;
+    unsigned to;
+    Matrix6d jacobian_from;
+    Matrix6d jacobian_to;
+    Matrix6d information;
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+typedef std::vector<LinearizedConstraint, Eigen::aligned_allocator<LinearizedConstraint> > LinearizedConstraints;
+
+/** A relative pose constraint between two neighbors, the indices start at zero for the first neighbor.
+ * The information is given in the tangent space of the to-vertex.
+ */
+struct SparsifiedConstraint
+{
+    unsigned from;
+    unsigned to;
+    Matrix6d information;
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+typedef std::vector<SparsifiedConstraint, Eigen::aligned_allocator<SparsifiedConstraint> > SparsifiedConstraints;
+
+/**
+ * Marginalizes a vertex out of its Markov blanket and approximates the dense information
+ * between its neighbors by a tree of relative pose constraints (Chow-Liu approximation).
+ * The Schur complement of the vertex is computed from the linearized constraints. For each
+ * pair of neighbors the information of the relative pose is taken from their joint marginal,
+ * and the spanning tree maximizing the log-determinant of these informations is selected.
+ *
+ * @param neighbor_count number of neighbors of the vertex
+ * @param constraints all constraints between the vertex and its neighbors
+ * @param tree resulting constraints between the neighbors
+ * @return false if the constraints are invalid
+ */
+bool sparsifyMarginal(unsigned neighbor_count, const LinearizedConstraints& constraints, SparsifiedConstraints& tree);
+
+}
+
+#endif
@@ -0,0 +1,342 @@
+#include "incremental_mls_projection.hpp"
+#include <graph_slam/instrumentation.hpp>
+#include <set>
+#include <list>
+#include <iostream>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+namespace graph_slam
+{
+
+IncrementalMLSProjection::CellBounds::CellBounds() : min_x(std::numeric_limits<int>::max()), min_y(std::numeric_limits<int>::max()),
+                                                     max_x(std::numeric_limits<int>::min()), max_y(std::numeric_limits<int>::min())
+{
+}
+
+void IncrementalMLSProjection::CellBounds::extend(int x, int y)
+{
+    min_x = std::min(min_x, x);
+    min_y = std::min(min_y, y);
+    max_x = std::max(max_x, x);
+    max_y = std::max(max_y, y);
+}
+
+bool IncrementalMLSProjection::CellBounds::intersects(const CellBounds& other) const
+{
+    return !isEmpty() && !other.isEmpty() &&
+           min_x <= other.max_x && other.min_x <= max_x &&
+           min_y <= other.max_y && other.min_y <= max_y;
+}
+
+IncrementalMLSProjection::IncrementalMLSProjection() : translation_threshold(0.01), rotation_threshold(0.001), full_update_ratio(0.5),
+                                                       min_x(0.0), max_x(0.0), min_y(0.0), max_y(0.0), min_z(0.0), max_z(0.0),
+                                                       area_of_interest_set(false), last_update_complete(false), grid(NULL), pointcloud_store(NULL)
+{
+}
+
+void IncrementalMLSProjection::setUpdateThresholds(double translation_threshold, double rotation_threshold)
+{
+    this->translation_threshold = translation_threshold;
+    this->rotation_threshold = rotation_threshold;
+}
+
+void IncrementalMLSProjection::setFullUpdateRatio(double full_update_ratio)
+{
+    this->full_update_ratio = full_update_ratio;
+}
+
+void IncrementalMLSProjection::setAreaOfInterest(double min_x, double max_x, double min_y, double max_y, double min_z, double max_z)
+{
+    this->min_x = min_x;
+    this->max_x = max_x;
+    this->min_y = min_y;
+    this->max_y = max_y;
+    this->min_z = min_z;
+    this->max_z = max_z;
+    area_of_interest_set = true;
+    if(update_projection)
+        update_projection->setAreaOfInterest(min_x, max_x, min_y, max_y, min_z, max_z);
+}
+
+void IncrementalMLSProjection::setPointcloudStore(PointcloudStore* pointcloud_store)
+{
+    this->pointcloud_store = pointcloud_store;
+}
+
+void IncrementalMLSProjection::loadPointcloud(envire::Pointcloud* pointcloud)
+{
+    if(pointcloud_store && !pointcloud_store->loadPoints(pointcloud))
+        std::cerr << "IncrementalMLSProjection: failed to load a spilled pointcloud." << std::endl;
+}
+
+size_t IncrementalMLSProjection::getPointCount(const envire::Pointcloud* pointcloud) const
+{
+    // spilled pointclouds keep the size they had when they were projected
+    if(pointcloud_store && pointcloud_store->isSpilled(pointcloud))
+    {
+        ProjectedPointclouds::const_iterator it = projected_pointclouds.find(pointcloud);
+        if(it != projected_pointclouds.end())
+            return it->second.point_count;
+    }
+    return pointcloud->vertices.size();
+}
+
+void IncrementalMLSProjection::removePointcloud(const envire::Pointcloud* pointcloud)
+{
+    ProjectedPointclouds::iterator it = projected_pointclouds.find(pointcloud);
+    if(it != projected_pointclouds.end())
+    {
+        outdated_cells.push_back(it->second.cells);
+        projected_pointclouds.erase(it);
+    }
+}
+
+void IncrementalMLSProjection::clear()
+{
+    projected_pointclouds.clear();
+    outdated_cells.clear();
+    update_projection.reset();
+    grid = NULL;
+}
+
+bool IncrementalMLSProjection::hasMoved(const Eigen::Affine3d& projected_pose, const Eigen::Affine3d& pose) const
+{
+    if((projected_pose.translation() - pose.translation()).norm() > translation_threshold)
+        return true;
+    Eigen::AngleAxisd rotation_delta(Eigen::Matrix3d(projected_pose.linear().transpose() * pose.linear()));
+    return std::abs(rotation_delta.angle()) > rotation_threshold;
+}
+
+bool IncrementalMLSProjection::toCell(const Eigen::Vector3d& point, int& x, int& y) const
+{
+    x = (int)std::floor((point.x() - grid->getOffsetX()) / grid->getScaleX());
+    y = (int)std::floor((point.y() - grid->getOffsetY()) / grid->getScaleY());
+    return x >= 0 && y >= 0 && x < (int)grid->getWidth() && y < (int)grid->getHeight();
+}
+
+void IncrementalMLSProjection::recordProjection(const envire::Pointcloud* pointcloud, const Eigen::Affine3d& pose)
+{
+    ProjectedPointcloud& projected = projected_pointclouds[pointcloud];
+    projected.pose = pose;
+    projected.point_count = pointcloud->vertices.size();
+    projected.cells = CellBounds();
+    transformPoints(mapPoints(pointcloud->vertices), pose, transformed_points);
+    if(transformed_points.cols() == 0)
+        return;
+
+    // if all points are within the grid the cells are given by the bounding box
+    Eigen::AlignedBox3d bounding_box = computeBoundingBox(transformed_points);
+    int x, y;
+    if(toCell(bounding_box.min(), x, y))
+    {
+        int max_x, max_y;
+        if(toCell(bounding_box.max(), max_x, max_y))
+        {
+            projected.cells.extend(x, y);
+            projected.cells.extend(max_x, max_y);
+            return;
+        }
+    }
+    for(int i = 0; i < transformed_points.cols(); i++)
+    {
+        if(toCell(transformed_points.col(i), x, y))
+            projected.cells.extend(x, y);
+    }
+}
+
+void IncrementalMLSProjection::clearOutdatedCells()
+{
+    cell_mask.assign(grid->getWidth() * grid->getHeight(), false);
+    for(std::vector<CellBounds>::const_iterator bounds = outdated_cells.begin(); bounds != outdated_cells.end(); bounds++)
+    {
+        if(bounds->isEmpty())
+            continue;
+        for(int x = std::max(bounds->min_x, 0); x <= std::min(bounds->max_x, (int)grid->getWidth() - 1); x++)
+        {
+            for(int y = std::max(bounds->min_y, 0); y <= std::min(bounds->max_y, (int)grid->getHeight() - 1); y++)
+            {
+                size_t index = y * grid->getWidth() + x;
+                if(cell_mask[index])
+                    continue;
+                cell_mask[index] = true;
+                for(envire::MLSGrid::iterator it = grid->beginCell(x, y); it != grid->endCell();)
+                    it = grid->erase(it);
+            }
+        }
+    }
+}
+
+void IncrementalMLSProjection::setupUpdateProjection(envire::Environment& env)
+{
+    if(update_projection)
+        return;
+    // a second projection into the same map, which only gets the pointclouds to update as inputs
+    update_projection.reset(new envire::MLSProjection());
+    if(area_of_interest_set)
+        update_projection->setAreaOfInterest(min_x, max_x, min_y, max_y, min_z, max_z);
+    env.attachItem(update_projection.get());
+    env.addOutput(update_projection.get(), grid);
+}
+
+size_t IncrementalMLSProjection::update(envire::Environment& env, envire::MLSProjection& projection, const std::set<const envire::Pointcloud*>* moved_pointclouds)
+{
+    GRAPH_SLAM_SCOPED_TIMER(mls_update_time);
+    envire::MultiLevelSurfaceGrid* mls = env.getOutput<envire::MultiLevelSurfaceGrid*>(&projection);
+    if(!mls)
+        return 0;
+    if(mls != grid)
+    {
+        clear();
+        grid = mls;
+    }
+
+    // collect the input pointclouds and their poses in the grid frame
+    std::list<envire::Layer*> inputs = env.getInputs(&projection);
+    std::vector<envire::Pointcloud*> pointclouds;
+    Poses poses;
+    for(std::list<envire::Layer*>::const_iterator it = inputs.begin(); it != inputs.end(); it++)
+    {
+        envire::Pointcloud* pointcloud = dynamic_cast<envire::Pointcloud*>(*it);
+        if(!pointcloud || !pointcloud->getFrameNode())
+            continue;
+        pointclouds.push_back(pointcloud);
+        // the pose of projected pointclouds which are known to be unchanged doesn't need to be looked up
+        ProjectedPointclouds::const_iterator projected = projected_pointclouds.find(pointcloud);
+        if(moved_pointclouds && projected != projected_pointclouds.end() && !moved_pointclouds->count(pointcloud))
+            poses.push_back(projected->second.pose);
+        else
+            poses.push_back(pointcloud->getFrameNode()->relativeTransform(grid->getFrameNode()));
+    }
+
+    // forget pointclouds which are no longer part of the projection
+    std::set<const envire::Pointcloud*> current_pointclouds(pointclouds.begin(), pointclouds.end());
+    for(ProjectedPointclouds::iterator it = projected_pointclouds.begin(); it != projected_pointclouds.end();)
+    {
+        if(!current_pointclouds.count(it->first))
+        {
+            outdated_cells.push_back(it->second.cells);
+            projected_pointclouds.erase(it++);
+        }
+        else
+            it++;
+    }
+
+    // find new and moved pointclouds
+    std::vector<bool> dirty(pointclouds.size(), false);
+    size_t dirty_count = 0;
+    for(unsigned i = 0; i < pointclouds.size(); i++)
+    {
+        ProjectedPointclouds::const_iterator it = projected_pointclouds.find(pointclouds[i]);
+        if(it == projected_pointclouds.end())
+            dirty[i] = true;
+        else if(it->second.point_count != getPointCount(pointclouds[i]) || hasMoved(it->second.pose, poses[i]))
+        {
+            outdated_cells.push_back(it->second.cells);
+            dirty[i] = true;
+        }
+        if(dirty[i])
+            dirty_count++;
+    }
+
+    last_update_complete = false;
+    if(dirty_count == 0 && outdated_cells.empty())
+        return 0;
+
+    // find unchanged pointclouds overlapping the outdated cells
+    std::vector<unsigned> overlapping;
+    for(unsigned i = 0; i < pointclouds.size(); i++)
+    {
+        if(dirty[i])
+            continue;
+        const CellBounds& cells = projected_pointclouds[pointclouds[i]].cells;
+        for(std::vector<CellBounds>::const_iterator bounds = outdated_cells.begin(); bounds != outdated_cells.end(); bounds++)
+        {
+            if(cells.intersects(*bounds))
+            {
+                overlapping.push_back(i);
+                break;
+            }
+        }
+    }
+
+    // rebuild the complete map if most of it is affected anyway
+    if(dirty_count + overlapping.size() > full_update_ratio * pointclouds.size())
+    {
+        grid->clear();
+        for(unsigned i = 0; i < pointclouds.size(); i++)
+        {
+            loadPointcloud(pointclouds[i]);
+            GRAPH_SLAM_COUNT(projected_points, pointclouds[i]->vertices.size());
+        }
+        if(!pointclouds.empty())
+            projection.updateAll();
+        else
+            grid->itemModified();
+
+        projected_pointclouds.clear();
+        outdated_cells.clear();
+        for(unsigned i = 0; i < pointclouds.size(); i++)
+            recordProjection(pointclouds[i], poses[i]);
+        last_update_complete = true;
+        return pointclouds.size();
+    }
+
+    clearOutdatedCells();
+    outdated_cells.clear();
+    setupUpdateProjection(env);
+
+    // the overlapping pointclouds are only projected into the cleared cells
+    std::vector<envire::Pointcloud::Ptr> clipped_pointclouds;
+    for(std::vector<unsigned>::const_iterator i = overlapping.begin(); i != overlapping.end(); i++)
+    {
+        envire::Pointcloud* pointcloud = pointclouds[*i];
+        loadPointcloud(pointcloud);
+        envire::Pointcloud::Ptr clipped(new envire::Pointcloud());
+        clipped->setSensorOrigin(pointcloud->getSensorOrigin());
+        int x, y;
+        transformPoints(mapPoints(pointcloud->vertices), poses[*i], transformed_points);
+        for(size_t j = 0; j < pointcloud->vertices.size(); j++)
+        {
+            if(toCell(transformed_points.col(j), x, y) && cell_mask[y * grid->getWidth() + x])
+                clipped->vertices.push_back(pointcloud->vertices[j]);
+        }
+        if(clipped->vertices.empty())
+            continue;
+        env.setFrameNode(clipped.get(), pointcloud->getFrameNode());
+        env.addInput(update_projection.get(), clipped.get());
+        GRAPH_SLAM_COUNT(projected_points, clipped->vertices.size());
+        clipped_pointclouds.push_back(clipped);
+    }
+
+    std::vector<envire::Pointcloud*> projected;
+    for(unsigned i = 0; i < pointclouds.size(); i++)
+    {
+        if(!dirty[i])
+            continue;
+        loadPointcloud(pointclouds[i]);
+        env.addInput(update_projection.get(), pointclouds[i]);
+        GRAPH_SLAM_COUNT(projected_points, pointclouds[i]->vertices.size());
+        projected.push_back(pointclouds[i]);
+        recordProjection(pointclouds[i], poses[i]);
+    }
+
+    if(!projected.empty() || !clipped_pointclouds.empty())
+        update_projection->updateAll();
+    else
+        grid->itemModified();
+
+    // remove the temporary inputs again
+    for(std::vector<envire::Pointcloud*>::const_iterator it = projected.begin(); it != projected.end(); it++)
+        env.removeInput(update_projection.get(), *it);
+    for(std::vector<envire::Pointcloud::Ptr>::const_iterator it = clipped_pointclouds.begin(); it != clipped_pointclouds.end(); it++)
+    {
+        env.removeInput(update_projection.get(), it->get());
+        env.detachItem(it->get());
+    }
+
+    return projected.size() + clipped_pointclouds.size();
+}
+
+}
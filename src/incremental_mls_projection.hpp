@@ -0,0 +1,122 @@
+#ifndef GRAPH_SLAM_INCREMENTAL_MLS_PROJECTION_HPP
+#define GRAPH_SLAM_INCREMENTAL_MLS_PROJECTION_HPP
+
+#include <map>
+#include <set>
+#include <vector>
+#include <Eigen/Geometry>
+#include <Eigen/StdVector>
+#include <envire/core/Environment.hpp>
+#include <envire/maps/Pointcloud.hpp>
+#include <envire/maps/MLSGrid.hpp>
+#include <envire/operators/MLSProjection.hpp>
+#include <graph_slam/pointcloud_store.hpp>
+#include <graph_slam/pointcloud_helper.hpp>
+
+namespace graph_slam
+{
+
+/**
+ * Keeps the output map of a MLS projection up to date with its input pointclouds.
+ * The pose of each pointcloud at the time of its projection is remembered, so that
+ * only pointclouds which have been added or moved by more than a threshold are
+ * projected again. The cells covered by moved or removed pointclouds are cleared,
+ * and the parts of other pointclouds falling into these cells are projected again.
+ * If too many pointclouds are affected, the complete map is rebuilt instead.
+ */
+class IncrementalMLSProjection
+{
+public:
+    IncrementalMLSProjection();
+
+    /** Sets the pose change of a pointcloud, above which it is projected again.
+     *
+     * @param translation_threshold translation threshold in meters
+     * @param rotation_threshold rotation threshold in radians
+     */
+    void setUpdateThresholds(double translation_threshold, double rotation_threshold);
+
+    /** Sets the share of pointclouds which need to be projected again,
+     * above which the complete map is rebuilt instead.
+     */
+    void setFullUpdateRatio(double full_update_ratio);
+
+    /** Sets the area of interest, it has to match the one of the projection. */
+    void setAreaOfInterest(double min_x, double max_x, double min_y, double max_y, double min_z, double max_z);
+
+    /** Sets a store whose spilled pointclouds are loaded back before they are projected.
+     * Use NULL to remove the store. */
+    void setPointcloudStore(PointcloudStore* pointcloud_store);
+
+    /** Marks the cells covered by a pointcloud as outdated.
+     * This has to be called before the pointcloud is removed from the projection,
+     * since its address might be reused by a new pointcloud afterwards.
+     */
+    void removePointcloud(const envire::Pointcloud* pointcloud);
+
+    /** Forgets all projected pointclouds, the next update rebuilds the complete map. */
+    void clear();
+
+    /** Brings the output map of the projection up to date with its inputs.
+     *
+     * @param env environment of the projection
+     * @param projection MLS projection with the pointclouds as inputs
+     * @param moved_pointclouds (optional) pointclouds whose frames might have changed since 
+     *                          the last update, the poses of all other projected pointclouds are not checked
+     * @return number of pointclouds which have been projected
+     */
+    size_t update(envire::Environment& env, envire::MLSProjection& projection, const std::set<const envire::Pointcloud*>* moved_pointclouds = NULL);
+
+    /** Returns true if the last update has rebuilt the complete map */
+    bool lastUpdateWasComplete() const {return last_update_complete;}
+
+protected:
+    /** Inclusive bounds of the grid cells covered by a pointcloud */
+    struct CellBounds
+    {
+        int min_x, min_y, max_x, max_y;
+        CellBounds();
+        bool isEmpty() const {return min_x > max_x || min_y > max_y;}
+        void extend(int x, int y);
+        bool intersects(const CellBounds& other) const;
+    };
+
+    struct ProjectedPointcloud
+    {
+        Eigen::Affine3d pose;
+        CellBounds cells;
+        size_t point_count;
+    };
+
+    typedef std::map<const envire::Pointcloud*, ProjectedPointcloud, std::less<const envire::Pointcloud*>,
+                     Eigen::aligned_allocator< std::pair<const envire::Pointcloud* const, ProjectedPointcloud> > > ProjectedPointclouds;
+    typedef std::vector<Eigen::Affine3d, Eigen::aligned_allocator<Eigen::Affine3d> > Poses;
+
+    bool hasMoved(const Eigen::Affine3d& projected_pose, const Eigen::Affine3d& pose) const;
+    bool toCell(const Eigen::Vector3d& point, int& x, int& y) const;
+    void recordProjection(const envire::Pointcloud* pointcloud, const Eigen::Affine3d& pose);
+    void clearOutdatedCells();
+    void setupUpdateProjection(envire::Environment& env);
+    void loadPointcloud(envire::Pointcloud* pointcloud);
+    size_t getPointCount(const envire::Pointcloud* pointcloud) const;
+
+    double translation_threshold;
+    double rotation_threshold;
+    double full_update_ratio;
+    double min_x, max_x, min_y, max_y, min_z, max_z;
+    bool area_of_interest_set;
+    bool last_update_complete;
+
+    envire::MultiLevelSurfaceGrid* grid;
+    PointcloudStore* pointcloud_store;
+    envire::MLSProjection::Ptr update_projection;
+    ProjectedPointclouds projected_pointclouds;
+    std::vector<CellBounds> outdated_cells;
+    std::vector<bool> cell_mask;
+    /** scratch buffer of the transformed points */
+    PointBuffer transformed_points;
+};
+
+}
+
+#endif
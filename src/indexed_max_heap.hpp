@@ -0,0 +1,151 @@
+#ifndef GRAPH_SLAM_INDEXED_MAX_HEAP_HPP
+#define GRAPH_SLAM_INDEXED_MAX_HEAP_HPP
+
+#include <vector>
+#include <stdexcept>
+#include <boost/unordered_map.hpp>
+
+namespace graph_slam
+{
+
+/**
+ * Binary max-heap of unique keys, ordered by a priority.
+ * The position of each key is indexed, so the priority of a key can be
+ * changed or the key can be removed in O(log n).
+ * Keys with the same priority are ordered ascending, i.e. the smaller key is on top.
+ */
+template<typename Key>
+class IndexedMaxHeap
+{
+public:
+    /** Inserts a key or updates its priority if it is already known */
+    void push(const Key& key, double priority)
+    {
+        typename Positions::iterator it = positions.find(key);
+        if(it == positions.end())
+        {
+            heap.push_back(Element(key, priority));
+            positions[key] = heap.size() - 1;
+            siftUp(heap.size() - 1);
+        }
+        else
+        {
+            size_t index = it->second;
+            double old_priority = heap[index].priority;
+            heap[index].priority = priority;
+            if(priority > old_priority)
+                siftUp(index);
+            else if(priority < old_priority)
+                siftDown(index);
+        }
+    }
+
+    /** Removes a key. Returns false if the key is unknown. */
+    bool remove(const Key& key)
+    {
+        typename Positions::iterator it = positions.find(key);
+        if(it == positions.end())
+            return false;
+        size_t index = it->second;
+        positions.erase(it);
+        if(index == heap.size() - 1)
+        {
+            heap.pop_back();
+            return true;
+        }
+        heap[index] = heap.back();
+        heap.pop_back();
+        positions[heap[index].key] = index;
+        siftUp(index);
+        siftDown(positions[heap[index].key]);
+        return true;
+    }
+
+    /** Returns the key with the highest priority */
+    const Key& top() const
+    {
+        if(heap.empty())
+            throw std::runtime_error("top called on an empty heap");
+        return heap.front().key;
+    }
+
+    /** Returns the highest priority */
+    double topPriority() const
+    {
+        if(heap.empty())
+            throw std::runtime_error("topPriority called on an empty heap");
+        return heap.front().priority;
+    }
+
+    /** Removes the key with the highest priority */
+    void pop()
+    {
+        if(!heap.empty())
+            remove(heap.front().key);
+    }
+
+    bool contains(const Key& key) const {return positions.count(key) > 0;}
+    bool empty() const {return heap.empty();}
+    size_t size() const {return heap.size();}
+    void clear() {heap.clear(); positions.clear();}
+
+protected:
+    struct Element
+    {
+        Key key;
+        double priority;
+        Element(const Key& key, double priority) : key(key), priority(priority) {};
+    };
+
+    typedef boost::unordered_map<Key, size_t> Positions;
+
+    /** Returns true if element a belongs above element b */
+    static bool isAbove(const Element& a, const Element& b)
+    {
+        return a.priority > b.priority || (a.priority == b.priority && a.key < b.key);
+    }
+
+    void swapElements(size_t a, size_t b)
+    {
+        std::swap(heap[a], heap[b]);
+        positions[heap[a].key] = a;
+        positions[heap[b].key] = b;
+    }
+
+    void siftUp(size_t index)
+    {
+        while(index > 0)
+        {
+            size_t parent = (index - 1) / 2;
+            if(!isAbove(heap[index], heap[parent]))
+                break;
+            swapElements(index, parent);
+            index = parent;
+        }
+    }
+
+    void siftDown(size_t index)
+    {
+        while(true)
+        {
+            size_t left = 2 * index + 1;
+            size_t right = left + 1;
+            size_t largest = index;
+            if(left < heap.size() && isAbove(heap[left], heap[largest]))
+                largest = left;
+            if(right < heap.size() && isAbove(heap[right], heap[largest]))
+                largest = right;
+            if(largest == index)
+                break;
+            swapElements(index, largest);
+            index = largest;
+        }
+    }
+
+    std::vector<Element> heap;
+    Positions positions;
+};
+
+}
+
+#endif
@@ -0,0 +1,67 @@
+#include "instrumentation.hpp"
+#include <base/Time.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace graph_slam
+{
+
+static InstrumentationStats stats;
+static boost::mutex stats_mutex;
+
+void InstrumentationStats::reset()
+{
+    gicp_time = 0.0;
+    gicp_calls = 0;
+    gicp_alignments = 0;
+    gicp_failures = 0;
+    downsampling_time = 0.0;
+    cov_graph_time = 0.0;
+    marginals_time = 0.0;
+    marginal_blocks = 0;
+    solver_time = 0.0;
+    mls_update_time = 0.0;
+    projected_points = 0;
+}
+
+InstrumentationStats getInstrumentationStats()
+{
+    boost::mutex::scoped_lock lock(stats_mutex);
+    return stats;
+}
+
+InstrumentationStats takeInstrumentationStats()
+{
+    boost::mutex::scoped_lock lock(stats_mutex);
+    InstrumentationStats current = stats;
+    stats.reset();
+    return current;
+}
+
+void resetInstrumentationStats()
+{
+    boost::mutex::scoped_lock lock(stats_mutex);
+    stats.reset();
+}
+
+void addInstrumentationTime(double InstrumentationStats::* timing, double seconds)
+{
+    boost::mutex::scoped_lock lock(stats_mutex);
+    stats.*timing += seconds;
+}
+
+void addInstrumentationCount(size_t InstrumentationStats::* counter, size_t count)
+{
+    boost::mutex::scoped_lock lock(stats_mutex);
+    stats.*counter += count;
+}
+
+ScopedInstrumentationTimer::ScopedInstrumentationTimer(double InstrumentationStats::* timing) : timing(timing), start(base::Time::now().toSeconds())
+{
+}
+
+ScopedInstrumentationTimer::~ScopedInstrumentationTimer()
+{
+    addInstrumentationTime(timing, base::Time::now().toSeconds() - start);
+}
+
+}
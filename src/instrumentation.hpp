@@ -0,0 +1,88 @@
+#ifndef GRAPH_SLAM_INSTRUMENTATION_HPP
+#define GRAPH_SLAM_INSTRUMENTATION_HPP
+
+#include <cstddef>
+
+namespace graph_slam
+{
+
+/**
+ * Timings and counters of the hot paths of a SLAM cycle.
+ * The timings are accumulated wall clock times in seconds. Stages running on several
+ * worker threads accumulate the times of all threads, so they can exceed the cycle time.
+ * The values are only recorded if the library is built with the CMake option
+ * GRAPH_SLAM_INSTRUMENTATION, otherwise they stay zero.
+ * The statistics are process-wide, since they are recorded by the edges, vertices and helpers
+ * without a reference to their optimizer. With several ExtendedSparseOptimizer instances in one
+ * process, the values are the sums over all of them and a reset affects all of them.
+ */
+struct InstrumentationStats
+{
+    /** time spent computing GICP measurements of edges */
+    double gicp_time;
+    /** number of computed GICP measurements */
+    size_t gicp_calls;
+    /** number of single GICP alignments, including the ones on coarser resolution levels */
+    size_t gicp_alignments;
+    /** number of GICP measurements which didn't converge or have been rejected */
+    size_t gicp_failures;
+    /** time spent downsampling the pointclouds of vertices and preparing their GICP data */
+    double downsampling_time;
+    /** time spent optimizing the covariance graph */
+    double cov_graph_time;
+    /** time spent computing marginal covariances */
+    double marginals_time;
+    /** number of computed marginal covariance blocks */
+    size_t marginal_blocks;
+    /** time spent in the g2o optimization of the graph */
+    double solver_time;
+    /** time spent updating the MLS map */
+    double mls_update_time;
+    /** number of points projected into the MLS map */
+    size_t projected_points;
+
+    InstrumentationStats() {reset();}
+    void reset();
+};
+
+/** Returns the statistics recorded by all optimizers of the process since the last reset */
+InstrumentationStats getInstrumentationStats();
+
+/** Returns the statistics recorded since the last reset and resets them,
+ * i.e. calling it once per cycle yields the statistics of each cycle. */
+InstrumentationStats takeInstrumentationStats();
+
+/** Resets all statistics to zero */
+void resetInstrumentationStats();
+
+/** Adds a duration to a timing of the statistics, it can be called concurrently */
+void addInstrumentationTime(double InstrumentationStats::* timing, double seconds);
+
+/** Adds a value to a counter of the statistics, it can be called concurrently */
+void addInstrumentationCount(size_t InstrumentationStats::* counter, size_t count);
+
+/** Adds its lifetime to a timing of the statistics */
+class ScopedInstrumentationTimer
+{
+public:
+    explicit ScopedInstrumentationTimer(double InstrumentationStats::* timing);
+    ~ScopedInstrumentationTimer();
+
+private:
+    double InstrumentationStats::* timing;
+    double start;
+};
+
+}
+
+#ifdef GRAPH_SLAM_INSTRUMENTATION
+/** Records the time until the end of the current scope, timing is a field of InstrumentationStats */
+#define GRAPH_SLAM_SCOPED_TIMER(timing) graph_slam::ScopedInstrumentationTimer graph_slam_scoped_timer_##timing(&graph_slam::InstrumentationStats::timing)
+/** Increases a counter of InstrumentationStats */
+#define GRAPH_SLAM_COUNT(counter, count) graph_slam::addInstrumentationCount(&graph_slam::InstrumentationStats::counter, count)
+#else
+#define GRAPH_SLAM_SCOPED_TIMER(timing)
+#define GRAPH_SLAM_COUNT(counter, count)
+#endif
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef GRAPH_SLAM_LINEAR_SOLVERS_HPP
+#define GRAPH_SLAM_LINEAR_SOLVERS_HPP
+
+#include <vector>
+#include <algorithm>
+#include <Eigen/Core>
+#include <Eigen/Cholesky>
+#include <g2o/core/linear_solver.h>
+#include <g2o/solvers/cholmod/linear_solver_cholmod.h>
+
+namespace graph_slam
+{
+
+/**
+ * Preconditioned conjugate gradient solver with a block Jacobi preconditioner.
+ * In contrast to g2o::LinearSolverPCG the solver can be started with the solution of
+ * the previous system. In the online optimization the increments of two consecutive
+ * solves are similar, since the new vertices are appended at the end of the system.
+ * Missing entries of the previous solution are initialized with zero.
+ */
+template <typename MatrixType>
+class LinearSolverWarmStartPCG : public g2o::LinearSolver<MatrixType>
+{
+public:
+    LinearSolverWarmStartPCG() : g2o::LinearSolver<MatrixType>(), tolerance(1e-6), absolute_tolerance(true),
+                                 max_iterations(-1), warm_start(true), last_iterations(0) {}
+    virtual ~LinearSolverWarmStartPCG() {}
+
+    /** The previous solution is kept, since init is called on every optimization */
+    virtual bool init() { return true; }
+
+    virtual bool solve(const g2o::SparseBlockMatrix<MatrixType>& A, double* x, double* b)
+    {
+        const int n = A.rows();
+        Eigen::Map<Eigen::VectorXd> xvec(x, n);
+        Eigen::Map<const Eigen::VectorXd> bvec(b, n);
+
+        // inverses of the diagonal blocks
+        std::vector<Eigen::MatrixXd> preconditioner(A.blockCols().size());
+        for(size_t i = 0; i < A.blockCols().size(); i++)
+        {
+            const MatrixType* diagonal = A.block(i, i);
+            int block_size = A.colsOfBlock(i);
+            if(diagonal)
+                preconditioner[i] = Eigen::MatrixXd(*diagonal).ldlt().solve(Eigen::MatrixXd::Identity(block_size, block_size));
+            else
+                preconditioner[i] = Eigen::MatrixXd::Identity(block_size, block_size);
+        }
+
+        // initial guess
+        xvec.setZero();
+        if(warm_start && !last_solution.empty())
+        {
+            int copy_size = std::min<int>(n, last_solution.size());
+            xvec.head(copy_size) = Eigen::Map<const Eigen::VectorXd>(&last_solution[0], copy_size);
+        }
+
+        Eigen::VectorXd r = bvec - multiply(A, xvec);
+        Eigen::VectorXd z = precondition(A, preconditioner, r);
+        Eigen::VectorXd p = z;
+        double rz = r.dot(z);
+        double threshold = absolute_tolerance ? tolerance : tolerance * bvec.squaredNorm();
+        int iterations = max_iterations < 0 ? 2 * n : max_iterations;
+
+        last_iterations = 0;
+        while(last_iterations < iterations && r.squaredNorm() > threshold)
+        {
+            Eigen::VectorXd q = multiply(A, p);
+            double pq = p.dot(q);
+            if(pq <= 0.0)
+                break;
+            double alpha = rz / pq;
+            xvec += alpha * p;
+            r -= alpha * q;
+            z = precondition(A, preconditioner, r);
+            double rz_new = r.dot(z);
+            p = z + (rz_new / rz) * p;
+            rz = rz_new;
+            last_iterations++;
+        }
+
+        last_solution.assign(x, x + n);
+        return true;
+    }
+
+    /** Tolerance of the squared norm of the residual */
+    void setTolerance(double tolerance) {this->tolerance = tolerance;}
+    /** If false the tolerance is relative to the squared norm of the right hand side */
+    void setAbsoluteTolerance(bool absolute_tolerance) {this->absolute_tolerance = absolute_tolerance;}
+    /** A negative value allows twice the dimension of the system */
+    void setMaxIterations(int max_iterations) {this->max_iterations = max_iterations;}
+    void setWarmStart(bool warm_start) {this->warm_start = warm_start;}
+    /** Returns the number of iterations of the last solve */
+    int getLastIterations() const {return last_iterations;}
+
+protected:
+    /** A is the upper triangular part of a symmetric matrix */
+    static Eigen::VectorXd multiply(const g2o::SparseBlockMatrix<MatrixType>& A, const Eigen::VectorXd& src)
+    {
+        Eigen::VectorXd dest = Eigen::VectorXd::Zero(src.size());
+        double* dest_ptr = dest.data();
+        A.multiplySymmetricUpperTriangle(dest_ptr, src.data());
+        return dest;
+    }
+
+    static Eigen::VectorXd precondition(const g2o::SparseBlockMatrix<MatrixType>& A, const std::vector<Eigen::MatrixXd>& preconditioner, const Eigen::VectorXd& r)
+    {
+        Eigen::VectorXd z(r.size());
+        for(unsigned i = 0; i < preconditioner.size(); i++)
+        {
+            int base = A.colBaseOfBlock(i);
+            int size = A.colsOfBlock(i);
+            z.segment(base, size) = preconditioner[i] * r.segment(base, size);
+        }
+        return z;
+    }
+
+    double tolerance;
+    bool absolute_tolerance;
+    int max_iterations;
+    bool warm_start;
+    int last_iterations;
+    std::vector<double> last_solution;
+};
+
+/**
+ * Cholmod solver which always uses a supernodal factorization.
+ * The supernodes are dense blocks of the factor, which are factorized by BLAS and LAPACK.
+ */
+template <typename MatrixType>
+class LinearSolverCholmodSupernodal : public g2o::LinearSolverCholmod<MatrixType>
+{
+public:
+    LinearSolverCholmodSupernodal() : g2o::LinearSolverCholmod<MatrixType>()
+    {
+        this->_cholmodCommon.supernodal = CHOLMOD_SUPERNODAL;
+    }
+};
+
+}
+
+#endif
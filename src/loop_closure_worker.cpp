@@ -0,0 +1,209 @@
+#include "loop_closure_worker.hpp"
+#include <algorithm>
+#include <cmath>
+#include <boost/bind.hpp>
+#include <graph_slam/edge_se3_gicp.hpp>
+#include <graph_slam/spatial_hash_grid.hpp>
+
+namespace graph_slam
+{
+
+LoopClosureWorker::LoopClosureWorker() : busy(false), shutdown(false)
+{
+    worker = boost::thread(boost::bind(&LoopClosureWorker::run, this));
+}
+
+LoopClosureWorker::~LoopClosureWorker()
+{
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        shutdown = true;
+    }
+    snapshot_available.notify_all();
+    worker.join();
+}
+
+bool LoopClosureWorker::isBusy()
+{
+    boost::mutex::scoped_lock lock(mutex);
+    return busy;
+}
+
+bool LoopClosureWorker::process(Snapshot& snapshot)
+{
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        if(busy)
+            return false;
+        current_snapshot.vertices.swap(snapshot.vertices);
+        current_snapshot.retries.swap(snapshot.retries);
+        current_snapshot.gicp_config = snapshot.gicp_config;
+        current_snapshot.max_alignments = snapshot.max_alignments;
+        busy = true;
+    }
+    snapshot_available.notify_one();
+    return true;
+}
+
+bool LoopClosureWorker::takeLoopClosures(LoopClosures& loop_closures)
+{
+    loop_closures.clear();
+    boost::mutex::scoped_lock lock(mutex);
+    loop_closures.swap(this->loop_closures);
+    return !loop_closures.empty();
+}
+
+void LoopClosureWorker::clear()
+{
+    boost::mutex::scoped_lock lock(mutex);
+    while(busy)
+        snapshot_done.wait(lock);
+    loop_closures.clear();
+    candidates.clear();
+    tested_pairs.clear();
+    current_snapshot = Snapshot();
+}
+
+void LoopClosureWorker::run()
+{
+    while(true)
+    {
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            while(!busy && !shutdown)
+                snapshot_available.wait(lock);
+            if(shutdown)
+                return;
+        }
+
+        // the snapshot is not modified by the main thread while busy is set
+        findCandidates(current_snapshot);
+        validateCandidates(current_snapshot);
+
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            current_snapshot.vertices.clear();
+            current_snapshot.retries.clear();
+            busy = false;
+        }
+        snapshot_done.notify_all();
+    }
+}
+
+void LoopClosureWorker::findCandidates(const Snapshot& snapshot)
+{
+    // the retried pairs become candidates again
+    for(Retries::const_iterator it = snapshot.retries.begin(); it != snapshot.retries.end(); it++)
+    {
+        VertexPair pair = it->source_id < it->target_id ? std::make_pair(it->source_id, it->target_id) : std::make_pair(it->target_id, it->source_id);
+        tested_pairs.erase(pair);
+        Candidate& candidate = candidates[pair];
+        candidate.error = 1.0 / (it->mahalanobis_distance + 1.0);
+        candidate.mahalanobis_distance = it->mahalanobis_distance;
+    }
+
+    // build a spatial index over the snapshot
+    SpatialHashGrid vertex_index(snapshot.gicp_config.max_sensor_distance > 0.0 ? snapshot.gicp_config.max_sensor_distance : 1.0);
+    std::map<int, const VertexSnapshot*> vertex_map;
+    double max_target_variance = 0.0;
+    for(VertexSnapshots::const_iterator it = snapshot.vertices.begin(); it != snapshot.vertices.end(); it++)
+    {
+        vertex_index.insert(it->id, it->pose.translation());
+        vertex_map[it->id] = &(*it);
+        max_target_variance = std::max(max_target_variance, it->position_covariance.trace());
+    }
+
+    std::vector<int> target_ids;
+    for(VertexSnapshots::const_iterator source = snapshot.vertices.begin(); source != snapshot.vertices.end(); source++)
+    {
+        if(!source->search_pending)
+            continue;
+
+        // only the vertices in range are tested instead of all pairs. The radius covers the
+        // mahalanobis gate below, since the trace bounds the largest eigenvalue of the covariance.
+        double max_variance = source->position_covariance.trace() + max_target_variance;
+        double search_radius = snapshot.gicp_config.max_sensor_distance * std::sqrt(std::max(1.0, max_variance));
+        vertex_index.query(source->pose.translation(), search_radius, target_ids);
+
+        for(std::vector<int>::const_iterator target_id = target_ids.begin(); target_id != target_ids.end(); target_id++)
+        {
+            const VertexSnapshot* target = vertex_map[*target_id];
+            if(!(source->id < target->id-1 || source->id > target->id+1))
+                continue;
+
+            // check if vertices have already an edge
+            if(source->connected_vertices.count(target->id) || target->connected_vertices.count(source->id))
+                continue;
+
+            VertexPair pair = source->id < target->id ? std::make_pair(source->id, target->id) : std::make_pair(target->id, source->id);
+            if(tested_pairs.count(pair))
+                continue;
+
+            Eigen::Matrix3d position_covariance = source->position_covariance + target->position_covariance;
+            double mahalanobis_distance = computeMahalanobisDistance<double, 3>(source->pose.translation(), position_covariance, target->pose.translation());
+            double euclidean_distance = (target->pose.translation() - source->pose.translation()).norm();
+            double distance = mahalanobis_distance > euclidean_distance ? euclidean_distance : mahalanobis_distance;
+
+            if(distance <= snapshot.gicp_config.max_sensor_distance)
+            {
+                Candidate& candidate = candidates[pair];
+                candidate.error += 1.0 / (distance + 1.0);
+                candidate.mahalanobis_distance = distance;
+            }
+        }
+    }
+}
+
+void LoopClosureWorker::validateCandidates(const Snapshot& snapshot)
+{
+    if(candidates.empty())
+        return;
+
+    std::map<int, const VertexSnapshot*> vertex_map;
+    for(VertexSnapshots::const_iterator it = snapshot.vertices.begin(); it != snapshot.vertices.end(); it++)
+        vertex_map[it->id] = &(*it);
+
+    // sort candidates by error, drop the ones without vertex in the snapshot
+    std::vector< std::pair<double, VertexPair> > sorted_candidates;
+    for(std::map<VertexPair, Candidate>::iterator it = candidates.begin(); it != candidates.end();)
+    {
+        if(!vertex_map.count(it->first.first) || !vertex_map.count(it->first.second))
+        {
+            candidates.erase(it++);
+            continue;
+        }
+        sorted_candidates.push_back(std::make_pair(-it->second.error, it->first));
+        it++;
+    }
+    std::sort(sorted_candidates.begin(), sorted_candidates.end());
+
+    LoopClosures new_loop_closures;
+    for(unsigned i = 0; i < sorted_candidates.size() && i < snapshot.max_alignments; i++)
+    {
+        const VertexPair& pair = sorted_candidates[i].second;
+        const VertexSnapshot* source = vertex_map[pair.first];
+        const VertexSnapshot* target = vertex_map[pair.second];
+
+        LoopClosure loop_closure;
+        loop_closure.source_id = source->id;
+        loop_closure.target_id = target->id;
+        loop_closure.mahalanobis_distance = candidates[pair].mahalanobis_distance;
+        if(source->pointcloud && target->pointcloud &&
+           EdgeSE3_GICP::computeGICPMeasurement(*source->pointcloud, *target->pointcloud, source->pose.inverse() * target->pose, snapshot.gicp_config,
+                                                loop_closure.measurement, loop_closure.information, loop_closure.fitness_score, true))
+        {
+            new_loop_closures.push_back(loop_closure);
+        }
+
+        candidates.erase(pair);
+        tested_pairs.insert(pair);
+    }
+
+    if(!new_loop_closures.empty())
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        loop_closures.insert(loop_closures.end(), new_loop_closures.begin(), new_loop_closures.end());
+    }
+}
+
+}
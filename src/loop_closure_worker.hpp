@@ -0,0 +1,130 @@
+#ifndef GRAPH_SLAM_LOOP_CLOSURE_WORKER_HPP
+#define GRAPH_SLAM_LOOP_CLOSURE_WORKER_HPP
+
+#include <map>
+#include <set>
+#include <vector>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <Eigen/StdVector>
+#include <graph_slam/vertex_se3_gicp.hpp>
+#include <graph_slam/matrix_helper.hpp>
+#include <graph_slam/graph_slam_config.hpp>
+
+namespace graph_slam
+{
+
+/**
+ * Runs the search for loop closure candidates and their GICP validation
+ * in a background thread. The worker operates on snapshots of the graph,
+ * so the graph can be modified while a snapshot is processed.
+ */
+class LoopClosureWorker
+{
+public:
+    /** Snapshot of a single vertex */
+    struct VertexSnapshot
+    {
+        int id;
+        Eigen::Isometry3d pose;
+        Eigen::Matrix3d position_covariance;
+        /** true if the candidate search hasn't been done for this vertex */
+        bool search_pending;
+        /** ids of all vertices this vertex has already an edge to */
+        std::set<int> connected_vertices;
+        VertexSE3_GICP::GICPPointCloudConstPtr pointcloud;
+        VertexSnapshot() : id(-1), search_pending(false) {};
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+    typedef std::vector<VertexSnapshot, Eigen::aligned_allocator<VertexSnapshot> > VertexSnapshots;
+
+    /** A vertex pair which is tested again, although it has been tested before */
+    struct Retry
+    {
+        int source_id;
+        int target_id;
+        double mahalanobis_distance;
+        Retry() : source_id(-1), target_id(-1), mahalanobis_distance(0.0) {};
+    };
+    typedef std::vector<Retry> Retries;
+
+    /** Snapshot of the graph */
+    struct Snapshot
+    {
+        VertexSnapshots vertices;
+        /** pairs which have been rejected by the graph and are tested again */
+        Retries retries;
+        GICPConfiguration gicp_config;
+        /** maximum amount of GICP alignments per snapshot */
+        unsigned max_alignments;
+        Snapshot() : max_alignments(1) {};
+    };
+
+    /** A validated loop closure */
+    struct LoopClosure
+    {
+        int source_id;
+        int target_id;
+        Eigen::Isometry3d measurement;
+        Matrix6d information;
+        double fitness_score;
+        double mahalanobis_distance;
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+    typedef std::vector<LoopClosure, Eigen::aligned_allocator<LoopClosure> > LoopClosures;
+
+    LoopClosureWorker();
+    ~LoopClosureWorker();
+
+    /** Returns true if a snapshot is currently processed. */
+    bool isBusy();
+
+    /** Hands over a snapshot to the worker thread. This doesn't block.
+     *
+     * @param snapshot graph snapshot, the content is swapped into the worker
+     * @return false if the worker is still busy with the last snapshot
+     */
+    bool process(Snapshot& snapshot);
+
+    /** Moves all validated loop closures found so far to the given vector.
+     * This doesn't block.
+     *
+     * @return true if there have been new loop closures
+     */
+    bool takeLoopClosures(LoopClosures& loop_closures);
+
+    /** Waits for the current snapshot and resets the state of the worker. */
+    void clear();
+
+protected:
+    struct Candidate
+    {
+        double error;
+        double mahalanobis_distance;
+        Candidate() : error(0.0), mahalanobis_distance(0.0) {};
+    };
+    typedef std::pair<int, int> VertexPair;
+
+    void run();
+    void findCandidates(const Snapshot& snapshot);
+    void validateCandidates(const Snapshot& snapshot);
+
+    boost::thread worker;
+    boost::mutex mutex;
+    boost::condition_variable snapshot_available;
+    boost::condition_variable snapshot_done;
+    bool busy;
+    bool shutdown;
+    Snapshot current_snapshot;
+    LoopClosures loop_closures;
+
+    /** candidates which haven't been validated yet, only accessed by the worker thread */
+    std::map<VertexPair, Candidate> candidates;
+    /** vertex pairs which have already been validated, only accessed by the worker thread */
+    std::set<VertexPair> tested_pairs;
+};
+
+}
+
+#endif
@@ -0,0 +1,186 @@
+#include "marginal_covariances.hpp"
+#include <graph_slam/instrumentation.hpp>
+#include <algorithm>
+
+namespace graph_slam
+{
+
+MarginalCovariances::MarginalCovariances(g2o::SparseOptimizer& graph) : graph(graph), computed_blocks(0), next_revision(1)
+{
+}
+
+void MarginalCovariances::invalidateAll()
+{
+    covariances.clear();
+}
+
+void MarginalCovariances::invalidate(int vertex_id)
+{
+    covariances.erase(vertex_id);
+}
+
+bool MarginalCovariances::getCachedCovariance(Matrix6d& covariance, int vertex_id) const
+{
+    CovarianceMap::const_iterator it = covariances.find(vertex_id);
+    if(it == covariances.end())
+        return false;
+    covariance = it->second.covariance;
+    return true;
+}
+
+size_t MarginalCovariances::getRevision(int vertex_id) const
+{
+    CovarianceMap::const_iterator it = covariances.find(vertex_id);
+    return it == covariances.end() ? 0 : it->second.revision;
+}
+
+void MarginalCovariances::setBlock(int vertex_id, const Matrix6d& covariance)
+{
+    CachedBlock& block = covariances[vertex_id];
+    block.covariance = covariance;
+    block.revision = next_revision++;
+}
+
+/** Returns the representative of a set in a union-find structure */
+static int findSet(std::map<int, int>& parents, int id)
+{
+    std::map<int, int>::iterator it = parents.find(id);
+    if(it == parents.end())
+    {
+        parents[id] = id;
+        return id;
+    }
+    if(it->second == id)
+        return id;
+    int root = findSet(parents, it->second);
+    parents[id] = root;
+    return root;
+}
+
+void MarginalCovariances::handleNewElements(const std::set<int>& new_vertices, const std::vector< std::pair<int, int> >& new_edges)
+{
+    if(covariances.empty())
+        return;
+
+    // a new fixed vertex changes all marginals
+    for(std::set<int>::const_iterator it = new_vertices.begin(); it != new_vertices.end(); it++)
+    {
+        g2o::OptimizableGraph::Vertex* vertex = graph.vertex(*it);
+        if(vertex && vertex->fixed())
+        {
+            invalidateAll();
+            return;
+        }
+    }
+
+    // All existing vertices are represented by one set. As long as the new edges don't create
+    // a cycle, they only attach new vertices as trees and don't change the existing marginals.
+    const int existing_set = -1;
+    std::map<int, int> parents;
+    for(std::vector< std::pair<int, int> >::const_iterator it = new_edges.begin(); it != new_edges.end(); it++)
+    {
+        int a = new_vertices.count(it->first) ? findSet(parents, it->first) : findSet(parents, existing_set);
+        int b = new_vertices.count(it->second) ? findSet(parents, it->second) : findSet(parents, existing_set);
+        if(a == b)
+        {
+            invalidateAll();
+            return;
+        }
+        // keep the existing set as representative
+        if(a == existing_set)
+            parents[b] = a;
+        else
+            parents[a] = b;
+    }
+}
+
+bool MarginalCovariances::prepare(const std::vector<int>& vertex_ids)
+{
+    g2o::OptimizableGraph::VertexContainer vc;
+    for(std::vector<int>::const_iterator it = vertex_ids.begin(); it != vertex_ids.end(); it++)
+    {
+        if(covariances.count(*it))
+            continue;
+        g2o::OptimizableGraph::Vertex* vertex = graph.vertex(*it);
+        if(!vertex)
+            continue;
+        if(vertex->hessianIndex() >= 0)
+            vc.push_back(vertex);
+        else if(vertex->fixed())
+            setBlock(*it, Matrix6d::Zero());
+    }
+
+    if(vc.empty())
+        return true;
+
+    GRAPH_SLAM_SCOPED_TIMER(marginals_time);
+    g2o::SparseBlockMatrix<Eigen::MatrixXd> spinv;
+    if(!graph.computeMarginals(spinv, vc))
+        return false;
+
+    for(g2o::OptimizableGraph::VertexContainer::const_iterator it = vc.begin(); it != vc.end(); it++)
+    {
+        int index = (*it)->hessianIndex();
+        if(index >= (int)spinv.blockCols().size())
+            continue;
+        const Eigen::MatrixXd* block = spinv.block(index, index);
+        if(!block)
+            continue;
+        setBlock((*it)->id(), Matrix6d(*block));
+        computed_blocks++;
+        GRAPH_SLAM_COUNT(marginal_blocks, 1);
+    }
+    return true;
+}
+
+bool MarginalCovariances::getCrossCovariance(Matrix6d& cross_covariance, int source_id, int target_id)
+{
+    g2o::OptimizableGraph::Vertex* source = graph.vertex(source_id);
+    g2o::OptimizableGraph::Vertex* target = graph.vertex(target_id);
+    if(!source || !target)
+        return false;
+
+    // a fixed vertex isn't correlated with any other vertex
+    if(source->fixed() || target->fixed())
+    {
+        cross_covariance.setZero();
+        return true;
+    }
+    if(source->hessianIndex() < 0 || target->hessianIndex() < 0)
+        return false;
+
+    // only the upper triangular blocks are computed
+    int row = std::min(source->hessianIndex(), target->hessianIndex());
+    int col = std::max(source->hessianIndex(), target->hessianIndex());
+    GRAPH_SLAM_SCOPED_TIMER(marginals_time);
+    g2o::SparseBlockMatrix<Eigen::MatrixXd> spinv;
+    if(!graph.computeMarginals(spinv, std::vector< std::pair<int, int> >(1, std::make_pair(row, col))))
+        return false;
+    if(col >= (int)spinv.blockCols().size())
+        return false;
+    const Eigen::MatrixXd* block = spinv.block(row, col);
+    if(!block)
+        return false;
+    if(source->hessianIndex() == row)
+        cross_covariance = *block;
+    else
+        cross_covariance = block->transpose();
+    return true;
+}
+
+bool MarginalCovariances::getCovariance(Matrix6d& covariance, int vertex_id)
+{
+    CovarianceMap::const_iterator it = covariances.find(vertex_id);
+    if(it == covariances.end())
+    {
+        if(!prepare(std::vector<int>(1, vertex_id)))
+            return false;
+        it = covariances.find(vertex_id);
+        if(it == covariances.end())
+            return false;
+    }
+    covariance = it->second.covariance;
+    return true;
+}
+
+}
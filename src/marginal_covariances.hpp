@@ -0,0 +1,96 @@
+#ifndef GRAPH_SLAM_MARGINAL_COVARIANCES_HPP
+#define GRAPH_SLAM_MARGINAL_COVARIANCES_HPP
+
+#include <map>
+#include <set>
+#include <vector>
+#include <Eigen/StdVector>
+#include <g2o/core/sparse_optimizer.h>
+#include <graph_slam/matrix_helper.hpp>
+
+namespace graph_slam
+{
+
+/**
+ * Provides the block diagonal marginal covariances of a graph and caches them.
+ * The blocks are only computed on request, and only recomputed if a change
+ * of the graph could have affected them.
+ */
+class MarginalCovariances
+{
+public:
+    /** @param graph the graph the marginals are computed from */
+    explicit MarginalCovariances(g2o::SparseOptimizer& graph);
+
+    /** Marks all cached blocks as outdated */
+    void invalidateAll();
+
+    /** Removes the cached block of a vertex */
+    void invalidate(int vertex_id);
+
+    /** Has to be called whenever new vertices and edges have been added to the graph.
+     * If the new edges don't add any new information about the existing vertices,
+     * i.e. the new vertices are only attached as a tree to the graph, the cached
+     * blocks stay valid. Otherwise all blocks are outdated.
+     *
+     * @param new_vertices ids of the new vertices
+     * @param new_edges pairs of vertex ids of the new edges
+     */
+    void handleNewElements(const std::set<int>& new_vertices, const std::vector< std::pair<int, int> >& new_edges);
+
+    /** Computes all outdated blocks of the given vertices in one step.
+     *
+     * @param vertex_ids ids of the vertices
+     * @return false if the computation of the marginals failed
+     */
+    bool prepare(const std::vector<int>& vertex_ids);
+
+    /** Returns the covariance of a vertex. It is computed, if it is not available.
+     *
+     * @param covariance 6x6 covariance matrix
+     * @param vertex_id id of the vertex
+     * @return false if the vertex is not handled by the graph optimization
+     */
+    bool getCovariance(Matrix6d& covariance, int vertex_id);
+
+    /** Computes the cross-covariance of two vertices, i.e. the off-diagonal block of their joint marginal.
+     * It isn't cached, since it is only valid for this pair of vertices.
+     *
+     * @param cross_covariance 6x6 covariance between the source and the target pose
+     * @return false if one of the vertices is not handled by the graph optimization
+     */
+    bool getCrossCovariance(Matrix6d& cross_covariance, int source_id, int target_id);
+
+    /** Returns the cached covariance of a vertex without computing it.
+     * Since the cache isn't modified, it can be called concurrently.
+     *
+     * @return false if no block is cached for the vertex
+     */
+    bool getCachedCovariance(Matrix6d& covariance, int vertex_id) const;
+
+    /** Returns a number identifying the cached block of a vertex, which changes
+     * whenever the block is recomputed. Returns zero if no block is cached. */
+    size_t getRevision(int vertex_id) const;
+
+    /** Returns the amount of blocks computed since the construction */
+    size_t getComputedBlockCount() const {return computed_blocks;}
+
+protected:
+    struct CachedBlock
+    {
+        Matrix6d covariance;
+        size_t revision;
+    };
+    typedef std::map<int, CachedBlock, std::less<int>, Eigen::aligned_allocator< std::pair<const int, CachedBlock> > > CovarianceMap;
+
+    void setBlock(int vertex_id, const Matrix6d& covariance);
+
+    g2o::SparseOptimizer& graph;
+    CovarianceMap covariances;
+    size_t computed_blocks;
+    size_t next_revision;
+};
+
+}
+
+#endif
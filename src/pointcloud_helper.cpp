@@ -1,12 +1,34 @@
 #include "pointcloud_helper.hpp"
+#include <Eigen/SVD>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include <boost/unordered_map.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/random/mersenne_twister.hpp>
 
 namespace graph_slam
 {
     
-void vectorToPCLPointCloud(const std::vector< Eigen::Vector3d >& pc, pcl::PointCloud< pcl::PointXYZ >& pcl_pc, double density)
+void selectRandomSubset(size_t count, size_t sample_count, std::vector<size_t>& indices, unsigned seed)
+{
+    // selection sampling, each index is selected with the probability of 
+    // the remaining samples divided by the remaining indices
+    indices.clear();
+    sample_count = std::min(sample_count, count);
+    indices.reserve(sample_count);
+    boost::mt19937 rng(seed);
+    for(size_t i = 0; i < count && indices.size() < sample_count; i++)
+    {
+        double u = (double)rng() / 4294967296.0;
+        if(u * (double)(count - i) < (double)(sample_count - indices.size()))
+            indices.push_back(i);
+    }
+}
+
+void vectorToPCLPointCloud(const std::vector< Eigen::Vector3d >& pc, pcl::PointCloud< pcl::PointXYZ >& pcl_pc, double density, unsigned seed)
 {    
     pcl_pc.clear();
-    std::vector<bool> mask;
     unsigned sample_count = (unsigned)(density * pc.size());
     
     if(density <= 0.0 || pc.size() == 0)
@@ -15,46 +37,145 @@ void vectorToPCLPointCloud(const std::vector< Eigen::Vector3d >& pc, pcl::PointC
     }
     else if(sample_count >= pc.size())
     {
-        mask.resize(pc.size(), true);
+        // copy all points at once, the capacity of pcl_pc is reused
+        pcl_pc.resize(pc.size());
+        pcl_pc.getMatrixXfMap(3, 4, 0) = mapPoints(pc).cast<float>();
+        return;
     }
-    else
+    
+    std::vector<size_t> indices;
+    selectRandomSubset(pc.size(), sample_count, indices, seed);
+    pcl_pc.resize(indices.size());
+    for(size_t i = 0; i < indices.size(); i++)
+        pcl_pc.points[i].getVector3fMap() = pc[indices[i]].cast<float>();
+}
+
+/** Floor of a coefficient, it is inlined into the Eigen expression */
+struct FloorOp
+{
+    double operator()(double value) const {return std::floor(value);}
+};
+
+/** Hashed voxel filter on a 3xN matrix of points */
+template<typename Derived>
+static void voxelFilterPoints(const Eigen::MatrixBase<Derived>& points, pcl::PointCloud< pcl::PointXYZ >& pcl_pc, const Eigen::Vector3d& leaf_size)
+{
+    if(!(leaf_size.minCoeff() > 0.0))
+        throw std::runtime_error("leaf sizes of the voxel filter have to be positive");
+    
+    pcl_pc.clear();
+    const size_t point_count = points.cols();
+    if(point_count == 0)
+        return;
+    
+    // the points are binned in blocks, so Eigen vectorizes the scaling, the floor is taken per coefficient
+    const size_t block_size = 1024;
+    const Eigen::Array3d inv_leaf_size = leaf_size.cwiseInverse().array();
+    const boost::int64_t mask = (1 << 21) - 1;
+    Eigen::Array3Xd block_indices(3, block_size);
+    
+    // sum and count of the points of each voxel
+    typedef boost::unordered_map<boost::uint64_t, unsigned> VoxelMap;
+    VoxelMap voxel_map;
+    std::vector<Eigen::Vector3d> sums;
+    std::vector<unsigned> counts;
+    
+    for(size_t start = 0; start < point_count; start += block_size)
     {
-        mask.resize(pc.size(), false);
-        unsigned samples_drawn = 0;
+        size_t count = std::min(block_size, point_count - start);
+        block_indices.leftCols(count) = (points.middleCols(start, count).template cast<double>().array().colwise() * inv_leaf_size).unaryExpr(FloorOp());
         
-        while(samples_drawn < sample_count)
+        for(size_t i = 0; i < count; i++)
         {
-            unsigned index = rand() % pc.size();
-            if(mask[index] == false)
+            // pack the voxel index into 21 bits per axis
+            boost::uint64_t key = ((boost::uint64_t)((boost::int64_t)block_indices(0,i) & mask) << 42) |
+                                  ((boost::uint64_t)((boost::int64_t)block_indices(1,i) & mask) << 21) |
+                                   (boost::uint64_t)((boost::int64_t)block_indices(2,i) & mask);
+            std::pair<VoxelMap::iterator, bool> entry = voxel_map.insert(std::make_pair(key, (unsigned)sums.size()));
+            if(entry.second)
+            {
+                sums.push_back(points.col(start + i).template cast<double>());
+                counts.push_back(1);
+            }
+            else
             {
-                mask[index] = true;
-                samples_drawn++;
+                sums[entry.first->second] += points.col(start + i).template cast<double>();
+                counts[entry.first->second]++;
             }
         }
     }
     
-    for(unsigned i = 0; i < pc.size(); i++)
+    pcl_pc.reserve(sums.size());
+    for(unsigned i = 0; i < sums.size(); i++)
     {
-        if(mask[i])
-            pcl_pc.push_back(pcl::PointXYZ(pc[i].x(), pc[i].y(), pc[i].z()));
+        Eigen::Vector3d centroid = sums[i] / (double)counts[i];
+        pcl_pc.push_back(pcl::PointXYZ(centroid.x(), centroid.y(), centroid.z()));
     }
 }
 
-void transformPointCloud(const std::vector< Eigen::Vector3d >& pc, std::vector< Eigen::Vector3d >& transformed_pc, const Eigen::Affine3d& transformation)
+void voxelFilterPointCloud(const std::vector< Eigen::Vector3d >& pc, pcl::PointCloud< pcl::PointXYZ >& pcl_pc, const Eigen::Vector3d& leaf_size)
+{
+    voxelFilterPoints(mapPoints(pc), pcl_pc, leaf_size);
+}
+
+void voxelFilterPointCloud(const pcl::PointCloud< pcl::PointXYZ >& pc, pcl::PointCloud< pcl::PointXYZ >& pcl_pc, const Eigen::Vector3d& leaf_size)
 {
-    transformed_pc.clear();
-    for(std::vector< Eigen::Vector3d >::const_iterator it = pc.begin(); it != pc.end(); it++)
+    // the points are used in place, pcl pads each point to four floats
+    if(pc.empty())
     {
-        transformed_pc.push_back(transformation * (*it));
+        pcl_pc.clear();
+        return;
     }
+    voxelFilterPoints(pc.getMatrixXfMap(3, 4, 0), pcl_pc, leaf_size);
+}
+
+void transformPointCloud(const std::vector< Eigen::Vector3d >& pc, std::vector< Eigen::Vector3d >& transformed_pc, const Eigen::Affine3d& transformation)
+{
+    transformed_pc.resize(pc.size());
+    Eigen::Map<Eigen::Matrix3Xd> transformed = mapPoints(transformed_pc);
+    transformed.noalias() = transformation.linear() * mapPoints(pc);
+    transformed.colwise() += transformation.translation();
 }
 
 void transformPointCloud(std::vector< Eigen::Vector3d >& pc, const Eigen::Affine3d& transformation)
 {
-    for(std::vector< Eigen::Vector3d >::iterator it = pc.begin(); it != pc.end(); it++)
+    Eigen::Map<Eigen::Matrix3Xd> points = mapPoints(pc);
+    points = transformation.linear() * points;
+    points.colwise() += transformation.translation();
+}
+
+bool computeGICPPointCovariances(const pcl::PointCloud<pcl::PointXYZ>& pc, const pcl::search::KdTree<pcl::PointXYZ>& search_tree, 
+                                 unsigned k, PointCovariances& covariances, double epsilon)
+{
+    covariances.clear();
+    if(k == 0 || k > pc.size())
+        return false;
+    
+    covariances.resize(pc.size());
+    std::vector<int> indices(k);
+    std::vector<float> squared_distances(k);
+    for(unsigned i = 0; i < pc.size(); i++)
     {
-        *it = (transformation * (*it));
+        search_tree.nearestKSearch(pc.points[i], k, indices, squared_distances);
+        
+        Eigen::Vector3d mean = Eigen::Vector3d::Zero();
+        Eigen::Matrix3d cov = Eigen::Matrix3d::Zero();
+        for(unsigned j = 0; j < indices.size(); j++)
+        {
+            Eigen::Vector3d point = pc.points[indices[j]].getVector3fMap().cast<double>();
+            mean += point;
+            cov += point * point.transpose();
+        }
+        mean /= (double)indices.size();
+        cov /= (double)indices.size();
+        cov -= mean * mean.transpose();
+        
+        // replace the singular values, the covariance is symmetric so U = V
+        Eigen::JacobiSVD<Eigen::Matrix3d> svd(cov, Eigen::ComputeFullU);
+        const Eigen::Matrix3d& U = svd.matrixU();
+        covariances[i] = U * Eigen::Vector3d(1.0, 1.0, epsilon).asDiagonal() * U.transpose();
     }
+    return true;
 }
 
-}
\ No newline at end of file
+}
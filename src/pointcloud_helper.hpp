@@ -3,15 +3,88 @@
 
 #include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
+#include <pcl/search/kdtree.h>
+#include <Eigen/StdVector>
+#include <Eigen/Geometry>
 
 namespace graph_slam 
 {
 
-    void vectorToPCLPointCloud(const std::vector<Eigen::Vector3d>& pc, pcl::PointCloud<pcl::PointXYZ> &pcl_pc, double density = 1.0);
+    /** Aligned buffer of points, one point per column */
+    typedef Eigen::Matrix3Xd PointBuffer;
+    
+    /** Maps the points of a pointcloud as the columns of a 3xN matrix, without copying them.
+     * Batch operations on the map are vectorized by Eigen. */
+    inline Eigen::Map<const Eigen::Matrix3Xd> mapPoints(const std::vector<Eigen::Vector3d>& pc)
+    {
+        return Eigen::Map<const Eigen::Matrix3Xd>(pc.empty() ? NULL : pc.front().data(), 3, pc.size());
+    }
+    inline Eigen::Map<Eigen::Matrix3Xd> mapPoints(std::vector<Eigen::Vector3d>& pc)
+    {
+        return Eigen::Map<Eigen::Matrix3Xd>(pc.empty() ? NULL : pc.front().data(), 3, pc.size());
+    }
+    
+    /** Transforms all points at once.
+     * 
+     * @param points 3xN matrix of points, e.g. the result of mapPoints() or pcl::PointCloud::getMatrixXfMap(3, 4, 0)
+     * @param transformation rigid transformation, an Eigen::Affine3d or Eigen::Isometry3d
+     * @param transformed resulting points
+     */
+    template<typename Derived, typename Transformation>
+    void transformPoints(const Eigen::MatrixBase<Derived>& points, const Transformation& transformation, PointBuffer& transformed)
+    {
+        transformed.resize(3, points.cols());
+        transformed.noalias() = transformation.linear() * points.template cast<double>();
+        transformed.colwise() += transformation.translation();
+    }
+    
+    /** Returns the axis aligned bounding box of a 3xN matrix of points */
+    template<typename Derived>
+    Eigen::AlignedBox3d computeBoundingBox(const Eigen::MatrixBase<Derived>& points)
+    {
+        if(points.cols() == 0)
+            return Eigen::AlignedBox3d();
+        return Eigen::AlignedBox3d(points.rowwise().minCoeff().template cast<double>(), points.rowwise().maxCoeff().template cast<double>());
+    }
+    
+    /** Selects sample_count of count indices uniformly at random in a single pass.
+     * The indices are in ascending order. The selection only depends on the seed,
+     * so it is reproducible and can be done concurrently.
+     */
+    void selectRandomSubset(size_t count, size_t sample_count, std::vector<size_t>& indices, unsigned seed);
+
+    void vectorToPCLPointCloud(const std::vector<Eigen::Vector3d>& pc, pcl::PointCloud<pcl::PointXYZ> &pcl_pc, double density = 1.0, unsigned seed = 0);
+    
+    /** Downsamples a pointcloud to the centroids of the occupied voxels, using a hashed voxel grid.
+     * This is equivalent to a pcl::VoxelGrid, but works directly on the given points and
+     * doesn't need to sort them. The voxels are ordered by their first point.
+     * 
+     * @param pc input pointcloud
+     * @param pcl_pc resulting downsampled pointcloud
+     * @param leaf_size size of the voxels
+     */
+    void voxelFilterPointCloud(const std::vector<Eigen::Vector3d>& pc, pcl::PointCloud<pcl::PointXYZ> &pcl_pc, const Eigen::Vector3d& leaf_size);
+    void voxelFilterPointCloud(const pcl::PointCloud<pcl::PointXYZ>& pc, pcl::PointCloud<pcl::PointXYZ> &pcl_pc, const Eigen::Vector3d& leaf_size);
     
     void transformPointCloud(const std::vector<Eigen::Vector3d>& pc, std::vector<Eigen::Vector3d>& transformed_pc, const Eigen::Affine3d &transformation);
     void transformPointCloud(std::vector<Eigen::Vector3d>& pc, const Eigen::Affine3d &transformation);
     
+    typedef std::vector<Eigen::Matrix3d, Eigen::aligned_allocator<Eigen::Matrix3d> > PointCovariances;
+    
+    /** Computes the local covariance of each point in the same way GICP does it.
+     * The covariances are derived from the k nearest neighbors of each point, and their
+     * singular values are replaced by (1, 1, epsilon), i.e. each point is modeled as a plane.
+     * 
+     * @param pc pointcloud
+     * @param search_tree search tree with pc as input cloud
+     * @param k number of nearest neighbors
+     * @param covariances resulting point covariances
+     * @param epsilon replaces the smallest singular value
+     * @return false if the pointcloud has less than k points
+     */
+    bool computeGICPPointCovariances(const pcl::PointCloud<pcl::PointXYZ>& pc, const pcl::search::KdTree<pcl::PointXYZ>& search_tree, 
+                                     unsigned k, PointCovariances& covariances, double epsilon = 0.001);
+    
 } // end namespace
 
 #endif
@@ -0,0 +1,253 @@
+#include "pointcloud_store.hpp"
+#include <cstdio>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+
+namespace graph_slam
+{
+
+PointcloudStore::PointcloudStore(const std::string& spill_file_path, size_t max_resident_bytes, double min_spill_distance) :
+                                spill_file_path(spill_file_path), spill_file_size(0), max_resident_bytes(max_resident_bytes), min_spill_distance(min_spill_distance)
+{
+    spill_file.open(spill_file_path.c_str(), std::ios::in | std::ios::out | std::ios::trunc | std::ios::binary);
+    if(!spill_file.is_open())
+        throw std::runtime_error("failed to open the pointcloud spill file " + spill_file_path);
+}
+
+PointcloudStore::~PointcloudStore()
+{
+    spill_file.close();
+    std::remove(spill_file_path.c_str());
+}
+
+void PointcloudStore::setMemoryBudget(size_t max_resident_bytes, double min_spill_distance)
+{
+    this->max_resident_bytes = max_resident_bytes;
+    this->min_spill_distance = min_spill_distance;
+}
+
+void PointcloudStore::addVertex(VertexSE3_GICP* vertex)
+{
+    envire::Pointcloud* pointcloud = dynamic_cast<envire::Pointcloud*>(vertex->getEnvirePointCloud().get());
+    if(!pointcloud || entries.count(vertex->id()))
+        return;
+    Entry& entry = entries[vertex->id()];
+    entry.vertex = vertex;
+    entry.pointcloud = pointcloud;
+    entry.point_count = pointcloud->vertices.size();
+    pointcloud_ids[pointcloud] = vertex->id();
+}
+
+void PointcloudStore::removeVertex(int vertex_id)
+{
+    Entries::iterator it = entries.find(vertex_id);
+    if(it == entries.end())
+        return;
+    if(it->second.file_offset >= 0)
+        freeRange(it->second.file_offset, it->second.point_count * sizeof(Eigen::Vector3d));
+    pointcloud_ids.erase(it->second.pointcloud);
+    entries.erase(it);
+}
+
+void PointcloudStore::clear()
+{
+    entries.clear();
+    pointcloud_ids.clear();
+    // the file can be reused from the beginning
+    spill_file.clear();
+    spill_file_size = 0;
+    free_ranges.clear();
+}
+
+std::streamoff PointcloudStore::allocateRange(std::streamoff size)
+{
+    // first fit, the remainder of the range stays free
+    for(FreeRanges::iterator it = free_ranges.begin(); it != free_ranges.end(); it++)
+    {
+        if(it->second < size)
+            continue;
+        std::streamoff offset = it->first;
+        std::streamoff remainder = it->second - size;
+        free_ranges.erase(it);
+        if(remainder > 0)
+            free_ranges[offset + size] = remainder;
+        return offset;
+    }
+    std::streamoff offset = spill_file_size;
+    spill_file_size += size;
+    return offset;
+}
+
+void PointcloudStore::freeRange(std::streamoff offset, std::streamoff size)
+{
+    if(size <= 0)
+        return;
+
+    // merge with the adjacent free ranges
+    FreeRanges::iterator next = free_ranges.lower_bound(offset);
+    if(next != free_ranges.end() && offset + size == next->first)
+    {
+        size += next->second;
+        free_ranges.erase(next++);
+    }
+    if(next != free_ranges.begin())
+    {
+        FreeRanges::iterator previous = next;
+        previous--;
+        if(previous->first + previous->second == offset)
+        {
+            offset = previous->first;
+            size += previous->second;
+            free_ranges.erase(previous);
+        }
+    }
+
+    // a free range at the end shrinks the used part of the file
+    if(offset + size == spill_file_size)
+        spill_file_size = offset;
+    else
+        free_ranges[offset] = size;
+}
+
+size_t PointcloudStore::getResidentMemory(const Entry& entry) const
+{
+    size_t usage = 0;
+    if(entry.points_resident)
+        usage += entry.point_count * sizeof(Eigen::Vector3d);
+    if(entry.gicp_resident)
+        usage += entry.vertex->getGICPPointCloudMemoryUsage();
+    return usage;
+}
+
+size_t PointcloudStore::getResidentMemory() const
+{
+    size_t usage = 0;
+    for(Entries::const_iterator it = entries.begin(); it != entries.end(); it++)
+        usage += getResidentMemory(it->second);
+    return usage;
+}
+
+unsigned PointcloudStore::enforceBudget(const Eigen::Vector3d& robot_position)
+{
+    size_t usage = 0;
+    std::vector< std::pair<double, int> > spill_candidates;
+    for(Entries::const_iterator it = entries.begin(); it != entries.end(); it++)
+    {
+        size_t entry_usage = getResidentMemory(it->second);
+        usage += entry_usage;
+        double distance = (it->second.vertex->estimate().translation() - robot_position).norm();
+        if(entry_usage > 0 && distance > min_spill_distance)
+            spill_candidates.push_back(std::make_pair(distance, it->first));
+    }
+    if(usage <= max_resident_bytes)
+        return 0;
+
+    // spill the farthest pointclouds first
+    std::sort(spill_candidates.rbegin(), spill_candidates.rend());
+    unsigned spilled = 0;
+    for(std::vector< std::pair<double, int> >::const_iterator it = spill_candidates.begin(); it != spill_candidates.end() && usage > max_resident_bytes; it++)
+    {
+        Entry& entry = entries[it->second];
+        size_t entry_usage = getResidentMemory(entry);
+        if(!spill(entry))
+            break;
+        usage -= entry_usage;
+        spilled++;
+    }
+    return spilled;
+}
+
+bool PointcloudStore::spill(Entry& entry)
+{
+    // the points only need to be written once, since envire pointclouds don't change
+    if(entry.points_resident && entry.file_offset < 0)
+    {
+        std::streamoff size = entry.point_count * sizeof(Eigen::Vector3d);
+        std::streamoff offset = allocateRange(size);
+        spill_file.clear();
+        spill_file.seekp(offset);
+        if(!entry.pointcloud->vertices.empty())
+            spill_file.write(reinterpret_cast<const char*>(&entry.pointcloud->vertices[0]), size);
+        spill_file.flush();
+        if(!spill_file.good())
+        {
+            std::cerr << "failed to write the pointcloud of vertex " << entry.vertex->id() << " to " << spill_file_path << std::endl;
+            freeRange(offset, size);
+            return false;
+        }
+        entry.file_offset = offset;
+    }
+
+    if(entry.points_resident)
+    {
+        std::vector<Eigen::Vector3d>().swap(entry.pointcloud->vertices);
+        entry.points_resident = false;
+    }
+    if(entry.gicp_resident)
+    {
+        entry.vertex->releaseGICPPointCloud();
+        entry.gicp_resident = false;
+    }
+    return true;
+}
+
+bool PointcloudStore::readPoints(Entry& entry)
+{
+    if(entry.points_resident)
+        return true;
+
+    entry.pointcloud->vertices.resize(entry.point_count);
+    spill_file.clear();
+    spill_file.seekg(entry.file_offset);
+    if(entry.point_count > 0)
+        spill_file.read(reinterpret_cast<char*>(&entry.pointcloud->vertices[0]), entry.point_count * sizeof(Eigen::Vector3d));
+    if(!spill_file.good())
+    {
+        std::cerr << "failed to read the pointcloud of vertex " << entry.vertex->id() << " from " << spill_file_path << std::endl;
+        entry.pointcloud->vertices.clear();
+        return false;
+    }
+    entry.points_resident = true;
+    return true;
+}
+
+bool PointcloudStore::load(VertexSE3_GICP* vertex, const GICPConfiguration& gicp_config)
+{
+    Entries::iterator it = entries.find(vertex->id());
+    if(it == entries.end())
+        return true;
+    Entry& entry = it->second;
+    if(entry.gicp_resident)
+        return true;
+    if(!readPoints(entry))
+        return false;
+
+    // attaching the pointcloud again recomputes the downsampled pointcloud and its GICP data
+    entry.vertex->attachPointCloud(entry.pointcloud, gicp_config, scratch_cloud);
+    entry.gicp_resident = true;
+    return true;
+}
+
+bool PointcloudStore::loadPoints(envire::Pointcloud* pointcloud)
+{
+    std::map<const envire::Pointcloud*, int>::const_iterator it = pointcloud_ids.find(pointcloud);
+    if(it == pointcloud_ids.end())
+        return true;
+    return readPoints(entries[it->second]);
+}
+
+bool PointcloudStore::isSpilled(const envire::Pointcloud* pointcloud) const
+{
+    std::map<const envire::Pointcloud*, int>::const_iterator it = pointcloud_ids.find(pointcloud);
+    return it != pointcloud_ids.end() && !entries.find(it->second)->second.points_resident;
+}
+
+bool PointcloudStore::isSpilled(int vertex_id) const
+{
+    Entries::const_iterator it = entries.find(vertex_id);
+    return it != entries.end() && !it->second.gicp_resident;
+}
+
+}
@@ -0,0 +1,107 @@
+#ifndef GRAPH_SLAM_POINTCLOUD_STORE_HPP
+#define GRAPH_SLAM_POINTCLOUD_STORE_HPP
+
+#include <map>
+#include <string>
+#include <fstream>
+#include <Eigen/Core>
+#include <envire/maps/Pointcloud.hpp>
+#include <graph_slam/vertex_se3_gicp.hpp>
+#include <graph_slam/graph_slam_config.hpp>
+
+namespace graph_slam
+{
+
+/**
+ * Keeps the memory used by the pointclouds of the vertices within a budget.
+ * If the budget is exceeded, the pointclouds of the vertices farthest away from the robot
+ * are spilled: The points of the envire pointcloud are written to a file and released
+ * together with the GICP data of the vertex. The vertex stays attached to its pointcloud,
+ * the points are loaded back lazily when they are needed for a GICP alignment or a
+ * projection into the MLS map. Since the envire pointclouds never change, the points of
+ * a pointcloud are only written once to the file. The ranges of removed vertices are reused.
+ */
+class PointcloudStore
+{
+public:
+    /**
+     * @param spill_file_path path of the file the pointclouds are spilled to, it is removed again by the destructor
+     * @param max_resident_bytes memory budget of all pointclouds in bytes
+     * @param min_spill_distance vertices within this distance to the robot are never spilled
+     */
+    PointcloudStore(const std::string& spill_file_path, size_t max_resident_bytes, double min_spill_distance);
+    ~PointcloudStore();
+
+    void setMemoryBudget(size_t max_resident_bytes, double min_spill_distance);
+
+    /** Registers a vertex with an attached pointcloud */
+    void addVertex(VertexSE3_GICP* vertex);
+
+    /** Unregisters a vertex, this has to be done before its pointcloud is detached.
+     * The spilled points of its pointcloud are not loaded back, their range in the file is freed. */
+    void removeVertex(int vertex_id);
+
+    /** Unregisters all vertices, the spilled points of their pointclouds are lost */
+    void clear();
+
+    /** Spills the pointclouds of the vertices farthest away from the robot until the memory budget is met.
+     *
+     * @param robot_position current position of the robot
+     * @return number of spilled pointclouds
+     */
+    unsigned enforceBudget(const Eigen::Vector3d& robot_position);
+
+    /** Makes sure the pointcloud and the GICP data of a vertex are in memory.
+     * Returns false if the pointcloud couldn't be loaded. */
+    bool load(VertexSE3_GICP* vertex, const GICPConfiguration& gicp_config);
+
+    /** Makes sure the points of an envire pointcloud are in memory, the GICP data isn't restored.
+     * Returns false if the pointcloud couldn't be loaded. */
+    bool loadPoints(envire::Pointcloud* pointcloud);
+
+    /** Returns true if the points of an envire pointcloud are currently not in memory */
+    bool isSpilled(const envire::Pointcloud* pointcloud) const;
+
+    /** Returns true if the GICP data of a registered vertex is currently not in memory */
+    bool isSpilled(int vertex_id) const;
+
+    /** Returns the estimated memory used by all pointclouds in memory in bytes */
+    size_t getResidentMemory() const;
+
+protected:
+    struct Entry
+    {
+        VertexSE3_GICP* vertex;
+        envire::Pointcloud* pointcloud;
+        /** position of the points in the spill file, negative if they haven't been written yet */
+        std::streamoff file_offset;
+        size_t point_count;
+        bool points_resident;
+        bool gicp_resident;
+        Entry() : vertex(NULL), pointcloud(NULL), file_offset(-1), point_count(0), points_resident(true), gicp_resident(true) {}
+    };
+    typedef std::map<int, Entry> Entries;
+
+    /** unused ranges of the spill file, maps the offset to the size in bytes */
+    typedef std::map<std::streamoff, std::streamoff> FreeRanges;
+
+    size_t getResidentMemory(const Entry& entry) const;
+    std::streamoff allocateRange(std::streamoff size);
+    void freeRange(std::streamoff offset, std::streamoff size);
+    bool readPoints(Entry& entry);
+    bool spill(Entry& entry);
+
+    std::string spill_file_path;
+    std::fstream spill_file;
+    std::streamoff spill_file_size;
+    FreeRanges free_ranges;
+    size_t max_resident_bytes;
+    double min_spill_distance;
+    Entries entries;
+    std::map<const envire::Pointcloud*, int> pointcloud_ids;
+    VertexSE3_GICP::PCLPointCloud scratch_cloud;
+};
+
+}
+
+#endif
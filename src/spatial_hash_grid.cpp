@@ -0,0 +1,143 @@
+#include "spatial_hash_grid.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <boost/functional/hash.hpp>
+
+namespace graph_slam
+{
+
+size_t SpatialHashGrid::CellIndexHash::operator()(const CellIndex& index) const
+{
+    size_t seed = 0;
+    boost::hash_combine(seed, index.x);
+    boost::hash_combine(seed, index.y);
+    boost::hash_combine(seed, index.z);
+    return seed;
+}
+
+SpatialHashGrid::SpatialHashGrid(double cell_size) : cell_size(cell_size)
+{
+    if(!(cell_size > 0.0))
+        throw std::runtime_error("cell size of the spatial hash grid has to be positive");
+}
+
+void SpatialHashGrid::setCellSize(double cell_size)
+{
+    if(!(cell_size > 0.0))
+        throw std::runtime_error("cell size of the spatial hash grid has to be positive");
+    if(cell_size == this->cell_size)
+        return;
+
+    this->cell_size = cell_size;
+    cells.clear();
+    for(Entries::iterator it = entries.begin(); it != entries.end(); it++)
+    {
+        it->second.cell = toCell(it->second.position);
+        cells[it->second.cell].push_back(it->first);
+    }
+}
+
+SpatialHashGrid::CellIndex SpatialHashGrid::toCell(const Eigen::Vector3d& position) const
+{
+    return CellIndex((int)std::floor(position.x() / cell_size),
+                     (int)std::floor(position.y() / cell_size),
+                     (int)std::floor(position.z() / cell_size));
+}
+
+void SpatialHashGrid::insert(int id, const Eigen::Vector3d& position)
+{
+    CellIndex cell = toCell(position);
+    Entries::iterator it = entries.find(id);
+    if(it != entries.end())
+    {
+        it->second.position = position;
+        if(it->second.cell == cell)
+            return;
+        removeFromCell(id, it->second.cell);
+        it->second.cell = cell;
+    }
+    else
+    {
+        Entry& entry = entries[id];
+        entry.position = position;
+        entry.cell = cell;
+    }
+    cells[cell].push_back(id);
+}
+
+bool SpatialHashGrid::remove(int id)
+{
+    Entries::iterator it = entries.find(id);
+    if(it == entries.end())
+        return false;
+    removeFromCell(id, it->second.cell);
+    entries.erase(it);
+    return true;
+}
+
+void SpatialHashGrid::removeFromCell(int id, const CellIndex& cell)
+{
+    Cells::iterator cell_it = cells.find(cell);
+    if(cell_it == cells.end())
+        return;
+    std::vector<int>& ids = cell_it->second;
+    std::vector<int>::iterator id_it = std::find(ids.begin(), ids.end(), id);
+    if(id_it != ids.end())
+    {
+        *id_it = ids.back();
+        ids.pop_back();
+    }
+    if(ids.empty())
+        cells.erase(cell_it);
+}
+
+void SpatialHashGrid::clear()
+{
+    cells.clear();
+    entries.clear();
+}
+
+void SpatialHashGrid::query(const Eigen::Vector3d& center, double radius, std::vector<int>& ids) const
+{
+    ids.clear();
+    if(radius < 0.0 || entries.empty())
+        return;
+
+    const double squared_radius = radius * radius;
+    double cells_per_axis = 2.0 * std::ceil(radius / cell_size) + 1.0;
+    double cell_count = cells_per_axis * cells_per_axis * cells_per_axis;
+
+    if(cell_count >= (double)cells.size())
+    {
+        // checking all entries is cheaper than visiting each cell
+        for(Entries::const_iterator it = entries.begin(); it != entries.end(); it++)
+        {
+            if((it->second.position - center).squaredNorm() <= squared_radius)
+                ids.push_back(it->first);
+        }
+    }
+    else
+    {
+        CellIndex min_cell = toCell(center - Eigen::Vector3d::Constant(radius));
+        CellIndex max_cell = toCell(center + Eigen::Vector3d::Constant(radius));
+        for(int x = min_cell.x; x <= max_cell.x; x++)
+            for(int y = min_cell.y; y <= max_cell.y; y++)
+                for(int z = min_cell.z; z <= max_cell.z; z++)
+                {
+                    Cells::const_iterator cell_it = cells.find(CellIndex(x, y, z));
+                    if(cell_it == cells.end())
+                        continue;
+                    for(std::vector<int>::const_iterator id = cell_it->second.begin(); id != cell_it->second.end(); id++)
+                    {
+                        if((entries.find(*id)->second.position - center).squaredNorm() <= squared_radius)
+                            ids.push_back(*id);
+                    }
+                }
+    }
+
+    std::sort(ids.begin(), ids.end());
+}
+
+}
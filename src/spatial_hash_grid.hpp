@@ -0,0 +1,81 @@
+#ifndef GRAPH_SLAM_SPATIAL_HASH_GRID_HPP
+#define GRAPH_SLAM_SPATIAL_HASH_GRID_HPP
+
+#include <vector>
+#include <boost/unordered_map.hpp>
+#include <Eigen/Core>
+
+namespace graph_slam
+{
+
+/**
+ * Unbounded hashed voxel grid over 3D positions.
+ * In contrast to the VertexGrid it is not limited to a fixed area, and it is
+ * meant for radius queries, e.g. to find vertices near a given position.
+ */
+class SpatialHashGrid
+{
+public:
+    /** @param cell_size edge length of each cubic cell in meters */
+    explicit SpatialHashGrid(double cell_size = 2.0);
+
+    /** Changes the cell size. All entries are reinserted. */
+    void setCellSize(double cell_size);
+    double getCellSize() const {return cell_size;}
+
+    /** Inserts an entry or moves it if the id is already known. */
+    void insert(int id, const Eigen::Vector3d& position);
+
+    /** Removes an entry. Returns false if the id is unknown. */
+    bool remove(int id);
+
+    /** Returns true if the id is known. */
+    bool contains(int id) const {return entries.count(id) > 0;}
+
+    /** Removes all entries */
+    void clear();
+
+    size_t size() const {return entries.size();}
+
+    /** Returns all ids within the given radius around the center, in ascending order.
+     *
+     * @param center center of the query
+     * @param radius query radius in meters
+     * @param ids found ids
+     */
+    void query(const Eigen::Vector3d& center, double radius, std::vector<int>& ids) const;
+
+protected:
+    struct CellIndex
+    {
+        int x, y, z;
+        CellIndex() : x(0), y(0), z(0) {};
+        CellIndex(int x, int y, int z) : x(x), y(y), z(z) {};
+        bool operator==(const CellIndex& other) const {return x == other.x && y == other.y && z == other.z;}
+    };
+
+    struct CellIndexHash
+    {
+        size_t operator()(const CellIndex& index) const;
+    };
+
+    struct Entry
+    {
+        Eigen::Vector3d position;
+        CellIndex cell;
+    };
+
+    typedef boost::unordered_map<CellIndex, std::vector<int>, CellIndexHash> Cells;
+    typedef boost::unordered_map<int, Entry> Entries;
+
+    CellIndex toCell(const Eigen::Vector3d& position) const;
+    void removeFromCell(int id, const CellIndex& cell);
+
+    double cell_size;
+    Cells cells;
+    Entries entries;
+};
+
+}
+
+#endif
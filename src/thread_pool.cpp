@@ -0,0 +1,104 @@
+#include "thread_pool.hpp"
+#include <stdexcept>
+#include <boost/bind.hpp>
+
+namespace graph_slam
+{
+
+ThreadPool::ThreadPool(unsigned threads) : thread_count(threads > 1 ? threads : 1), pending_tasks(0), shutdown(false)
+{
+    if(thread_count > 1)
+    {
+        for(unsigned i = 0; i < thread_count; i++)
+            workers.create_thread(boost::bind(&ThreadPool::workerLoop, this));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        shutdown = true;
+    }
+    task_available.notify_all();
+    workers.join_all();
+}
+
+void ThreadPool::schedule(const Task& task)
+{
+    if(thread_count <= 1)
+    {
+        execute(task);
+        return;
+    }
+
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        tasks.push_back(task);
+        pending_tasks++;
+    }
+    task_available.notify_one();
+}
+
+void ThreadPool::wait()
+{
+    std::string error;
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        while(pending_tasks > 0)
+            tasks_done.wait(lock);
+        error.swap(task_error);
+    }
+
+    if(!error.empty())
+        throw std::runtime_error(error);
+}
+
+void ThreadPool::parallelFor(size_t count, const IndexedTask& task)
+{
+    for(size_t i = 0; i < count; i++)
+        schedule(boost::bind(task, i));
+    wait();
+}
+
+void ThreadPool::execute(const Task& task)
+{
+    try
+    {
+        task();
+    }
+    catch (const std::exception& e)
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        if(task_error.empty())
+            task_error = e.what();
+    }
+}
+
+void ThreadPool::workerLoop()
+{
+    while(true)
+    {
+        Task task;
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            while(tasks.empty() && !shutdown)
+                task_available.wait(lock);
+            if(tasks.empty())
+                return;
+            task = tasks.front();
+            tasks.pop_front();
+        }
+
+        execute(task);
+
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            pending_tasks--;
+            if(pending_tasks == 0)
+                tasks_done.notify_all();
+        }
+    }
+}
+
+}
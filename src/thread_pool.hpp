@@ -0,0 +1,60 @@
+#ifndef GRAPH_SLAM_THREAD_POOL_HPP
+#define GRAPH_SLAM_THREAD_POOL_HPP
+
+#include <deque>
+#include <string>
+#include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+namespace graph_slam
+{
+
+/**
+ * A fixed size pool of worker threads.
+ * With a thread count of one or less all tasks are executed
+ * on the calling thread.
+ */
+class ThreadPool
+{
+public:
+    typedef boost::function<void ()> Task;
+    typedef boost::function<void (size_t)> IndexedTask;
+
+    /** @param threads number of worker threads. */
+    explicit ThreadPool(unsigned threads = 1);
+    ~ThreadPool();
+
+    /** Returns the number of worker threads. */
+    unsigned getThreadCount() const {return thread_count;}
+
+    /** Queues a task, which is executed as soon as a worker thread is available. */
+    void schedule(const Task& task);
+
+    /** Blocks until all scheduled tasks have finished.
+     * Throws a std::runtime_error if one of the tasks has thrown an exception.
+     */
+    void wait();
+
+    /** Calls task(i) for all i in [0, count) and blocks until all calls have finished. */
+    void parallelFor(size_t count, const IndexedTask& task);
+
+private:
+    void workerLoop();
+    void execute(const Task& task);
+
+    unsigned thread_count;
+    std::deque<Task> tasks;
+    unsigned pending_tasks;
+    bool shutdown;
+    std::string task_error;
+    boost::mutex mutex;
+    boost::condition_variable task_available;
+    boost::condition_variable tasks_done;
+    boost::thread_group workers;
+};
+
+}
+
+#endif
@@ -1,6 +1,7 @@
 #include "vertex_grid.hpp"
 #include <boost/foreach.hpp>
 #include <iostream>
+#include <algorithm>
 
 namespace graph_slam 
 {
@@ -16,17 +17,67 @@ VertexGrid::VertexGrid(double grid_size_x, double grid_size_y, double cell_resol
 
 bool VertexGrid::addVertex(int vertex_id, Eigen::Vector3d vertex_position)
 {
-    try
+    size_t xi, yi;
+    if (!toGrid(vertex_position[0], vertex_position[1], xi, yi))
     {
-        std::vector<int>& vertex_cell = getCell(vertex_position[0], vertex_position[1]);
-        vertex_cell.push_back(vertex_id);
+        std::cerr << "vertex position (" << vertex_position[0] << ", " << vertex_position[1] << ") is out of vertex grid." << std::endl;
+        return false;
+    }
+    insertIntoCell(vertex_id, xi, yi);
+    return true;
+}
+
+bool VertexGrid::moveVertex(int vertex_id, const Eigen::Vector3d& vertex_position)
+{
+    size_t xi, yi;
+    bool in_grid = toGrid(vertex_position[0], vertex_position[1], xi, yi);
+
+    VertexCells::iterator it = vertex_cells.find(vertex_id);
+    if (it == vertex_cells.end())
+    {
+        std::set<int>::iterator outside = vertices_outside.find(vertex_id);
+        if (outside == vertices_outside.end() || !in_grid)
+            return false;
+        // the vertex is back in the grid
+        vertices_outside.erase(outside);
+        insertIntoCell(vertex_id, xi, yi);
         return true;
     }
-    catch (std::runtime_error e)
+
+    if (in_grid && it->second.first == xi && it->second.second == yi)
+        return true;
+
+    std::vector<int>& old_cell = grid[it->second.second][it->second.first];
+    old_cell.erase(std::find(old_cell.begin(), old_cell.end(), vertex_id));
+    vertex_cells.erase(it);
+
+    if (!in_grid)
     {
-        std::cerr << "vertex position (" << vertex_position[0] << ", " << vertex_position[1] << ") is out of vertex grid." << std::endl;
+        vertices_outside.insert(vertex_id);
+        return false;
     }
-    return false;
+    insertIntoCell(vertex_id, xi, yi);
+    return true;
+}
+
+bool VertexGrid::removeVertex(int vertex_id)
+{
+    VertexCells::iterator it = vertex_cells.find(vertex_id);
+    if (it == vertex_cells.end())
+        return vertices_outside.erase(vertex_id) > 0;
+
+    std::vector<int>& cell = grid[it->second.second][it->second.first];
+    cell.erase(std::find(cell.begin(), cell.end(), vertex_id));
+    vertex_cells.erase(it);
+    return true;
+}
+
+void VertexGrid::insertIntoCell(int vertex_id, size_t xi, size_t yi)
+{
+    // the cells are kept sorted by id, so the oldest vertices are removed first
+    std::vector<int>& cell = grid[yi][xi];
+    cell.insert(std::lower_bound(cell.begin(), cell.end(), vertex_id), vertex_id);
+    vertex_cells[vertex_id] = std::make_pair(xi, yi);
 }
 
 void VertexGrid::removeVertices(std::vector<int>& vertices_removed)
@@ -41,6 +92,7 @@ void VertexGrid::removeVertices(std::vector<int>& vertices_removed)
             while(cell.size() > max_vertices_per_cell)
             {
                 vertices_removed.push_back(cell.front());
+                vertex_cells.erase(cell.front());
                 cell.erase(cell.begin());
             }
         }
@@ -2,6 +2,8 @@
 #define GRAPH_SLAM_VERTEX_GRID_HPP
 
 #include <vector>
+#include <map>
+#include <set>
 #include <boost/multi_array.hpp>
 #include <Eigen/Dense>
 
@@ -17,6 +19,12 @@ public:
     ~VertexGrid() {}
 
     bool addVertex(int vertex_id, Eigen::Vector3d vertex_position);
+    /** Moves a vertex to the cell of its new position. A vertex that has moved out of
+     * the grid is kept track of and is inserted again once its position is back in the grid.
+     * Returns false if the vertex is unknown or out of the grid. */
+    bool moveVertex(int vertex_id, const Eigen::Vector3d& vertex_position);
+    /** Removes a single vertex from the grid. Returns false if the vertex is unknown. */
+    bool removeVertex(int vertex_id);
     void removeVertices(std::vector<int>& vertices_removed);
     void setMaxVerticesPerCell(size_t max_vertices_per_cell) {this->max_vertices_per_cell = max_vertices_per_cell;}
     size_t getMaxVerticesPerCell() const {return max_vertices_per_cell;}
@@ -24,8 +32,15 @@ public:
 protected:
     std::vector<int>& getCell(double x, double y);
     bool toGrid(double x, double y, size_t& xi, size_t& yi);
+    void insertIntoCell(int vertex_id, size_t xi, size_t yi);
+
+    /** cell indices (x, y) of each vertex in the grid */
+    typedef std::map<int, std::pair<size_t, size_t> > VertexCells;
 
     VertexGridData grid;
+    VertexCells vertex_cells;
+    /** vertices that have been moved out of the grid */
+    std::set<int> vertices_outside;
     double offset_x, offset_y;
     double scale_x, scale_y;
     size_t cell_size_x, cell_size_y;
@@ -1,35 +1,167 @@
 #include "vertex_se3_gicp.hpp"
 
 #include <graph_slam/pointcloud_helper.hpp>
+#include <graph_slam/instrumentation.hpp>
 #include <pcl/filters/voxel_grid.h>
+#include <pcl/filters/approximate_voxel_grid.h>
 
 namespace graph_slam
 {
+
+/** Deleter for shared pointers to objects which aren't owned */
+struct NullDeleter
+{
+    void operator()(const void*) const {}
+};
     
-VertexSE3_GICP::VertexSE3_GICP() : VertexSE3(), pcl_cloud(new PCLPointCloud), missing_edges_error(0.0), pointcloud_attached(false)
+VertexSE3_GICP::VertexSE3_GICP() : VertexSE3(), pcl_cloud(new PCLPointCloud), gicp_cloud(new GICPPointCloud), candidate_queue(NULL), missing_edges_error(0.0), pointcloud_attached(false)
+{
+}
+
+VertexSE3_GICP::~VertexSE3_GICP()
 {
+    setEdgeCandidateQueue(NULL);
 }
 
-void VertexSE3_GICP::attachPointCloud(envire::Pointcloud* point_cloud)
+/** Prepares the search tree and point covariances of a pointcloud for GICP */
+static boost::shared_ptr<VertexSE3_GICP::GICPPointCloud> createGICPPointCloud(const VertexSE3_GICP::PCLPointCloudConstPtr& pcl_cloud, unsigned correspondence_randomness)
 {
+    boost::shared_ptr<VertexSE3_GICP::GICPPointCloud> cloud(new VertexSE3_GICP::GICPPointCloud);
+    cloud->cloud = pcl_cloud;
+    if(!pcl_cloud->empty())
+    {
+        cloud->search_tree.reset(new VertexSE3_GICP::PCLSearchTree);
+        cloud->search_tree->setInputCloud(pcl_cloud);
+        VertexSE3_GICP::PointCovariancesPtr covariances(new PointCovariances);
+        if(computeGICPPointCovariances(*pcl_cloud, *cloud->search_tree, correspondence_randomness, *covariances))
+        {
+            cloud->covariances = covariances;
+            cloud->covariance_neighbors = correspondence_randomness;
+        }
+    }
+    return cloud;
+}
+
+void VertexSE3_GICP::attachPointCloud(envire::Pointcloud* point_cloud, const GICPConfiguration& gicp_config)
+{
+    PCLPointCloud buffer;
+    attachPointCloud(point_cloud, gicp_config, buffer);
+}
+
+void VertexSE3_GICP::attachPointCloud(envire::Pointcloud* point_cloud, const GICPConfiguration& gicp_config, PCLPointCloud& buffer)
+{
+    GRAPH_SLAM_SCOPED_TIMER(downsampling_time);
     envire_pointcloud.reset(point_cloud);
     
-    PCLPointCloudPtr pointcloud(new PCLPointCloud);
-    vectorToPCLPointCloud(point_cloud->vertices, *pointcloud.get());
-    pcl::VoxelGrid<pcl::PointXYZ> voxel_grid;
-    voxel_grid.setLeafSize(0.1, 0.1, 0.05);
-    voxel_grid.setDownsampleAllData(true);
-    voxel_grid.setInputCloud(pointcloud);
-    voxel_grid.filter(*pcl_cloud.get());
+    // downsample pointcloud
+    pcl_cloud.reset(new PCLPointCloud);
+    // the buffer is only borrowed, it is not released by the filters
+    PCLPointCloudConstPtr buffer_ptr(&buffer, NullDeleter());
+    switch(gicp_config.downsampling_method)
+    {
+        case HashedVoxel:
+        {
+            Eigen::Vector3d leaf_size(gicp_config.voxel_leaf_size_x, gicp_config.voxel_leaf_size_y, gicp_config.voxel_leaf_size_z);
+            voxelFilterPointCloud(point_cloud->vertices, *pcl_cloud.get(), leaf_size);
+            break;
+        }
+        case RandomSubsample:
+        {
+            // seeded by the id, so the subset doesn't depend on the thread the pointcloud is attached on
+            vectorToPCLPointCloud(point_cloud->vertices, *pcl_cloud.get(), gicp_config.point_cloud_density, (unsigned)_id);
+            break;
+        }
+        case ApproximateVoxel:
+        {
+            vectorToPCLPointCloud(point_cloud->vertices, buffer);
+            pcl::ApproximateVoxelGrid<pcl::PointXYZ> voxel_grid;
+            voxel_grid.setLeafSize(gicp_config.voxel_leaf_size_x, gicp_config.voxel_leaf_size_y, gicp_config.voxel_leaf_size_z);
+            voxel_grid.setDownsampleAllData(true);
+            voxel_grid.setInputCloud(buffer_ptr);
+            voxel_grid.filter(*pcl_cloud.get());
+            break;
+        }
+        case VoxelCentroid:
+        default:
+        {
+            vectorToPCLPointCloud(point_cloud->vertices, buffer);
+            pcl::VoxelGrid<pcl::PointXYZ> voxel_grid;
+            voxel_grid.setLeafSize(gicp_config.voxel_leaf_size_x, gicp_config.voxel_leaf_size_y, gicp_config.voxel_leaf_size_z);
+            voxel_grid.setDownsampleAllData(true);
+            voxel_grid.setInputCloud(buffer_ptr);
+            voxel_grid.filter(*pcl_cloud.get());
+            break;
+        }
+    }
     
+    // prepare the search tree and point covariances for GICP
+    boost::shared_ptr<GICPPointCloud> cloud = createGICPPointCloud(pcl_cloud, gicp_config.correspondence_randomness);
+    
+    // build the coarser resolution levels, a level is only usable if it has enough points for the covariances
+    Eigen::Vector3d leaf_size(gicp_config.voxel_leaf_size_x, gicp_config.voxel_leaf_size_y, gicp_config.voxel_leaf_size_z);
+    for(unsigned level = 1; level < gicp_config.resolution_levels && gicp_config.resolution_level_scale > 1.0; level++)
+    {
+        leaf_size *= gicp_config.resolution_level_scale;
+        PCLPointCloudPtr level_cloud(new PCLPointCloud);
+        voxelFilterPointCloud(*pcl_cloud, *level_cloud, leaf_size);
+        boost::shared_ptr<GICPPointCloud> coarse_level = createGICPPointCloud(level_cloud, gicp_config.correspondence_randomness);
+        if(!coarse_level->covariances)
+            break;
+        cloud->coarse_levels.push_back(coarse_level);
+    }
+    gicp_cloud = cloud;
+    
+    pointcloud_attached = true;
+    updateEdgeCandidateQueue();
+}
+
+void VertexSE3_GICP::attachPointCloud(envire::Pointcloud* point_cloud, const PCLPointCloudPtr& downsampled_cloud, const GICPPointCloudConstPtr& gicp_cloud)
+{
+    envire_pointcloud.reset(point_cloud);
+    pcl_cloud = downsampled_cloud;
+    this->gicp_cloud = gicp_cloud;
     pointcloud_attached = true;
+    updateEdgeCandidateQueue();
 }
 
 void VertexSE3_GICP::detachPointCloud()
 {
     envire_pointcloud.reset();
-    pcl_cloud->clear();
+    // don't clear the cloud in place, it might still be used by a snapshot
+    pcl_cloud.reset(new PCLPointCloud);
+    gicp_cloud.reset(new GICPPointCloud);
     pointcloud_attached = false;
+    updateEdgeCandidateQueue();
+}
+
+void VertexSE3_GICP::releaseGICPPointCloud()
+{
+    // like in detachPointCloud() the data might still be used by a snapshot
+    pcl_cloud.reset(new PCLPointCloud);
+    gicp_cloud.reset(new GICPPointCloud);
+}
+
+/** Estimates the memory used by one resolution level, the search tree holds an index per point */
+static size_t getGICPPointCloudLevelMemoryUsage(const VertexSE3_GICP::GICPPointCloud& cloud)
+{
+    size_t usage = 0;
+    if(cloud.cloud)
+    {
+        usage += cloud.cloud->size() * sizeof(pcl::PointXYZ);
+        if(cloud.search_tree)
+            usage += cloud.cloud->size() * (sizeof(int) + sizeof(pcl::PointXYZ));
+    }
+    if(cloud.covariances)
+        usage += cloud.covariances->size() * sizeof(Eigen::Matrix3d);
+    return usage;
+}
+
+size_t VertexSE3_GICP::getGICPPointCloudMemoryUsage() const
+{
+    size_t usage = getGICPPointCloudLevelMemoryUsage(*gicp_cloud);
+    for(std::vector<GICPPointCloudConstPtr>::const_iterator it = gicp_cloud->coarse_levels.begin(); it != gicp_cloud->coarse_levels.end(); it++)
+        usage += getGICPPointCloudLevelMemoryUsage(**it);
+    return usage;
 }
 
 envire::EnvironmentItem::Ptr VertexSE3_GICP::getEnvirePointCloud() const
@@ -42,24 +174,22 @@ VertexSE3_GICP::PCLPointCloudConstPtr VertexSE3_GICP::getPCLPointCloud() const
     return pcl_cloud;
 }
 
+VertexSE3_GICP::GICPPointCloudConstPtr VertexSE3_GICP::getGICPPointCloud() const
+{
+    return gicp_cloud;
+}
+
 bool VertexSE3_GICP::getBestEdgeCandidate(VertexSE3_GICP::EdgeCandidate& candidate, int& vertex_id)
 {
-    double error = 0.0;
-    for(EdgeCandidates::iterator it = edge_candidates.begin(); it != edge_candidates.end(); it++)
-    {
-        if(!it->second.icp_failed && it->second.error > error)
-        {
-            error = it->second.error;
-            vertex_id = it->first;
-        }
-    }
-    
-    if(error <= 0.0)
+    // candidate_errors contains all candidates which haven't failed, on equal errors the smaller id is on top
+    if(candidate_errors.empty() || candidate_errors.topPriority() <= 0.0)
     {
         missing_edges_error = 0.0;
+        updateEdgeCandidateQueue();
         return false;
     }
     
+    vertex_id = candidate_errors.top();
     candidate = edge_candidates[vertex_id];
     return true;
 }
@@ -84,6 +214,12 @@ void VertexSE3_GICP::addEdgeCandidate(int vertex_id, double mahalanobis_distance
 
     // update mahalanobis distance
     edge_candidates[vertex_id].mahalanobis_distance = mahalanobis_distance;
+    
+    if(!edge_candidates[vertex_id].icp_failed)
+    {
+        candidate_errors.push(vertex_id, edge_candidates[vertex_id].error);
+        updateEdgeCandidateQueue();
+    }
 }
 
 void VertexSE3_GICP::removeEdgeCandidate(int vertex_id)
@@ -94,6 +230,8 @@ void VertexSE3_GICP::removeEdgeCandidate(int vertex_id)
         if(missing_edges_error < 0.0)
             missing_edges_error = 0.0;
         edge_candidates.erase(vertex_id);
+        candidate_errors.remove(vertex_id);
+        updateEdgeCandidateQueue();
     }
 }
 
@@ -114,6 +252,12 @@ void VertexSE3_GICP::updateEdgeCandidate(int vertex_id, bool icp_failed)
         }
         
         edge_candidates[vertex_id].icp_failed = icp_failed;
+        
+        if(icp_failed)
+            candidate_errors.remove(vertex_id);
+        else
+            candidate_errors.push(vertex_id, edge_candidates[vertex_id].error);
+        updateEdgeCandidateQueue();
     }
 }
 
@@ -122,6 +266,24 @@ double VertexSE3_GICP::getMissingEdgesError() const
     return missing_edges_error;
 }
 
+void VertexSE3_GICP::setEdgeCandidateQueue(EdgeCandidateQueue* queue)
+{
+    if(candidate_queue && candidate_queue != queue)
+        candidate_queue->remove(_id);
+    candidate_queue = queue;
+    updateEdgeCandidateQueue();
+}
+
+void VertexSE3_GICP::updateEdgeCandidateQueue()
+{
+    if(!candidate_queue)
+        return;
+    if(pointcloud_attached && missing_edges_error > 0.0)
+        candidate_queue->push(_id, missing_edges_error);
+    else
+        candidate_queue->remove(_id);
+}
+
 const VertexSE3_GICP::EdgeSearchState& VertexSE3_GICP::getEdgeSearchState()
 {
     return search_state;
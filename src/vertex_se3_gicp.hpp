@@ -6,6 +6,10 @@
 #include <base/samples/RigidBodyState.hpp>
 #include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
+#include <pcl/search/kdtree.h>
+#include <graph_slam/indexed_max_heap.hpp>
+#include <graph_slam/pointcloud_helper.hpp>
+#include <graph_slam/graph_slam_config.hpp>
 
 namespace graph_slam 
 {
@@ -32,13 +36,49 @@ public:
     typedef pcl::PointCloud<pcl::PointXYZ> PCLPointCloud;
     typedef typename PCLPointCloud::Ptr PCLPointCloudPtr;
     typedef typename PCLPointCloud::ConstPtr PCLPointCloudConstPtr;
+    typedef pcl::search::KdTree<pcl::PointXYZ> PCLSearchTree;
+    typedef typename PCLSearchTree::Ptr PCLSearchTreePtr;
+    typedef boost::shared_ptr<PointCovariances> PointCovariancesPtr;
+    
+    struct GICPPointCloud;
+    typedef boost::shared_ptr<const GICPPointCloud> GICPPointCloudConstPtr;
+    
+    /** The downsampled pointcloud together with its search tree and local point covariances.
+     * They are computed once in attachPointCloud() and reused in every GICP alignment.
+     */
+    struct GICPPointCloud
+    {
+        PCLPointCloudConstPtr cloud;
+        PCLSearchTreePtr search_tree;
+        PointCovariancesPtr covariances;
+        /** number of nearest neighbors used to compute the covariances */
+        unsigned covariance_neighbors;
+        /** coarser resolution levels of the pointcloud, beginning with the finest one */
+        std::vector<GICPPointCloudConstPtr> coarse_levels;
+        GICPPointCloud() : covariance_neighbors(0) {};
+    };
+    /** Queue of vertex ids ordered by their missing edges error */
+    typedef IndexedMaxHeap<int> EdgeCandidateQueue;
     
     VertexSE3_GICP();
-    void attachPointCloud(envire::Pointcloud* point_cloud);
+    virtual ~VertexSE3_GICP();
+    void attachPointCloud(envire::Pointcloud* point_cloud, const GICPConfiguration& gicp_config = GICPConfiguration());
+    /** Same as above, but uses the given buffer for the intermediate full resolution pointcloud.
+     * Reusing the buffer avoids an allocation per pointcloud. */
+    void attachPointCloud(envire::Pointcloud* point_cloud, const GICPConfiguration& gicp_config, PCLPointCloud& buffer);
+    /** Attaches a pointcloud together with its already downsampled pointcloud and GICP data,
+     * e.g. restored from a snapshot. No filtering is done and no point covariances are computed. */
+    void attachPointCloud(envire::Pointcloud* point_cloud, const PCLPointCloudPtr& downsampled_cloud, const GICPPointCloudConstPtr& gicp_cloud);
     void detachPointCloud();
     bool hasPointcloudAttached() const {return pointcloud_attached;};
+    /** Releases the downsampled pointcloud and its GICP data, but keeps the pointcloud attached.
+     * The data can be restored by attaching the envire pointcloud again. */
+    void releaseGICPPointCloud();
+    /** Returns an estimate of the memory used by the downsampled pointcloud and its GICP data in bytes */
+    size_t getGICPPointCloudMemoryUsage() const;
     envire::EnvironmentItem::Ptr getEnvirePointCloud() const;
     PCLPointCloudConstPtr getPCLPointCloud() const;
+    GICPPointCloudConstPtr getGICPPointCloud() const;
     
     
     void addEdgeCandidate(int vertex_id, double mahalanobis_distance);
@@ -47,13 +87,22 @@ public:
     bool getBestEdgeCandidate(EdgeCandidate& candidate, int& vertex_id);
     double getMissingEdgesError() const;
     
+    /** Registers the vertex in a queue, which is kept up to date with the missing edges error 
+     * of this vertex as long as a pointcloud is attached. Use NULL to unregister the vertex. */
+    void setEdgeCandidateQueue(EdgeCandidateQueue* queue);
+    
     void setEdgeSearchState(bool has_run, const Eigen::Isometry3d& search_pose);
     const EdgeSearchState& getEdgeSearchState();
     
 protected:
+    void updateEdgeCandidateQueue();
+    
     PCLPointCloudPtr pcl_cloud;
+    GICPPointCloudConstPtr gicp_cloud;
     envire::EnvironmentItem::Ptr envire_pointcloud;
     EdgeCandidates edge_candidates;
+    IndexedMaxHeap<int> candidate_errors;
+    EdgeCandidateQueue* candidate_queue;
     EdgeSearchState search_state;
     double missing_edges_error;
     bool pointcloud_attached;
@@ -0,0 +1,370 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/normal_distribution.hpp>
+#include <boost/random/variate_generator.hpp>
+
+#include <graph_slam/extended_sparse_optimizer.hpp>
+#include <graph_slam/instrumentation.hpp>
+#include <envire/maps/MLSGrid.hpp>
+
+/**
+ * Drives the ExtendedSparseOptimizer through complete SLAM cycles on a synthetic world,
+ * i.e. addVertex, optimize, findEdgeCandidates, tryBestEdgeCandidates and updateEnvire,
+ * and reports the throughput, the latency percentiles and the growth of the peak memory of each stage.
+ *
+ * The world consists of a ground plane and a grid of pillars, which are scanned by a simulated
+ * 16 beam laser scanner. The trajectory is either a circle, which is driven repeatedly to create
+ * loop closures, or a recorded trajectory given as a text file with one "x y z yaw" pose per line.
+ */
+
+typedef std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d> > Poses;
+
+static long getPeakMemoryKB()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static double getTime()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/** Latencies and peak memory growth of one stage of the SLAM cycle */
+struct StageStats
+{
+    std::string name;
+    std::vector<double> latencies;
+    long memory_growth_kb;
+
+    explicit StageStats(const std::string& name) : name(name), memory_growth_kb(0) {}
+
+    double percentile(double p) const
+    {
+        if(latencies.empty())
+            return 0.0;
+        std::vector<double> sorted = latencies;
+        std::sort(sorted.begin(), sorted.end());
+        size_t index = std::min(sorted.size() - 1, (size_t)(p * (sorted.size() - 1) + 0.5));
+        return sorted[index];
+    }
+
+    double total() const
+    {
+        double sum = 0.0;
+        for(unsigned i = 0; i < latencies.size(); i++)
+            sum += latencies[i];
+        return sum;
+    }
+};
+
+/** Measures the latency and the peak memory growth of a stage during its lifetime */
+class StageTimer
+{
+public:
+    explicit StageTimer(StageStats& stats) : stats(stats), start(getTime()), start_memory(getPeakMemoryKB()) {}
+    ~StageTimer()
+    {
+        stats.latencies.push_back(getTime() - start);
+        stats.memory_growth_kb += getPeakMemoryKB() - start_memory;
+    }
+
+private:
+    StageStats& stats;
+    double start;
+    long start_memory;
+};
+
+/** Distance along a ray to the first hit of the ground plane or a pillar, negative if nothing is hit */
+static double castRay(const Eigen::Vector3d& origin, const Eigen::Vector3d& direction, double max_range)
+{
+    const double pillar_spacing = 10.0;
+    const double pillar_radius = 0.5;
+    double range = max_range + 1.0;
+
+    if(direction.z() < -1e-6)
+        range = std::min(range, -origin.z() / direction.z());
+
+    // test the pillars of the grid cells along the ray
+    Eigen::Vector2d origin_2d = origin.head<2>();
+    Eigen::Vector2d direction_2d = direction.head<2>();
+    double direction_norm = direction_2d.norm();
+    if(direction_norm > 1e-6)
+    {
+        for(double step = 0.0; step < std::min(range, max_range) * direction_norm + pillar_spacing; step += pillar_spacing * 0.5)
+        {
+            Eigen::Vector2d sample = origin_2d + direction_2d * (step / direction_norm);
+            for(int dx = -1; dx <= 1; dx++)
+                for(int dy = -1; dy <= 1; dy++)
+                {
+                    Eigen::Vector2d center(pillar_spacing * (std::floor(sample.x() / pillar_spacing) + dx) + pillar_spacing * 0.5,
+                                           pillar_spacing * (std::floor(sample.y() / pillar_spacing) + dy) + pillar_spacing * 0.5);
+                    // solve |origin + t * direction - center| = radius in the plane
+                    Eigen::Vector2d offset = origin_2d - center;
+                    double a = direction_2d.squaredNorm();
+                    double b = 2.0 * offset.dot(direction_2d);
+                    double c = offset.squaredNorm() - pillar_radius * pillar_radius;
+                    double discriminant = b * b - 4.0 * a * c;
+                    if(discriminant < 0.0)
+                        continue;
+                    double t = (-b - std::sqrt(discriminant)) / (2.0 * a);
+                    if(t > 0.0)
+                        range = std::min(range, t);
+                }
+        }
+    }
+    return range <= max_range ? range : -1.0;
+}
+
+/** Simulates a scan of the synthetic world in the frame of the robot */
+static void simulateScan(const Eigen::Isometry3d& robot_pose, const Eigen::Vector3d& sensor_in_robot, unsigned points_per_scan,
+                         boost::variate_generator<boost::mt19937&, boost::normal_distribution<double> >& range_noise,
+                         std::vector<Eigen::Vector3d>& pointcloud)
+{
+    const unsigned beams = 16;
+    const double max_range = 50.0;
+    unsigned azimuth_steps = std::max(1u, points_per_scan / beams);
+    Eigen::Vector3d sensor_origin = robot_pose * sensor_in_robot;
+    Eigen::Isometry3d world2robot = robot_pose.inverse();
+
+    pointcloud.clear();
+    for(unsigned beam = 0; beam < beams; beam++)
+    {
+        double elevation = (-15.0 + 30.0 * beam / (beams - 1)) * M_PI / 180.0;
+        for(unsigned step = 0; step < azimuth_steps; step++)
+        {
+            double azimuth = 2.0 * M_PI * step / azimuth_steps;
+            Eigen::Vector3d direction = robot_pose.linear() * Eigen::Vector3d(std::cos(elevation) * std::cos(azimuth),
+                                                                             std::cos(elevation) * std::sin(azimuth),
+                                                                             std::sin(elevation));
+            double range = castRay(sensor_origin, direction, max_range);
+            if(range < 0.0)
+                continue;
+            range += range_noise();
+            pointcloud.push_back(world2robot * (sensor_origin + range * direction));
+        }
+    }
+}
+
+/** A circle of 20m radius with one pose per meter, the laps are slightly shifted */
+static void createCircleTrajectory(unsigned count, Poses& poses)
+{
+    const double radius = 20.0;
+    const double step = 1.0 / radius;
+    poses.clear();
+    for(unsigned i = 0; i < count; i++)
+    {
+        double angle = i * step;
+        double lap_offset = 0.2 * std::sin(angle / 7.0);
+        Eigen::Isometry3d pose = Eigen::Isometry3d::Identity();
+        pose.translation() = Eigen::Vector3d((radius + lap_offset) * std::cos(angle), (radius + lap_offset) * std::sin(angle), 0.0);
+        pose.linear() = Eigen::AngleAxisd(angle + M_PI * 0.5, Eigen::Vector3d::UnitZ()).toRotationMatrix();
+        poses.push_back(pose);
+    }
+}
+
+static bool loadTrajectory(const std::string& path, unsigned count, Poses& poses)
+{
+    std::ifstream file(path.c_str());
+    if(!file.is_open())
+    {
+        std::cerr << "failed to open the trajectory " << path << std::endl;
+        return false;
+    }
+    poses.clear();
+    std::string line;
+    while(poses.size() < count && std::getline(file, line))
+    {
+        std::istringstream stream(line);
+        double x, y, z, yaw;
+        if(!(stream >> x >> y >> z >> yaw))
+            continue;
+        Eigen::Isometry3d pose = Eigen::Isometry3d::Identity();
+        pose.translation() = Eigen::Vector3d(x, y, z);
+        pose.linear() = Eigen::AngleAxisd(yaw, Eigen::Vector3d::UnitZ()).toRotationMatrix();
+        poses.push_back(pose);
+    }
+    return true;
+}
+
+struct BenchmarkConfiguration
+{
+    unsigned points_per_scan;
+    unsigned threads;
+    unsigned candidates_per_cycle;
+    unsigned iterations;
+    bool use_mls;
+    std::string trajectory_path;
+
+    BenchmarkConfiguration() : points_per_scan(16 * 1024), threads(1), candidates_per_cycle(2), iterations(5), use_mls(true) {}
+};
+
+static void runBenchmark(unsigned vertex_count, const BenchmarkConfiguration& config)
+{
+    Poses true_poses;
+    if(config.trajectory_path.empty())
+        createCircleTrajectory(vertex_count, true_poses);
+    else if(!loadTrajectory(config.trajectory_path, vertex_count, true_poses))
+        return;
+
+    graph_slam::ExtendedSparseOptimizer optimizer;
+    optimizer.setWorkerThreadCount(config.threads);
+    graph_slam::GICPConfiguration gicp_config;
+    gicp_config.max_sensor_distance = 5.0;
+    gicp_config.voxel_leaf_size_x = 0.25;
+    gicp_config.voxel_leaf_size_y = 0.25;
+    gicp_config.voxel_leaf_size_z = 0.25;
+    optimizer.updateGICPConfiguration(gicp_config);
+    if(config.use_mls)
+        optimizer.setMLSMapConfiguration(true, envire::MLSConfiguration(), "/slam/mls", 100.0, 100.0, 0.1, 0.1, -5.0, 5.0);
+
+    boost::mt19937 rng(42);
+    boost::normal_distribution<double> range_distribution(0.0, 0.02);
+    boost::normal_distribution<double> odometry_distribution(0.0, 0.01);
+    boost::variate_generator<boost::mt19937&, boost::normal_distribution<double> > range_noise(rng, range_distribution);
+    boost::variate_generator<boost::mt19937&, boost::normal_distribution<double> > odometry_noise(rng, odometry_distribution);
+
+    StageStats add_vertex("addVertex"), optimize("optimize"), find_candidates("findEdgeCandidates"),
+               try_candidates("tryBestEdgeCandidates"), update_envire("updateEnvire");
+    const Eigen::Vector3d sensor_in_robot(0.0, 0.0, 2.0);
+    Eigen::Isometry3d odometry_pose = true_poses.empty() ? Eigen::Isometry3d::Identity() : true_poses.front();
+    std::vector<Eigen::Vector3d> pointcloud;
+    graph_slam::resetInstrumentationStats();
+    double start = getTime();
+    for(unsigned i = 0; i < true_poses.size(); i++)
+    {
+        // the odometry drifts with the traveled distance
+        if(i > 0)
+        {
+            Eigen::Isometry3d delta = true_poses[i-1].inverse() * true_poses[i];
+            Eigen::Isometry3d noise = Eigen::Isometry3d::Identity();
+            noise.translation() = Eigen::Vector3d(odometry_noise(), odometry_noise(), 0.0);
+            noise.linear() = Eigen::AngleAxisd(0.1 * odometry_noise(), Eigen::Vector3d::UnitZ()).toRotationMatrix();
+            odometry_pose = odometry_pose * delta * noise;
+        }
+        envire::TransformWithUncertainty transformation(Eigen::Affine3d(odometry_pose.matrix()), 0.001 * (i + 1) * graph_slam::Matrix6d::Identity());
+        simulateScan(true_poses[i], sensor_in_robot, config.points_per_scan, range_noise, pointcloud);
+        Eigen::Affine3d sensor_origin = Eigen::Affine3d::Identity();
+        sensor_origin.translation() = sensor_in_robot;
+
+        try
+        {
+            {
+                StageTimer timer(add_vertex);
+                optimizer.addVertex(transformation, pointcloud, sensor_origin);
+            }
+            {
+                StageTimer timer(optimize);
+                optimizer.optimize(config.iterations, true);
+            }
+            {
+                StageTimer timer(find_candidates);
+                optimizer.findEdgeCandidates();
+            }
+            {
+                StageTimer timer(try_candidates);
+                optimizer.tryBestEdgeCandidates(config.candidates_per_cycle);
+            }
+            {
+                StageTimer timer(update_envire);
+                optimizer.updateEnvire();
+            }
+        }
+        catch (std::exception& e)
+        {
+            std::cerr << "cycle " << i << " failed: " << e.what() << std::endl;
+            return;
+        }
+    }
+    double duration = getTime() - start;
+    graph_slam::InstrumentationStats instrumentation = graph_slam::takeInstrumentationStats();
+
+    std::cout << std::endl << "vertices: " << true_poses.size() << ", edges: " << optimizer.edges().size()
+              << ", points per scan: " << config.points_per_scan << ", threads: " << config.threads << std::endl;
+    std::cout << "total " << duration << " s, " << true_poses.size() / duration << " cycles/s, peak memory "
+              << getPeakMemoryKB() / 1024 << " MB" << std::endl;
+    std::cout << std::setw(22) << std::left << "stage" << std::right << std::setw(12) << "calls/s" << std::setw(12) << "p50 [ms]"
+              << std::setw(12) << "p90 [ms]" << std::setw(12) << "p99 [ms]" << std::setw(12) << "max [ms]" << std::setw(14) << "memory [MB]" << std::endl;
+    StageStats* stages[] = {&add_vertex, &optimize, &find_candidates, &try_candidates, &update_envire};
+    for(unsigned i = 0; i < sizeof(stages) / sizeof(stages[0]); i++)
+    {
+        const StageStats& stage = *stages[i];
+        double total = stage.total();
+        std::cout << std::setw(22) << std::left << stage.name << std::right << std::fixed << std::setprecision(2)
+                  << std::setw(12) << (total > 0.0 ? stage.latencies.size() / total : 0.0)
+                  << std::setw(12) << 1000.0 * stage.percentile(0.5) << std::setw(12) << 1000.0 * stage.percentile(0.9)
+                  << std::setw(12) << 1000.0 * stage.percentile(0.99) << std::setw(12) << 1000.0 * stage.percentile(1.0)
+                  << std::setw(14) << stage.memory_growth_kb / 1024.0 << std::endl;
+        std::cout.unsetf(std::ios::fixed);
+    }
+#ifdef GRAPH_SLAM_INSTRUMENTATION
+    std::cout << "gicp: " << instrumentation.gicp_calls << " calls, " << instrumentation.gicp_failures << " failures, "
+              << instrumentation.gicp_time << " s; downsampling " << instrumentation.downsampling_time << " s; cov graph "
+              << instrumentation.cov_graph_time << " s; marginals " << instrumentation.marginal_blocks << " blocks, "
+              << instrumentation.marginals_time << " s; solver " << instrumentation.solver_time << " s; mls "
+              << instrumentation.projected_points << " points, " << instrumentation.mls_update_time << " s" << std::endl;
+#else
+    (void)instrumentation;
+#endif
+}
+
+static void printUsage(const char* name)
+{
+    std::cerr << "usage: " << name << " [--points N] [--threads N] [--candidates N] [--iterations N] [--no-mls] [--trajectory FILE] [vertex counts...]" << std::endl
+              << "  runs complete SLAM cycles for each vertex count, the default counts are 100 1000 10000" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    BenchmarkConfiguration config;
+    std::vector<unsigned> vertex_counts;
+    for(int i = 1; i < argc; i++)
+    {
+        bool has_value = i + 1 < argc;
+        if(!std::strcmp(argv[i], "--points") && has_value)
+            config.points_per_scan = std::atoi(argv[++i]);
+        else if(!std::strcmp(argv[i], "--threads") && has_value)
+            config.threads = std::atoi(argv[++i]);
+        else if(!std::strcmp(argv[i], "--candidates") && has_value)
+            config.candidates_per_cycle = std::atoi(argv[++i]);
+        else if(!std::strcmp(argv[i], "--iterations") && has_value)
+            config.iterations = std::atoi(argv[++i]);
+        else if(!std::strcmp(argv[i], "--trajectory") && has_value)
+            config.trajectory_path = argv[++i];
+        else if(!std::strcmp(argv[i], "--no-mls"))
+            config.use_mls = false;
+        else if(argv[i][0] != '-' && std::atoi(argv[i]) > 0)
+            vertex_counts.push_back(std::atoi(argv[i]));
+        else
+        {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if(vertex_counts.empty())
+    {
+        vertex_counts.push_back(100);
+        vertex_counts.push_back(1000);
+        vertex_counts.push_back(10000);
+    }
+
+    for(unsigned i = 0; i < vertex_counts.size(); i++)
+        runBenchmark(vertex_counts[i], config);
+    return 0;
+}
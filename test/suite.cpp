@@ -0,0 +1,5 @@
+// Do NOT add anything to this file, the unit tests are in the test_*.cpp files.
+// The boost test header takes ages to compile, so it is only compiled once (here).
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
@@ -0,0 +1,206 @@
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <graph_slam/graph_snapshot.hpp>
+#include <graph_slam/extended_sparse_optimizer.hpp>
+#include <g2o/core/robust_kernel_impl.h>
+
+using namespace graph_slam;
+
+static Eigen::Isometry3d createPose(double x, double y, double yaw)
+{
+    Eigen::Isometry3d pose = Eigen::Isometry3d::Identity();
+    pose.rotate(Eigen::AngleAxisd(yaw, Eigen::Vector3d::UnitZ()));
+    pose.translation() = Eigen::Vector3d(x, y, 0.5);
+    return pose;
+}
+
+static GraphSnapshot::Edge createEdge(const GraphSnapshot& snapshot, int source_id, int target_id, GraphSnapshot::EdgeKind kind,
+                                      RobustKernelType robust_kernel, double robust_kernel_width)
+{
+    GraphSnapshot::Edge edge;
+    edge.source_id = source_id;
+    edge.target_id = target_id;
+    edge.kind = kind;
+    edge.measurement = snapshot.vertices[source_id].pose.inverse() * snapshot.vertices[target_id].pose;
+    edge.information = (10.0 + source_id) * Matrix6d::Identity();
+    edge.information(0, 1) = edge.information(1, 0) = 0.5;
+    edge.fitness_score = kind == GraphSnapshot::ConstraintEdge ? 0.0 : 0.01 * target_id;
+    edge.robust_kernel = robust_kernel;
+    edge.robust_kernel_width = robust_kernel_width;
+    return edge;
+}
+
+/** Graph of three vertices without pointclouds, connected by every kind of edge */
+static GraphSnapshot createSnapshot()
+{
+    GraphSnapshot snapshot;
+    for(int i = 0; i < 3; i++)
+    {
+        GraphSnapshot::Vertex vertex;
+        vertex.id = i;
+        vertex.fixed = i == 0;
+        vertex.pose = createPose(1.0 * i, 0.5 * i, 0.1 * i);
+        snapshot.vertices.push_back(vertex);
+    }
+    snapshot.next_vertex_id = 3;
+    snapshot.last_vertex_id = 2;
+    snapshot.odometry_pose_last_vertex = createPose(3.0, 1.0, 0.3);
+    snapshot.odometry_covariance_last_vertex = 0.01 * Matrix6d::Identity();
+
+    snapshot.edges.push_back(createEdge(snapshot, 0, 1, GraphSnapshot::OdometryEdge, HuberKernel, 2.0));
+    snapshot.edges.push_back(createEdge(snapshot, 0, 2, GraphSnapshot::LoopClosureEdge, DCSKernel, 3.0));
+    snapshot.edges.push_back(createEdge(snapshot, 1, 2, GraphSnapshot::ConstraintEdge, NoRobustKernel, 1.0));
+    return snapshot;
+}
+
+/** the order of the vertices and edges isn't preserved by the optimizer */
+static const GraphSnapshot::Vertex* findVertex(const GraphSnapshot& snapshot, int id)
+{
+    for(GraphSnapshot::Vertices::const_iterator it = snapshot.vertices.begin(); it != snapshot.vertices.end(); it++)
+    {
+        if(it->id == id)
+            return &(*it);
+    }
+    return NULL;
+}
+
+static const GraphSnapshot::Edge* findEdge(const GraphSnapshot& snapshot, int source_id, int target_id)
+{
+    for(GraphSnapshot::Edges::const_iterator it = snapshot.edges.begin(); it != snapshot.edges.end(); it++)
+    {
+        if(it->source_id == source_id && it->target_id == target_id)
+            return &(*it);
+    }
+    return NULL;
+}
+
+static void checkEqual(const GraphSnapshot& expected, const GraphSnapshot& snapshot)
+{
+    BOOST_CHECK_EQUAL(snapshot.next_vertex_id, expected.next_vertex_id);
+    BOOST_CHECK_EQUAL(snapshot.last_vertex_id, expected.last_vertex_id);
+    BOOST_CHECK(snapshot.odometry_pose_last_vertex.isApprox(expected.odometry_pose_last_vertex));
+    BOOST_CHECK(snapshot.odometry_covariance_last_vertex.isApprox(expected.odometry_covariance_last_vertex));
+
+    BOOST_REQUIRE_EQUAL(snapshot.vertices.size(), expected.vertices.size());
+    for(GraphSnapshot::Vertices::const_iterator it = expected.vertices.begin(); it != expected.vertices.end(); it++)
+    {
+        const GraphSnapshot::Vertex* vertex = findVertex(snapshot, it->id);
+        BOOST_REQUIRE(vertex);
+        BOOST_CHECK_EQUAL(vertex->fixed, it->fixed);
+        BOOST_CHECK(vertex->pose.isApprox(it->pose));
+        BOOST_CHECK_EQUAL(vertex->has_pointcloud, it->has_pointcloud);
+    }
+
+    BOOST_REQUIRE_EQUAL(snapshot.edges.size(), expected.edges.size());
+    for(GraphSnapshot::Edges::const_iterator it = expected.edges.begin(); it != expected.edges.end(); it++)
+    {
+        const GraphSnapshot::Edge* edge = findEdge(snapshot, it->source_id, it->target_id);
+        BOOST_REQUIRE(edge);
+        BOOST_CHECK_EQUAL(edge->kind, it->kind);
+        BOOST_CHECK(edge->measurement.isApprox(it->measurement));
+        BOOST_CHECK(edge->information.isApprox(it->information));
+        BOOST_CHECK_EQUAL(edge->fitness_score, it->fitness_score);
+        BOOST_CHECK_EQUAL(edge->robust_kernel, it->robust_kernel);
+        if(it->robust_kernel != NoRobustKernel)
+            BOOST_CHECK_EQUAL(edge->robust_kernel_width, it->robust_kernel_width);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(graph_snapshot)
+
+BOOST_AUTO_TEST_CASE(file_round_trip)
+{
+    GraphSnapshot snapshot = createSnapshot();
+    GraphSnapshot::Vertex& vertex = snapshot.vertices[1];
+    vertex.has_covariance = true;
+    vertex.covariance = 0.1 * Matrix6d::Identity();
+    vertex.has_pointcloud = true;
+    vertex.sensor_origin = Eigen::Affine3d(createPose(0.0, 0.0, 0.2));
+    vertex.points.push_back(Eigen::Vector3d(1.0, 2.0, 3.0));
+    vertex.points.push_back(Eigen::Vector3d(-1.0, 0.0, 0.5));
+
+    const std::string path = "graph_snapshot_test.bin";
+    saveGraphSnapshot(path, snapshot);
+    GraphSnapshot loaded;
+    loadGraphSnapshot(path, loaded);
+    std::remove(path.c_str());
+
+    checkEqual(snapshot, loaded);
+    BOOST_CHECK(loaded.vertices[1].has_covariance);
+    BOOST_CHECK(loaded.vertices[1].covariance.isApprox(vertex.covariance));
+    BOOST_CHECK(loaded.vertices[1].sensor_origin.isApprox(vertex.sensor_origin));
+    BOOST_REQUIRE_EQUAL(loaded.vertices[1].points.size(), 2u);
+    BOOST_CHECK(loaded.vertices[1].points[1].isApprox(vertex.points[1]));
+    BOOST_CHECK(!loaded.vertices[1].gicp_cloud);
+}
+
+BOOST_AUTO_TEST_CASE(invalid_files_are_rejected)
+{
+    const std::string path = "graph_snapshot_invalid.bin";
+    {
+        std::ofstream os(path.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+        os << "GSLAMSNP";
+    }
+    GraphSnapshot loaded;
+    BOOST_CHECK_THROW(loadGraphSnapshot(path, loaded), std::runtime_error);
+    std::remove(path.c_str());
+    BOOST_CHECK_THROW(loadGraphSnapshot(path, loaded), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(optimizer_restores_the_edge_kinds_and_kernels)
+{
+    GraphSnapshot snapshot = createSnapshot();
+    const std::string path = "graph_snapshot_optimizer.bin";
+    const std::string saved_path = "graph_snapshot_optimizer_saved.bin";
+    saveGraphSnapshot(path, snapshot);
+
+    ExtendedSparseOptimizer optimizer;
+    optimizer.loadSnapshot(path);
+    std::remove(path.c_str());
+    BOOST_REQUIRE_EQUAL(optimizer.vertices().size(), 3u);
+    BOOST_REQUIRE_EQUAL(optimizer.edges().size(), 3u);
+
+    for(g2o::HyperGraph::EdgeSet::const_iterator it = optimizer.edges().begin(); it != optimizer.edges().end(); it++)
+    {
+        g2o::EdgeSE3* edge = dynamic_cast<g2o::EdgeSE3*>(*it);
+        BOOST_REQUIRE(edge);
+        EdgeSE3_GICP* gicp_edge = dynamic_cast<EdgeSE3_GICP*>(edge);
+        int source_id = edge->vertices()[0]->id();
+        int target_id = edge->vertices()[1]->id();
+        if(source_id == 0 && target_id == 1)
+        {
+            BOOST_REQUIRE(gicp_edge);
+            BOOST_CHECK(!gicp_edge->usesCoarseToFine());
+            BOOST_CHECK(gicp_edge->hasValidGICPMeasurement());
+            BOOST_REQUIRE(dynamic_cast<g2o::RobustKernelHuber*>(edge->robustKernel()));
+            BOOST_CHECK_EQUAL(edge->robustKernel()->delta(), 2.0);
+        }
+        else if(source_id == 0 && target_id == 2)
+        {
+            BOOST_REQUIRE(gicp_edge);
+            BOOST_CHECK(gicp_edge->usesCoarseToFine());
+            BOOST_REQUIRE(dynamic_cast<g2o::RobustKernelDCS*>(edge->robustKernel()));
+            BOOST_CHECK_EQUAL(edge->robustKernel()->delta(), 3.0);
+        }
+        else
+        {
+            BOOST_CHECK_EQUAL(source_id, 1);
+            BOOST_CHECK_EQUAL(target_id, 2);
+            BOOST_CHECK(!gicp_edge);
+            BOOST_CHECK(!edge->robustKernel());
+        }
+    }
+
+    // saving the restored graph again keeps the poses, edges and kernels
+    optimizer.saveSnapshot(saved_path);
+    GraphSnapshot saved;
+    loadGraphSnapshot(saved_path, saved);
+    std::remove(saved_path.c_str());
+    checkEqual(snapshot, saved);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
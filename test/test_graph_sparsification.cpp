@@ -0,0 +1,96 @@
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include <graph_slam/graph_sparsification.hpp>
+
+using namespace graph_slam;
+
+/** Constraint with the linear error x_to - x_from */
+static LinearizedConstraint relativeConstraint(unsigned from, unsigned to, const Matrix6d& information)
+{
+    LinearizedConstraint constraint;
+    constraint.from = from;
+    constraint.to = to;
+    constraint.jacobian_from = -Matrix6d::Identity();
+    constraint.jacobian_to = Matrix6d::Identity();
+    constraint.information = information;
+    return constraint;
+}
+
+BOOST_AUTO_TEST_SUITE(graph_sparsification)
+
+BOOST_AUTO_TEST_CASE(chain_is_replaced_by_the_combined_constraint)
+{
+    // neighbor 1 -> vertex 0 -> neighbor 2
+    Eigen::Matrix<double, 6, 1> info_a, info_b;
+    info_a << 2.0, 2.0, 4.0, 10.0, 10.0, 20.0;
+    info_b << 3.0, 6.0, 4.0, 10.0, 40.0, 5.0;
+    LinearizedConstraints constraints;
+    constraints.push_back(relativeConstraint(1, 0, info_a.asDiagonal()));
+    constraints.push_back(relativeConstraint(0, 2, info_b.asDiagonal()));
+
+    SparsifiedConstraints tree;
+    BOOST_REQUIRE(sparsifyMarginal(2, constraints, tree));
+    BOOST_REQUIRE_EQUAL(tree.size(), 1u);
+    BOOST_CHECK_EQUAL(tree[0].from, 0u);
+    BOOST_CHECK_EQUAL(tree[0].to, 1u);
+
+    // the covariances of the chained constraints add up
+    Matrix6d expected = (info_a.cwiseInverse() + info_b.cwiseInverse()).cwiseInverse().asDiagonal();
+    BOOST_CHECK_SMALL((tree[0].information - expected).norm(), 1e-6);
+}
+
+BOOST_AUTO_TEST_CASE(tree_keeps_the_most_informative_pairs)
+{
+    // star with the neighbors 1, 2 and 3
+    LinearizedConstraints constraints;
+    constraints.push_back(relativeConstraint(0, 1, 1.0 * Matrix6d::Identity()));
+    constraints.push_back(relativeConstraint(0, 2, 10.0 * Matrix6d::Identity()));
+    constraints.push_back(relativeConstraint(0, 3, 100.0 * Matrix6d::Identity()));
+
+    SparsifiedConstraints tree;
+    BOOST_REQUIRE(sparsifyMarginal(3, constraints, tree));
+    BOOST_REQUIRE_EQUAL(tree.size(), 2u);
+
+    // the weakest pair of the neighbors 0 and 1 is left out
+    bool found_12 = false, found_02 = false;
+    for(unsigned i = 0; i < tree.size(); i++)
+    {
+        BOOST_CHECK(tree[i].from < tree[i].to);
+        if(tree[i].from == 1 && tree[i].to == 2)
+        {
+            found_12 = true;
+            BOOST_CHECK_SMALL((tree[i].information - (1.0 / (1.0 / 10.0 + 1.0 / 100.0)) * Matrix6d::Identity()).norm(), 1e-6);
+        }
+        else if(tree[i].from == 0 && tree[i].to == 2)
+        {
+            found_02 = true;
+            BOOST_CHECK_SMALL((tree[i].information - (1.0 / (1.0 + 1.0 / 100.0)) * Matrix6d::Identity()).norm(), 1e-6);
+        }
+    }
+    BOOST_CHECK(found_12);
+    BOOST_CHECK(found_02);
+}
+
+BOOST_AUTO_TEST_CASE(single_neighbor_needs_no_constraint)
+{
+    LinearizedConstraints constraints;
+    constraints.push_back(relativeConstraint(0, 1, Matrix6d::Identity()));
+    SparsifiedConstraints tree;
+    BOOST_CHECK(sparsifyMarginal(1, constraints, tree));
+    BOOST_CHECK(tree.empty());
+}
+
+BOOST_AUTO_TEST_CASE(invalid_constraints_are_rejected)
+{
+    LinearizedConstraints constraints;
+    constraints.push_back(relativeConstraint(0, 3, Matrix6d::Identity()));
+    SparsifiedConstraints tree;
+    BOOST_CHECK(!sparsifyMarginal(2, constraints, tree));
+
+    constraints.clear();
+    constraints.push_back(relativeConstraint(1, 1, Matrix6d::Identity()));
+    BOOST_CHECK(!sparsifyMarginal(2, constraints, tree));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,78 @@
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include <stdexcept>
+#include <graph_slam/indexed_max_heap.hpp>
+
+using namespace graph_slam;
+
+BOOST_AUTO_TEST_SUITE(indexed_max_heap)
+
+BOOST_AUTO_TEST_CASE(pops_in_descending_priority)
+{
+    IndexedMaxHeap<int> heap;
+    heap.push(1, 0.5);
+    heap.push(2, 3.0);
+    heap.push(3, 1.0);
+    heap.push(4, 2.0);
+    BOOST_CHECK_EQUAL(heap.size(), 4u);
+
+    int expected[] = {2, 4, 3, 1};
+    for(unsigned i = 0; i < 4; i++)
+    {
+        BOOST_CHECK_EQUAL(heap.top(), expected[i]);
+        heap.pop();
+    }
+    BOOST_CHECK(heap.empty());
+}
+
+BOOST_AUTO_TEST_CASE(equal_priorities_prefer_the_smaller_key)
+{
+    IndexedMaxHeap<int> heap;
+    heap.push(7, 1.0);
+    heap.push(3, 1.0);
+    heap.push(5, 1.0);
+    BOOST_CHECK_EQUAL(heap.top(), 3);
+    heap.pop();
+    BOOST_CHECK_EQUAL(heap.top(), 5);
+}
+
+BOOST_AUTO_TEST_CASE(updates_and_removes_keys)
+{
+    IndexedMaxHeap<int> heap;
+    for(int i = 0; i < 10; i++)
+        heap.push(i, i);
+
+    // pushing a known key changes its priority
+    heap.push(0, 20.0);
+    BOOST_CHECK_EQUAL(heap.size(), 10u);
+    BOOST_CHECK_EQUAL(heap.top(), 0);
+    BOOST_CHECK_EQUAL(heap.topPriority(), 20.0);
+    heap.push(0, -1.0);
+    BOOST_CHECK_EQUAL(heap.top(), 9);
+
+    BOOST_CHECK(heap.remove(9));
+    BOOST_CHECK(heap.remove(4));
+    BOOST_CHECK(!heap.remove(4));
+    BOOST_CHECK(!heap.contains(4));
+    BOOST_CHECK(heap.contains(5));
+
+    int expected[] = {8, 7, 6, 5, 3, 2, 1, 0};
+    for(unsigned i = 0; i < 8; i++)
+    {
+        BOOST_CHECK_EQUAL(heap.top(), expected[i]);
+        heap.pop();
+    }
+    BOOST_CHECK(heap.empty());
+}
+
+BOOST_AUTO_TEST_CASE(empty_heap_throws_on_top)
+{
+    IndexedMaxHeap<int> heap;
+    BOOST_CHECK_THROW(heap.top(), std::runtime_error);
+    BOOST_CHECK_THROW(heap.topPriority(), std::runtime_error);
+    heap.pop();
+    BOOST_CHECK(heap.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
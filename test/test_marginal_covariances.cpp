@@ -0,0 +1,108 @@
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include <graph_slam/marginal_covariances.hpp>
+
+#include <g2o/core/block_solver.h>
+#include <g2o/core/optimization_algorithm_gauss_newton.h>
+#include <g2o/solvers/csparse/linear_solver_csparse.h>
+#include <g2o/types/slam3d/edge_se3.h>
+#include <g2o/types/slam3d/vertex_se3.h>
+
+using namespace graph_slam;
+
+/** Chain of vertices with identity poses and measurements, the first vertex is fixed */
+struct ChainFixture
+{
+    typedef g2o::BlockSolver< g2o::BlockSolverTraits<6, 6> > SlamBlockSolver;
+    typedef g2o::LinearSolverCSparse<SlamBlockSolver::PoseMatrixType> SlamLinearSolver;
+
+    g2o::SparseOptimizer graph;
+
+    ChainFixture()
+    {
+        graph.setAlgorithm(new g2o::OptimizationAlgorithmGaussNewton(new SlamBlockSolver(new SlamLinearSolver())));
+        for(int i = 0; i < 3; i++)
+            addVertex(i, i == 0);
+        addEdge(0, 1);
+        addEdge(1, 2);
+        graph.initializeOptimization();
+        graph.optimize(1);
+    }
+
+    void addVertex(int id, bool fixed = false)
+    {
+        g2o::VertexSE3* vertex = new g2o::VertexSE3();
+        vertex->setId(id);
+        vertex->setFixed(fixed);
+        vertex->setEstimate(Eigen::Isometry3d::Identity());
+        graph.addVertex(vertex);
+    }
+
+    void addEdge(int source_id, int target_id)
+    {
+        g2o::EdgeSE3* edge = new g2o::EdgeSE3();
+        edge->vertices()[0] = graph.vertex(source_id);
+        edge->vertices()[1] = graph.vertex(target_id);
+        edge->setMeasurement(Eigen::Isometry3d::Identity());
+        edge->setInformation(Matrix6d::Identity());
+        graph.addEdge(edge);
+    }
+};
+
+BOOST_FIXTURE_TEST_SUITE(marginal_covariances, ChainFixture)
+
+BOOST_AUTO_TEST_CASE(covariances_of_a_chain)
+{
+    MarginalCovariances marginals(graph);
+    Matrix6d covariance;
+    BOOST_REQUIRE(marginals.getCovariance(covariance, 1));
+    BOOST_CHECK_SMALL((covariance - Matrix6d::Identity()).norm(), 1e-6);
+    BOOST_REQUIRE(marginals.getCovariance(covariance, 2));
+    BOOST_CHECK_SMALL((covariance - 2.0 * Matrix6d::Identity()).norm(), 1e-6);
+
+    // the fixed vertex has no uncertainty
+    BOOST_REQUIRE(marginals.getCovariance(covariance, 0));
+    BOOST_CHECK_SMALL(covariance.norm(), 1e-12);
+    BOOST_CHECK(!marginals.getCovariance(covariance, 5));
+
+    Matrix6d cross_covariance;
+    BOOST_REQUIRE(marginals.getCrossCovariance(cross_covariance, 2, 1));
+    BOOST_CHECK_SMALL((cross_covariance - Matrix6d::Identity()).norm(), 1e-6);
+    BOOST_REQUIRE(marginals.getCrossCovariance(cross_covariance, 0, 2));
+    BOOST_CHECK_SMALL(cross_covariance.norm(), 1e-12);
+}
+
+BOOST_AUTO_TEST_CASE(cached_blocks_are_kept_unless_outdated)
+{
+    MarginalCovariances marginals(graph);
+    std::vector<int> ids;
+    ids.push_back(1);
+    ids.push_back(2);
+    BOOST_REQUIRE(marginals.prepare(ids));
+    BOOST_CHECK_EQUAL(marginals.getComputedBlockCount(), 2u);
+    size_t revision = marginals.getRevision(2);
+    BOOST_CHECK(revision > 0);
+
+    // a new vertex attached as a leaf doesn't change the existing marginals
+    addVertex(3);
+    addEdge(2, 3);
+    std::set<int> new_vertices;
+    new_vertices.insert(3);
+    std::vector< std::pair<int, int> > new_edges(1, std::make_pair(2, 3));
+    marginals.handleNewElements(new_vertices, new_edges);
+    Matrix6d covariance;
+    BOOST_CHECK(marginals.getCachedCovariance(covariance, 2));
+    BOOST_CHECK_EQUAL(marginals.getRevision(2), revision);
+
+    // closing a loop outdates all blocks
+    addEdge(0, 2);
+    marginals.handleNewElements(std::set<int>(), std::vector< std::pair<int, int> >(1, std::make_pair(0, 2)));
+    BOOST_CHECK(!marginals.getCachedCovariance(covariance, 2));
+    BOOST_CHECK_EQUAL(marginals.getRevision(2), 0u);
+
+    marginals.invalidate(1);
+    BOOST_CHECK(!marginals.getCachedCovariance(covariance, 1));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
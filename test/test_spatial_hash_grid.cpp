@@ -0,0 +1,100 @@
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include <graph_slam/spatial_hash_grid.hpp>
+#include <graph_slam/vertex_grid.hpp>
+
+using namespace graph_slam;
+
+BOOST_AUTO_TEST_SUITE(spatial_hash_grid)
+
+BOOST_AUTO_TEST_CASE(query_returns_ids_in_range_in_ascending_order)
+{
+    SpatialHashGrid grid(1.0);
+    for(int i = 0; i < 100; i++)
+        grid.insert(i, Eigen::Vector3d(i - 50.0, 0.0, 0.0));
+    BOOST_CHECK_EQUAL(grid.size(), 100u);
+
+    // a small radius visits the cells, the distance is inclusive
+    std::vector<int> ids;
+    grid.query(Eigen::Vector3d(-0.5, 0.0, 0.0), 2.5, ids);
+    BOOST_REQUIRE_EQUAL(ids.size(), 6u);
+    for(unsigned i = 0; i < ids.size(); i++)
+        BOOST_CHECK_EQUAL(ids[i], 47 + (int)i);
+
+    // a large radius checks all entries
+    grid.query(Eigen::Vector3d(0.0, 0.0, 0.0), 1000.0, ids);
+    BOOST_REQUIRE_EQUAL(ids.size(), 100u);
+    for(unsigned i = 0; i < ids.size(); i++)
+        BOOST_CHECK_EQUAL(ids[i], (int)i);
+
+    grid.query(Eigen::Vector3d(0.0, 10.0, 0.0), 1.0, ids);
+    BOOST_CHECK(ids.empty());
+    grid.query(Eigen::Vector3d(0.0, 0.0, 0.0), -1.0, ids);
+    BOOST_CHECK(ids.empty());
+}
+
+BOOST_AUTO_TEST_CASE(insert_moves_known_ids)
+{
+    SpatialHashGrid grid(2.0);
+    grid.insert(1, Eigen::Vector3d(0.0, 0.0, 0.0));
+    grid.insert(1, Eigen::Vector3d(-10.0, -10.0, -10.0));
+    BOOST_CHECK_EQUAL(grid.size(), 1u);
+
+    std::vector<int> ids;
+    grid.query(Eigen::Vector3d(0.0, 0.0, 0.0), 1.0, ids);
+    BOOST_CHECK(ids.empty());
+    grid.query(Eigen::Vector3d(-10.0, -10.0, -9.5), 1.0, ids);
+    BOOST_REQUIRE_EQUAL(ids.size(), 1u);
+    BOOST_CHECK_EQUAL(ids[0], 1);
+
+    BOOST_CHECK(grid.remove(1));
+    BOOST_CHECK(!grid.remove(1));
+    BOOST_CHECK(!grid.contains(1));
+    grid.query(Eigen::Vector3d(-10.0, -10.0, -10.0), 1.0, ids);
+    BOOST_CHECK(ids.empty());
+}
+
+BOOST_AUTO_TEST_CASE(changing_the_cell_size_keeps_the_entries)
+{
+    SpatialHashGrid grid(1.0);
+    grid.insert(3, Eigen::Vector3d(5.0, 5.0, 0.0));
+    grid.insert(4, Eigen::Vector3d(-5.0, 5.0, 0.0));
+    grid.setCellSize(4.0);
+    BOOST_CHECK_EQUAL(grid.getCellSize(), 4.0);
+    BOOST_CHECK_EQUAL(grid.size(), 2u);
+
+    std::vector<int> ids;
+    grid.query(Eigen::Vector3d(5.0, 4.0, 0.0), 1.5, ids);
+    BOOST_REQUIRE_EQUAL(ids.size(), 1u);
+    BOOST_CHECK_EQUAL(ids[0], 3);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(vertex_grid)
+
+BOOST_AUTO_TEST_CASE(vertices_moved_out_of_the_grid_are_inserted_again)
+{
+    VertexGrid grid(10.0, 10.0, 1.0, 1);
+    BOOST_CHECK(grid.addVertex(0, Eigen::Vector3d(0.5, 0.5, 0.0)));
+    BOOST_CHECK(grid.addVertex(1, Eigen::Vector3d(0.5, 0.5, 0.0)));
+    BOOST_CHECK(!grid.moveVertex(2, Eigen::Vector3d(0.5, 0.5, 0.0)));
+
+    BOOST_CHECK(!grid.moveVertex(1, Eigen::Vector3d(100.0, 0.0, 0.0)));
+    std::vector<int> removed;
+    grid.removeVertices(removed);
+    BOOST_CHECK(removed.empty());
+
+    // back in the cell, the oldest vertex exceeds the limit
+    BOOST_CHECK(grid.moveVertex(1, Eigen::Vector3d(0.2, 0.7, 0.0)));
+    grid.removeVertices(removed);
+    BOOST_REQUIRE_EQUAL(removed.size(), 1u);
+    BOOST_CHECK_EQUAL(removed[0], 0);
+
+    BOOST_CHECK(!grid.moveVertex(1, Eigen::Vector3d(100.0, 0.0, 0.0)));
+    BOOST_CHECK(grid.removeVertex(1));
+    BOOST_CHECK(!grid.moveVertex(1, Eigen::Vector3d(0.5, 0.5, 0.0)));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
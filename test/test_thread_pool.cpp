@@ -0,0 +1,64 @@
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include <stdexcept>
+#include <vector>
+#include <boost/bind.hpp>
+#include <graph_slam/thread_pool.hpp>
+
+using namespace graph_slam;
+
+static void countCall(std::vector<int>* calls, size_t index)
+{
+    (*calls)[index]++;
+}
+
+static void storeThreadId(std::vector<boost::thread::id>* ids, size_t index)
+{
+    (*ids)[index] = boost::this_thread::get_id();
+}
+
+static void throwOnOdd(size_t index)
+{
+    if(index % 2)
+        throw std::runtime_error("odd index");
+}
+
+BOOST_AUTO_TEST_SUITE(thread_pool)
+
+BOOST_AUTO_TEST_CASE(parallel_for_calls_each_index_once)
+{
+    ThreadPool pool(4);
+    BOOST_CHECK_EQUAL(pool.getThreadCount(), 4u);
+    std::vector<int> calls(1000, 0);
+    pool.parallelFor(calls.size(), boost::bind(&countCall, &calls, _1));
+    for(size_t i = 0; i < calls.size(); i++)
+        BOOST_CHECK_EQUAL(calls[i], 1);
+}
+
+BOOST_AUTO_TEST_CASE(single_thread_runs_on_the_calling_thread)
+{
+    ThreadPool pool(0);
+    BOOST_CHECK_EQUAL(pool.getThreadCount(), 1u);
+    std::vector<boost::thread::id> ids(10);
+    pool.parallelFor(ids.size(), boost::bind(&storeThreadId, &ids, _1));
+    for(size_t i = 0; i < ids.size(); i++)
+        BOOST_CHECK(ids[i] == boost::this_thread::get_id());
+}
+
+BOOST_AUTO_TEST_CASE(task_errors_are_rethrown)
+{
+    ThreadPool pool(3);
+    BOOST_CHECK_THROW(pool.parallelFor(10, &throwOnOdd), std::runtime_error);
+
+    // the error is reported once, the pool stays usable
+    std::vector<int> calls(10, 0);
+    pool.parallelFor(calls.size(), boost::bind(&countCall, &calls, _1));
+    for(size_t i = 0; i < calls.size(); i++)
+        BOOST_CHECK_EQUAL(calls[i], 1);
+
+    ThreadPool single(1);
+    BOOST_CHECK_THROW(single.parallelFor(2, &throwOnOdd), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_SUITE_END()